@@ -18,6 +18,48 @@ defaultgw 10.10.20.1
 # Default scrambling is enabled.
 # noscrambling
 
+# Scrambler plugin replacing the built-in scrambler, see plugins/README.
+# plugin /usr/lib/firetunnel/xor.so
+
+# Keep the keys derived from the secret file in /run/firetunnel, the next
+# tunnels started with the same secret and port map them from there.
+# keycache
+
+# Derive the keys on demand instead of keeping the key tables in memory,
+# for embedded routers short on memory.
+# lowmem
+
+# Compress the payload of the packets going out, for slow links carrying text
+# (HTTP, logs, database queries). Compressed and encrypted data is detected
+# and sent as it is.
+# lz
+
+# Number of packets processed in a single recvmmsg()/sendmmsg() system call,
+# default 32. Use 1 to disable batching.
+# batch 32
+
+# The packets of a batch going to the same destination are handed to the kernel
+# as a single UDP segmentation offload (GSO) buffer, enabled by default.
+# nogso
+
+# The datagrams coalesced by the kernel (UDP GRO) are received in a single
+# buffer, enabled by default.
+# nogro
+
+# Tap device offloads, disabled by default. The kernel passes TCP super-frames
+# up to 64KB to the program, and the program cuts them in MTU-sized packets.
+# tso
+
+# Number of worker threads, default 1. Each worker handles its own queue
+# of a multi-queue tap device. Use cpus to pin the workers on specific CPUs.
+# workers 2
+# cpus 0,1
+
+# I/O engine for the data path: epoll (default) or uring. The io_uring engine
+# keeps the tap reads and the UDP receive posted in the kernel, and submits
+# the packets in batches; it requires Linux 6.0 or newer.
+# engine uring
+
 # Run the program as a Unix daemon, disabled by default.
 # daemonize
 
@@ -25,7 +67,7 @@ defaultgw 10.10.20.1
 # noseccomp
 
 # seccomp configuration for parent and child processes if seccomp enabled
-seccomp.child    write,read,close,open,openat,writev,select,sendto,recvfrom,socket,connect,fstat,stat,getpid,mmap,munmap,mremap,sigreturn,rt_sigprocmask,exit_group,kill,wait4
+seccomp.child    write,read,close,open,openat,writev,readv,setsockopt,fcntl,io_uring_setup,io_uring_enter,io_uring_register,epoll_create1,epoll_ctl,epoll_wait,epoll_pwait,timerfd_create,timerfd_settime,sendto,recvfrom,sendmmsg,recvmmsg,clock_gettime,socket,connect,fstat,stat,getpid,mmap,munmap,mremap,sigreturn,rt_sigprocmask,exit_group,kill,wait4,clone,clone3,futex,set_robust_list,rseq,mprotect,madvise,sched_yield,sched_setaffinity,sched_getaffinity,gettid
 seccomp.parent sendto,write,read,close,open,openat,writev,ioctl,socket,connect,fstat,stat,getpid,mmap,munmap,mremap,sigreturn,rt_sigprocmask,exit_group,kill,wait4
 
 #DNS servers - not more than 16 are allowed
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+// Example scrambler plugin: the data is XOR-ed with a key picked from the scrambling
+// dictionary using the sequence number of the packet.
+//     gcc -O2 -shared -fPIC -I../src/firetunnel xor.c -o xor.so
+#include <stddef.h>
+#include <arpa/inet.h>
+#include "plugin.h"
+
+static const uint8_t *dict;
+static unsigned key_len;
+static unsigned key_max;
+
+static int xor_init(const FtKeys *keys) {
+	if (keys->key_len == 0 || keys->key_max == 0)
+		return 1;
+	dict = keys->enc;
+	key_len = keys->key_len;
+	key_max = keys->key_max;
+	return 0;
+}
+
+// XOR is its own inverse, the same function scrambles and descrambles
+static void xor_batch(FtPacket *pkt, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		const uint8_t *key = dict + (ntohs(pkt[i].hdr->seq) % key_max) * key_len;
+		uint8_t *ptr = pkt[i].data;
+		unsigned j;
+		for (j = 0; j < pkt[i].len; j++)
+			ptr[j] ^= key[j % key_len];
+	}
+}
+
+const FtPlugin firetunnel_plugin_v1 = {
+	.abi = FT_PLUGIN_ABI,
+	.name = "xor",
+	.init = xor_init,
+	.scramble = xor_batch,
+	.descramble = xor_batch
+};
@@ -147,6 +147,13 @@ int blake2b_init_param( blake2b_state *S, const blake2b_param *P );
 int blake2b_update( blake2b_state *S, const void *in, size_t inlen );
 int blake2b_final( blake2b_state *S, void *out, size_t outlen );
 
+typedef void (*blake2b_compress_fn)( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
+extern blake2b_compress_fn blake2b_compress;
+void blake2b_compress_ref( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] );
+int blake2b_key_state( uint64_t h[8], size_t outlen, const void *key, size_t keylen );
+int blake2b_init_state( blake2b_state *S, size_t outlen, const uint64_t h[8] );
+int blake2b_keyed( void *out, size_t outlen, const uint64_t h[8], const void *in, size_t inlen );
+
 int blake2sp_init( blake2sp_state *S, size_t outlen );
 int blake2sp_init_key( blake2sp_state *S, size_t outlen, const void *key, size_t keylen );
 int blake2sp_update( blake2sp_state *S, const void *in, size_t inlen );
@@ -168,7 +168,7 @@ int blake2b_init_key( blake2b_state *S, size_t outlen, const void *key, size_t k
 		G(r,7,v[ 3],v[ 4],v[ 9],v[14]); \
 	} while(0)
 
-static void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] ) {
+void blake2b_compress_ref( blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES] ) {
 	uint64_t m[16];
 	uint64_t v[16];
 	size_t i;
@@ -211,6 +211,9 @@ static void blake2b_compress( blake2b_state *S, const uint8_t block[BLAKE2B_BLOC
 #undef G
 #undef ROUND
 
+/* Compression function in use, the SIMD kernels are selected at startup */
+blake2b_compress_fn blake2b_compress = blake2b_compress_ref;
+
 int blake2b_update( blake2b_state *S, const void *pin, size_t inlen ) {
 	const unsigned char *in = (const unsigned char *)pin;
 	if( inlen > 0 ) {
@@ -286,6 +289,52 @@ int blake2b( void *out, size_t outlen, const void *in, size_t inlen, const void
 	return 0;
 }
 
+/* Chaining value after the key block of a keyed hash. The key block is always the
+   first block compressed, the result depends only on the key and the output length. */
+int blake2b_key_state( uint64_t h[8], size_t outlen, const void *key, size_t keylen ) {
+	blake2b_state S[1];
+
+	if( blake2b_init_key( S, outlen, key, keylen ) < 0 ) return -1;
+
+	blake2b_increment_counter( S, BLAKE2B_BLOCKBYTES );
+	blake2b_compress( S, S->buf );
+	memcpy( h, S->h, sizeof( S->h ) );
+	secure_zero_memory( S, sizeof( S ) );
+	return 0;
+}
+
+/* Continue a keyed hash from a state computed by blake2b_key_state(), the message goes
+   in with blake2b_update(). The message should not be empty. */
+int blake2b_init_state( blake2b_state *S, size_t outlen, const uint64_t h[8] ) {
+	if( !outlen || outlen > BLAKE2B_OUTBYTES ) return -1;
+
+	memcpy( S->h, h, sizeof( S->h ) );
+	S->t[0] = BLAKE2B_BLOCKBYTES;
+	S->t[1] = 0;
+	S->f[0] = 0;
+	S->f[1] = 0;
+	S->buflen = 0;
+	S->outlen = outlen;
+	S->last_node = 0;
+	return 0;
+}
+
+/* Keyed hash starting from a state computed by blake2b_key_state(); the result is the
+   same as blake2b() with the key. The message should not be empty. */
+int blake2b_keyed( void *out, size_t outlen, const uint64_t h[8], const void *in, size_t inlen ) {
+	blake2b_state S[1];
+
+	if ( NULL == in || 0 == inlen ) return -1;
+
+	if ( NULL == out ) return -1;
+
+	if( blake2b_init_state( S, outlen, h ) < 0 ) return -1;
+
+	blake2b_update( S, ( const uint8_t * )in, inlen );
+	blake2b_final( S, out, outlen );
+	return 0;
+}
+
 int blake2( void *out, size_t outlen, const void *in, size_t inlen, const void *key, size_t keylen ) {
 	return blake2b(out, outlen, in, inlen, key, keylen);
 }
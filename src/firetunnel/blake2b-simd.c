@@ -0,0 +1,698 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include "blake2.h"
+#include <time.h>
+
+// SIMD BLAKE2b compression functions
+// - SSE4.1: the 4x4 state matrix is kept in eight 128-bit registers, two 64-bit words
+//   each; the round structure follows the SSE code in the official BLAKE2 package
+// - AVX2: one 256-bit register per row, the four G functions of a column or diagonal
+//   step run in parallel
+// - the kernel is selected at startup based on the CPU features; every kernel is checked
+//   against the reference implementation before it is used
+// - multi-buffer hashing of a batch of packets, see blake2b_keyed_mb() below
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLAKE2_SIMD
+#endif
+
+typedef struct {
+	const char *name;
+	blake2b_compress_fn fn;
+} Blake2Kernel;
+
+// multi-buffer compression, one block in each lane set in mask
+#define MB_LANES_MAX 8
+typedef void (*mb_compress_fn)(uint64_t h[8][MB_LANES_MAX], uint64_t m[16][MB_LANES_MAX],
+			       const uint64_t *t, const uint64_t *f, unsigned mask);
+static mb_compress_fn mb_compress = NULL;	// NULL: the packets are hashed one by one
+static int mb_lanes = 1;
+
+#ifdef BLAKE2_SIMD
+static const uint64_t IV[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint8_t sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+//**********************************************************************************
+// SSE4.1
+//**********************************************************************************
+// 64-bit rotations: 32 is a dword shuffle, 24 and 16 are byte shuffles, 63 is an add and a shift
+#define SSE_ROT32(x) _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define SSE_ROT24(x) _mm_shuffle_epi8((x), r24)
+#define SSE_ROT16(x) _mm_shuffle_epi8((x), r16)
+#define SSE_ROT63(x) _mm_xor_si128(_mm_srli_epi64((x), 63), _mm_add_epi64((x), (x)))
+
+// half a G function on two columns; b0 and b1 are the message words
+#define SSE_G1(a, b, c, d, b0, b1) \
+	do { \
+		a = _mm_add_epi64(_mm_add_epi64(a, b), b0); \
+		d = SSE_ROT32(_mm_xor_si128(d, a)); \
+		c = _mm_add_epi64(c, d); \
+		b = SSE_ROT24(_mm_xor_si128(b, c)); \
+	} while (0)
+
+#define SSE_G2(a, b, c, d, b0, b1) \
+	do { \
+		a = _mm_add_epi64(_mm_add_epi64(a, b), b1); \
+		d = SSE_ROT16(_mm_xor_si128(d, a)); \
+		c = _mm_add_epi64(c, d); \
+		b = SSE_ROT63(_mm_xor_si128(b, c)); \
+	} while (0)
+
+// rotate rows 2, 3 and 4 by one, two and three words; the diagonals become columns
+#define SSE_DIAGONALIZE() \
+	do { \
+		__m128i t0 = _mm_alignr_epi8(row2h, row2l, 8); \
+		__m128i t1 = _mm_alignr_epi8(row2l, row2h, 8); \
+		row2l = t0; \
+		row2h = t1; \
+		t0 = row3l; \
+		row3l = row3h; \
+		row3h = t0; \
+		t0 = _mm_alignr_epi8(row4h, row4l, 8); \
+		t1 = _mm_alignr_epi8(row4l, row4h, 8); \
+		row4l = t1; \
+		row4h = t0; \
+	} while (0)
+
+#define SSE_UNDIAGONALIZE() \
+	do { \
+		__m128i t0 = _mm_alignr_epi8(row2l, row2h, 8); \
+		__m128i t1 = _mm_alignr_epi8(row2h, row2l, 8); \
+		row2l = t0; \
+		row2h = t1; \
+		t0 = row3l; \
+		row3l = row3h; \
+		row3h = t0; \
+		t0 = _mm_alignr_epi8(row4l, row4h, 8); \
+		t1 = _mm_alignr_epi8(row4h, row4l, 8); \
+		row4l = t1; \
+		row4h = t0; \
+	} while (0)
+
+#define SSE_MSG(i, j) _mm_set_epi64x((long long) m[s[j]], (long long) m[s[i]])
+
+#define SSE_ROUND(r) \
+	do { \
+		const uint8_t *s = sigma[r]; \
+		__m128i b0 = SSE_MSG(0, 2), b1 = SSE_MSG(1, 3); \
+		__m128i b2 = SSE_MSG(4, 6), b3 = SSE_MSG(5, 7); \
+		SSE_G1(row1l, row2l, row3l, row4l, b0, b1); \
+		SSE_G1(row1h, row2h, row3h, row4h, b2, b3); \
+		SSE_G2(row1l, row2l, row3l, row4l, b0, b1); \
+		SSE_G2(row1h, row2h, row3h, row4h, b2, b3); \
+		SSE_DIAGONALIZE(); \
+		b0 = SSE_MSG(8, 10); b1 = SSE_MSG(9, 11); \
+		b2 = SSE_MSG(12, 14); b3 = SSE_MSG(13, 15); \
+		SSE_G1(row1l, row2l, row3l, row4l, b0, b1); \
+		SSE_G1(row1h, row2h, row3h, row4h, b2, b3); \
+		SSE_G2(row1l, row2l, row3l, row4l, b0, b1); \
+		SSE_G2(row1h, row2h, row3h, row4h, b2, b3); \
+		SSE_UNDIAGONALIZE(); \
+	} while (0)
+
+__attribute__((target("sse4.1")))
+static void blake2b_compress_sse41(blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES]) {
+	const __m128i r16 = _mm_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m128i r24 = _mm_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	uint64_t m[16];
+	memcpy(m, block, sizeof(m));	// little endian
+
+	__m128i row1l = _mm_loadu_si128((const __m128i *) &S->h[0]);
+	__m128i row1h = _mm_loadu_si128((const __m128i *) &S->h[2]);
+	__m128i row2l = _mm_loadu_si128((const __m128i *) &S->h[4]);
+	__m128i row2h = _mm_loadu_si128((const __m128i *) &S->h[6]);
+	__m128i row3l = _mm_loadu_si128((const __m128i *) &IV[0]);
+	__m128i row3h = _mm_loadu_si128((const __m128i *) &IV[2]);
+	__m128i row4l = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &IV[4]),
+		_mm_loadu_si128((const __m128i *) &S->t[0]));
+	__m128i row4h = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &IV[6]),
+		_mm_loadu_si128((const __m128i *) &S->f[0]));
+	__m128i h0 = row1l, h1 = row1h, h2 = row2l, h3 = row2h;
+
+	SSE_ROUND(0);
+	SSE_ROUND(1);
+	SSE_ROUND(2);
+	SSE_ROUND(3);
+	SSE_ROUND(4);
+	SSE_ROUND(5);
+	SSE_ROUND(6);
+	SSE_ROUND(7);
+	SSE_ROUND(8);
+	SSE_ROUND(9);
+	SSE_ROUND(10);
+	SSE_ROUND(11);
+
+	row1l = _mm_xor_si128(_mm_xor_si128(row3l, row1l), h0);
+	row1h = _mm_xor_si128(_mm_xor_si128(row3h, row1h), h1);
+	row2l = _mm_xor_si128(_mm_xor_si128(row4l, row2l), h2);
+	row2h = _mm_xor_si128(_mm_xor_si128(row4h, row2h), h3);
+	_mm_storeu_si128((__m128i *) &S->h[0], row1l);
+	_mm_storeu_si128((__m128i *) &S->h[2], row1h);
+	_mm_storeu_si128((__m128i *) &S->h[4], row2l);
+	_mm_storeu_si128((__m128i *) &S->h[6], row2h);
+}
+
+//**********************************************************************************
+// AVX2
+//**********************************************************************************
+#define AVX_ROT32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define AVX_ROT24(x) _mm256_shuffle_epi8((x), r24)
+#define AVX_ROT16(x) _mm256_shuffle_epi8((x), r16)
+#define AVX_ROT63(x) _mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+
+// four G functions in parallel, b0 and b1 are the message words
+#define AVX_G(b0, b1) \
+	do { \
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), b0); \
+		d = AVX_ROT32(_mm256_xor_si256(d, a)); \
+		c = _mm256_add_epi64(c, d); \
+		b = AVX_ROT24(_mm256_xor_si256(b, c)); \
+		a = _mm256_add_epi64(_mm256_add_epi64(a, b), b1); \
+		d = AVX_ROT16(_mm256_xor_si256(d, a)); \
+		c = _mm256_add_epi64(c, d); \
+		b = AVX_ROT63(_mm256_xor_si256(b, c)); \
+	} while (0)
+
+#define AVX_MSG(i, j, k, l) \
+	_mm256_set_epi64x((long long) m[s[l]], (long long) m[s[k]], (long long) m[s[j]], (long long) m[s[i]])
+
+#define AVX_ROUND(r) \
+	do { \
+		const uint8_t *s = sigma[r]; \
+		AVX_G(AVX_MSG(0, 2, 4, 6), AVX_MSG(1, 3, 5, 7)); \
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1)); \
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3)); \
+		AVX_G(AVX_MSG(8, 10, 12, 14), AVX_MSG(9, 11, 13, 15)); \
+		b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3)); \
+		c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+		d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1)); \
+	} while (0)
+
+__attribute__((target("avx2")))
+static void blake2b_compress_avx2(blake2b_state *S, const uint8_t block[BLAKE2B_BLOCKBYTES]) {
+	const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	uint64_t m[16];
+	memcpy(m, block, sizeof(m));	// little endian
+
+	__m256i a = _mm256_loadu_si256((const __m256i *) &S->h[0]);
+	__m256i b = _mm256_loadu_si256((const __m256i *) &S->h[4]);
+	__m256i c = _mm256_loadu_si256((const __m256i *) &IV[0]);
+	__m256i d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &IV[4]),
+		_mm256_set_epi64x((long long) S->f[1], (long long) S->f[0], (long long) S->t[1], (long long) S->t[0]));
+	__m256i h0 = a, h1 = b;
+
+	AVX_ROUND(0);
+	AVX_ROUND(1);
+	AVX_ROUND(2);
+	AVX_ROUND(3);
+	AVX_ROUND(4);
+	AVX_ROUND(5);
+	AVX_ROUND(6);
+	AVX_ROUND(7);
+	AVX_ROUND(8);
+	AVX_ROUND(9);
+	AVX_ROUND(10);
+	AVX_ROUND(11);
+
+	_mm256_storeu_si256((__m256i *) &S->h[0], _mm256_xor_si256(_mm256_xor_si256(a, c), h0));
+	_mm256_storeu_si256((__m256i *) &S->h[4], _mm256_xor_si256(_mm256_xor_si256(b, d), h1));
+}
+
+//**********************************************************************************
+// Multi-buffer
+//**********************************************************************************
+// One packet in each 64-bit lane: 4 packets with AVX2, 8 with AVX-512. The state and the
+// message words are transposed, word j of all the lanes goes in the same vector. The lanes
+// without a block in the current step are masked, their state is not updated.
+#define MB_G(a, b, c, d, x, y) \
+	do { \
+		v[a] = VADD(VADD(v[a], v[b]), VLOAD(m[s[x]])); \
+		v[d] = VROT32(VXOR(v[d], v[a])); \
+		v[c] = VADD(v[c], v[d]); \
+		v[b] = VROT24(VXOR(v[b], v[c])); \
+		v[a] = VADD(VADD(v[a], v[b]), VLOAD(m[s[y]])); \
+		v[d] = VROT16(VXOR(v[d], v[a])); \
+		v[c] = VADD(v[c], v[d]); \
+		v[b] = VROT63(VXOR(v[b], v[c])); \
+	} while (0)
+
+#define MB_ROUNDS() \
+	do { \
+		int r; \
+		for (r = 0; r < 12; r++) { \
+			const uint8_t *s = sigma[r]; \
+			MB_G(0, 4, 8, 12, 0, 1); \
+			MB_G(1, 5, 9, 13, 2, 3); \
+			MB_G(2, 6, 10, 14, 4, 5); \
+			MB_G(3, 7, 11, 15, 6, 7); \
+			MB_G(0, 5, 10, 15, 8, 9); \
+			MB_G(1, 6, 11, 12, 10, 11); \
+			MB_G(2, 7, 8, 13, 12, 13); \
+			MB_G(3, 4, 9, 14, 14, 15); \
+		} \
+	} while (0)
+
+#define VADD(a, b) _mm256_add_epi64((a), (b))
+#define VXOR(a, b) _mm256_xor_si256((a), (b))
+#define VLOAD(p) _mm256_load_si256((const __m256i *) (p))
+#define VROT32(x) AVX_ROT32(x)
+#define VROT24(x) AVX_ROT24(x)
+#define VROT16(x) AVX_ROT16(x)
+#define VROT63(x) AVX_ROT63(x)
+__attribute__((target("avx2")))
+static void mb_compress_avx2(uint64_t h[8][MB_LANES_MAX], uint64_t m[16][MB_LANES_MAX],
+			     const uint64_t *t, const uint64_t *f, unsigned mask) {
+	const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	__m256i v[16];
+	int i;
+	for (i = 0; i < 8; i++) {
+		v[i] = VLOAD(h[i]);
+		v[i + 8] = _mm256_set1_epi64x((long long) IV[i]);
+	}
+	v[12] = VXOR(v[12], VLOAD(t));
+	v[14] = VXOR(v[14], VLOAD(f));
+
+	MB_ROUNDS();
+
+	__m256i keep = _mm256_set_epi64x((mask & 8)? -1: 0, (mask & 4)? -1: 0, (mask & 2)? -1: 0, (mask & 1)? -1: 0);
+	for (i = 0; i < 8; i++) {
+		__m256i old = VLOAD(h[i]);
+		__m256i new = VXOR(VXOR(old, v[i]), v[i + 8]);
+		_mm256_store_si256((__m256i *) h[i], _mm256_blendv_epi8(old, new, keep));
+	}
+}
+#undef VADD
+#undef VXOR
+#undef VLOAD
+#undef VROT32
+#undef VROT24
+#undef VROT16
+#undef VROT63
+
+#define VADD(a, b) _mm512_add_epi64((a), (b))
+#define VXOR(a, b) _mm512_xor_si512((a), (b))
+#define VLOAD(p) _mm512_load_si512((const void *) (p))
+#define VROT32(x) _mm512_ror_epi64((x), 32)
+#define VROT24(x) _mm512_ror_epi64((x), 24)
+#define VROT16(x) _mm512_ror_epi64((x), 16)
+#define VROT63(x) _mm512_ror_epi64((x), 63)
+__attribute__((target("avx512f")))
+static void mb_compress_avx512(uint64_t h[8][MB_LANES_MAX], uint64_t m[16][MB_LANES_MAX],
+			       const uint64_t *t, const uint64_t *f, unsigned mask) {
+	__m512i v[16];
+	int i;
+	for (i = 0; i < 8; i++) {
+		v[i] = VLOAD(h[i]);
+		v[i + 8] = _mm512_set1_epi64((long long) IV[i]);
+	}
+	v[12] = VXOR(v[12], VLOAD(t));
+	v[14] = VXOR(v[14], VLOAD(f));
+
+	MB_ROUNDS();
+
+	for (i = 0; i < 8; i++) {
+		__m512i old = VLOAD(h[i]);
+		__m512i new = VXOR(VXOR(old, v[i]), v[i + 8]);
+		_mm512_store_si512((void *) h[i], _mm512_mask_mov_epi64(old, (__mmask8) mask, new));
+	}
+}
+#undef VADD
+#undef VXOR
+#undef VLOAD
+#undef VROT32
+#undef VROT24
+#undef VROT16
+#undef VROT63
+#endif // BLAKE2_SIMD
+
+// Hash up to MB_LANES_MAX packets in parallel, see blake2b_keyed_mb()
+static void mb_hash(uint8_t **out, size_t outlen, const uint64_t **h, uint8_t **in, const unsigned *inlen, int n) {
+	uint64_t H[8][MB_LANES_MAX] __attribute__((aligned(64)));
+	uint64_t M[16][MB_LANES_MAX] __attribute__((aligned(64)));
+	uint64_t T[MB_LANES_MAX] __attribute__((aligned(64)));
+	uint64_t F[MB_LANES_MAX] __attribute__((aligned(64)));
+	uint8_t pad[BLAKE2B_BLOCKBYTES];
+	unsigned blocks[MB_LANES_MAX];
+	unsigned max = 0;
+	memset(H, 0, sizeof(H));
+	memset(M, 0, sizeof(M));
+	memset(T, 0, sizeof(T));
+	memset(F, 0, sizeof(F));
+
+	int l, j;
+	for (l = 0; l < n; l++) {
+		for (j = 0; j < 8; j++)
+			H[j][l] = h[l][j];
+		blocks[l] = (inlen[l] + BLAKE2B_BLOCKBYTES - 1) / BLAKE2B_BLOCKBYTES;
+		if (blocks[l] > max)
+			max = blocks[l];
+	}
+
+	// the counter starts after the key block, the last block is zero-padded
+	unsigned k;
+	for (k = 0; k < max; k++) {
+		unsigned mask = 0;
+		for (l = 0; l < n; l++) {
+			if (k >= blocks[l])
+				continue;
+			mask |= 1U << l;
+			unsigned offset = k * BLAKE2B_BLOCKBYTES;
+			unsigned len = inlen[l] - offset;
+			const uint8_t *ptr = in[l] + offset;
+			if (len < BLAKE2B_BLOCKBYTES) {
+				memset(pad, 0, sizeof(pad));
+				memcpy(pad, ptr, len);
+				ptr = pad;
+			}
+			else
+				len = BLAKE2B_BLOCKBYTES;
+			for (j = 0; j < 16; j++)
+				memcpy(&M[j][l], ptr + j * 8, 8);	// little endian
+			T[l] = BLAKE2B_BLOCKBYTES + offset + len;
+			F[l] = (k == blocks[l] - 1)? ~0ULL: 0;
+		}
+		mb_compress(H, M, T, F, mask);
+	}
+
+	for (l = 0; l < n; l++) {
+		uint64_t tag[8];
+		for (j = 0; j < 8; j++)
+			tag[j] = H[j][l];
+		memcpy(out[l], tag, outlen);
+	}
+}
+
+// return 1 if the packets of a batch are hashed in parallel
+int blake2b_mb_enabled(void) {
+	return mb_compress != NULL;
+}
+
+// Keyed hash of n packets, each one starting from a state computed by blake2b_key_state().
+// The result is the same as blake2b_keyed(); the packets should not be empty.
+void blake2b_keyed_mb(uint8_t **out, size_t outlen, const uint64_t **h, uint8_t **in, const unsigned *inlen, int n) {
+	assert(outlen <= BLAKE2B_OUTBYTES);
+	int i = 0;
+	while (i < n) {
+		int cnt = n - i;
+		if (cnt > mb_lanes)
+			cnt = mb_lanes;
+		if (cnt == 1) {
+			if (blake2b_keyed(out[i], outlen, h[i], in[i], inlen[i]))
+				errExit("blake2");
+		}
+		else
+			mb_hash(out + i, outlen, h + i, in + i, inlen + i, cnt);
+		i += cnt;
+	}
+}
+
+//**********************************************************************************
+// Runtime selection
+//**********************************************************************************
+// Known answers from RFC 7693 and the BLAKE2 reference code
+static const uint8_t kat_abc[BLAKE2B_OUTBYTES] = {	// BLAKE2b-512("abc")
+	0xba, 0x80, 0xa5, 0x3f, 0x98, 0x1c, 0x4d, 0x0d, 0x6a, 0x27, 0x97, 0xb6, 0x9f, 0x12, 0xf6, 0xe9,
+	0x4c, 0x21, 0x2f, 0x14, 0x68, 0x5a, 0xc4, 0xb7, 0x4b, 0x12, 0xbb, 0x6f, 0xdb, 0xff, 0xa2, 0xd1,
+	0x7d, 0x87, 0xc5, 0x39, 0x2a, 0xab, 0x79, 0x2d, 0xc2, 0x52, 0xd5, 0xde, 0x45, 0x33, 0xcc, 0x95,
+	0x18, 0xd3, 0x8a, 0xa8, 0xdb, 0xf1, 0x92, 0x5a, 0xb9, 0x23, 0x86, 0xed, 0xd4, 0x00, 0x99, 0x23
+};
+static const uint8_t kat_keyed[KEY_LEN] = {	// key 00..0f, message 00..fe, 16 bytes output
+	0x8d, 0xf5, 0x93, 0x69, 0xb5, 0xc6, 0x3b, 0x87, 0x29, 0x7f, 0x20, 0x95, 0xe6, 0x0a, 0xd2, 0xc1
+};
+
+#define SELFTEST_LEN (3 * BLAKE2B_BLOCKBYTES + 1)
+#define BENCH_LEN 1500		// a full-size tunnel packet
+#define BENCH_LOOPS 2000
+
+// return 0 if the kernel produces the same hashes as the reference implementation
+static int blake2_selftest(blake2b_compress_fn fn) {
+	blake2b_compress_fn saved = blake2b_compress;
+	blake2b_compress = fn;
+	int rv = 0;
+
+	uint8_t in[SELFTEST_LEN];
+	uint8_t key[KEY_LEN];
+	uint8_t out[BLAKE2B_OUTBYTES];
+	int i;
+	for (i = 0; i < SELFTEST_LEN; i++)
+		in[i] = (uint8_t) i;
+	for (i = 0; i < KEY_LEN; i++)
+		key[i] = (uint8_t) i;
+
+	if (blake2(out, BLAKE2B_OUTBYTES, "abc", 3, NULL, 0) ||
+	    memcmp(out, kat_abc, BLAKE2B_OUTBYTES))
+		rv = -1;
+	if (blake2(out, KEY_LEN, in, 255, key, KEY_LEN) ||
+	    memcmp(out, kat_keyed, KEY_LEN))
+		rv = -1;
+
+	// all the lengths up to three blocks, the result is compared with the reference code
+	for (i = 0; i <= SELFTEST_LEN && rv == 0; i++) {
+		uint8_t ref[KEY_LEN];
+		blake2b_compress = blake2b_compress_ref;
+		blake2(ref, KEY_LEN, in, i, key, KEY_LEN);
+		blake2b_compress = fn;
+		blake2(out, KEY_LEN, in, i, key, KEY_LEN);
+		if (memcmp(out, ref, KEY_LEN))
+			rv = -1;
+	}
+
+	blake2b_compress = saved;
+	return rv;
+}
+
+// hashing speed in MB/s for packet-sized buffers
+static unsigned blake2_bench(blake2b_compress_fn fn) {
+	blake2b_compress_fn saved = blake2b_compress;
+	blake2b_compress = fn;
+
+	uint8_t in[BENCH_LEN];
+	uint8_t key[KEY_LEN];
+	uint8_t out[KEY_LEN];
+	memset(in, 0x5a, sizeof(in));
+	memset(key, 0xa5, sizeof(key));
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int i;
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		blake2(out, KEY_LEN, in, BENCH_LEN, key, KEY_LEN);
+		in[0] = out[0];	// keep the compiler honest
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	blake2b_compress = saved;
+	double usec = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+	if (usec < 1)
+		usec = 1;
+	return (unsigned) ((double) BENCH_LEN * BENCH_LOOPS / usec);
+}
+
+#define MB_TEST_CNT 19	// a few lanes left over in the last group
+#define MB_BENCH_CNT 64
+#define MB_BENCH_LEN 64	// TCP ACK, VoIP
+#define MB_BENCH_LOOPS 500
+
+// return 0 if the multi-buffer kernel gives the same tags as blake2b_keyed()
+static int mb_selftest(mb_compress_fn fn, int lanes) {
+	uint64_t h[8];
+	uint8_t key[KEY_LEN];
+	int i;
+	for (i = 0; i < KEY_LEN; i++)
+		key[i] = (uint8_t) (i * 7);
+	blake2b_key_state(h, KEY_LEN, key, KEY_LEN);
+
+	// lengths from 1 byte to a few blocks
+	static uint8_t data[MB_TEST_CNT][4 * BLAKE2B_BLOCKBYTES];
+	uint8_t tags[MB_TEST_CNT][KEY_LEN];
+	uint8_t *in[MB_TEST_CNT], *out[MB_TEST_CNT];
+	const uint64_t *hp[MB_TEST_CNT];
+	unsigned len[MB_TEST_CNT];
+	for (i = 0; i < MB_TEST_CNT; i++) {
+		unsigned j;
+		len[i] = 1 + (i * 97) % sizeof(data[i]);
+		for (j = 0; j < len[i]; j++)
+			data[i][j] = (uint8_t) (i + j * 13);
+		in[i] = data[i];
+		out[i] = tags[i];
+		hp[i] = h;
+	}
+
+	mb_compress_fn saved_fn = mb_compress;
+	int saved_lanes = mb_lanes;
+	mb_compress = fn;
+	mb_lanes = lanes;
+	blake2b_keyed_mb(out, KEY_LEN, hp, in, len, MB_TEST_CNT);
+	mb_compress = saved_fn;
+	mb_lanes = saved_lanes;
+
+	for (i = 0; i < MB_TEST_CNT; i++) {
+		uint8_t ref[KEY_LEN];
+		blake2b_keyed(ref, KEY_LEN, h, in[i], len[i]);
+		if (memcmp(ref, tags[i], KEY_LEN))
+			return -1;
+	}
+	return 0;
+}
+
+// nanoseconds per packet for a batch of small packets
+static unsigned mb_bench(mb_compress_fn fn, int lanes) {
+	uint64_t h[8];
+	uint8_t key[KEY_LEN];
+	memset(key, 0xa5, sizeof(key));
+	blake2b_key_state(h, KEY_LEN, key, KEY_LEN);
+
+	static uint8_t data[MB_BENCH_CNT][MB_BENCH_LEN];
+	static uint8_t tags[MB_BENCH_CNT][KEY_LEN];
+	uint8_t *in[MB_BENCH_CNT], *out[MB_BENCH_CNT];
+	const uint64_t *hp[MB_BENCH_CNT];
+	unsigned len[MB_BENCH_CNT];
+	int i;
+	for (i = 0; i < MB_BENCH_CNT; i++) {
+		in[i] = data[i];
+		out[i] = tags[i];
+		hp[i] = h;
+		len[i] = MB_BENCH_LEN;
+	}
+
+	mb_compress_fn saved_fn = mb_compress;
+	int saved_lanes = mb_lanes;
+	mb_compress = fn;
+	mb_lanes = lanes;
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < MB_BENCH_LOOPS; i++) {
+		blake2b_keyed_mb(out, KEY_LEN, hp, in, len, MB_BENCH_CNT);
+		data[0][0] = tags[0][0];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	mb_compress = saved_fn;
+	mb_lanes = saved_lanes;
+
+	double nsec = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	return (unsigned) (nsec / (MB_BENCH_LOOPS * MB_BENCH_CNT));
+}
+
+// Select the multi-buffer kernel; it is used only if it beats hashing the packets one by one.
+static void mb_select(void) {
+#ifdef BLAKE2_SIMD
+	const char *name = NULL;
+	mb_compress_fn fn = NULL;
+	int lanes = 1;
+	if (__builtin_cpu_supports("avx512f") && mb_selftest(mb_compress_avx512, 8) == 0) {
+		name = "avx512";
+		fn = mb_compress_avx512;
+		lanes = 8;
+	}
+	else if (__builtin_cpu_supports("avx2") && mb_selftest(mb_compress_avx2, 4) == 0) {
+		name = "avx2";
+		fn = mb_compress_avx2;
+		lanes = 4;
+	}
+	if (!fn)
+		return;
+
+	unsigned single = mb_bench(NULL, 1);
+	unsigned multi = mb_bench(fn, lanes);
+	if (multi < single) {
+		mb_compress = fn;
+		mb_lanes = lanes;
+	}
+	logmsg("BLAKE2b multi-buffer %s, %d lanes, %s (%d-byte packets: %u ns single, %u ns multi-buffer)\n",
+	       name, lanes, (mb_compress)? "enabled": "disabled", MB_BENCH_LEN, single, multi);
+#endif
+}
+
+// Select the fastest compression function supported by the CPU. The kernels failing
+// the self-test are not used.
+void blake2_select(void) {
+	Blake2Kernel kernels[3];
+	int cnt = 0;
+	kernels[cnt].name = "ref";
+	kernels[cnt++].fn = blake2b_compress_ref;
+#ifdef BLAKE2_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		kernels[cnt].name = "sse4.1";
+		kernels[cnt++].fn = blake2b_compress_sse41;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[cnt].name = "avx2";
+		kernels[cnt++].fn = blake2b_compress_avx2;
+	}
+#endif
+
+	if (blake2_selftest(blake2b_compress_ref)) {
+		fprintf(stderr, "Error: BLAKE2b self-test failed\n");
+		exit(1);
+	}
+
+	char msg[128];
+	char *ptr = msg;
+	*ptr = '\0';
+	int best = 0;
+	unsigned best_speed = 0;
+	int i;
+	for (i = 0; i < cnt; i++) {
+		if (i && blake2_selftest(kernels[i].fn)) {
+			fprintf(stderr, "Warning: BLAKE2b %s self-test failed, kernel disabled\n", kernels[i].name);
+			continue;
+		}
+
+		unsigned speed = blake2_bench(kernels[i].fn);
+		ptr += sprintf(ptr, "%s%s %u MB/s", (ptr == msg)? "": ", ", kernels[i].name, speed);
+		if (speed > best_speed) {
+			best_speed = speed;
+			best = i;
+		}
+	}
+
+	blake2b_compress = kernels[best].fn;
+	logmsg("BLAKE2b kernel %s (%s)\n", kernels[best].name, msg);
+	mb_select();
+}
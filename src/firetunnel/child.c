@@ -18,11 +18,95 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 #include "firetunnel.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <linux/virtio_net.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #define STATS_TIMEOUT_MAX 6	// print stats every STATS_TIMEOUT_MAX * TIMEOUT
-static int statscnt = 0;
 #define COMPRESS_TIMEOUT_MAX (STATS_TIMEOUT_MAX)
-static int compresscnt = 0;
+static const int hlen = sizeof(PacketHeader);
+
+// UDP_SEGMENT and UDP_GRO control messages
+typedef union {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+} GsoCtl;
+
+// Worker threads
+// - one worker for each tap queue; worker 0 runs in the main thread of the child process
+//   and it also handles the timers
+// - a worker sends its packets on its own tunnel lane; the lane goes in the packet
+//   header flags, and it selects the header compression tables on both sides
+// - each worker has its own UDP socket, the incoming packets are steered on the lane
+//   (see net_udp_steering() in network.c)
+// - the connection state is shared by all workers, changes are serialized with state_lock
+typedef struct worker_t {
+	int id;			// also the lane of the packets sent by this worker
+	pthread_t thread;
+	int tapfd;		// tap queue
+	int udpfd;		// UDP socket
+	int gso;		// UDP segmentation offload enabled on udpfd
+	int gro;		// UDP receive coalescing enabled on udpfd
+	int socket;		// unix socket connected to the parent
+
+	// event loop
+	int epfd;
+	uint32_t tap_events;	// epoll events currently enabled for tapfd
+	uint32_t udp_events;	// epoll events currently enabled for udpfd
+
+	// bounded queues, one for each direction
+	Queue tapq;		// Ethernet frames waiting to be written to the tap device
+	Queue udpq;		// tunnel packets waiting to be sent on the UDP socket
+	unsigned udpq_signed;	// entries at the head of udpq with the BLAKE2 tag in place
+	int fused;		// packets scrambled and hashed one at a time in a single pass
+
+	// packet buffers for the queues, the control packets and the io_uring engine
+	PacketPool pool;
+	UdpFrame *ctlframe;
+
+	// compression contexts found damaged in the current receive batch, see nack_flush()
+	Peer *nack_peer;
+	int nack_cnt;
+	uint8_t nack[NACK_MAX * NACK_ENTRY];
+
+	// batched I/O, arg_batch entries
+	PacketMem **rxmem;	// receive buffers used when tapq is full
+	struct mmsghdr *rxmsg;
+	struct mmsghdr *txmsg;
+	struct iovec *rxiov;
+	struct iovec *txiov;
+	struct sockaddr_in *rxaddr;
+	int *txseg;		// number of udpq entries sent in each txmsg
+	GsoCtl *txctl;
+	uint8_t **hashpkt;	// packets signed or verified in a single batch
+	unsigned *hashlen;
+	uint8_t *auth;		// pkt_verify_batch() result
+	uint8_t *grobuf;	// GRO_BUFS coalesced receive buffers
+	uint8_t *tsobuf;	// TSO super-frame read from the tap device
+#ifdef HAVE_URING
+	struct uring_engine_t *uring;	// io_uring engine, NULL with epoll
+#endif
+	Xsk *xsk;		// AF_XDP socket, NULL if not used
+	GsoCtl *rxctl;
+
+	TStats stats;
+} __attribute__((aligned(64))) Worker;
+
+static Worker workers[WORKERS_MAX];
+#ifdef HAVE_URING
+static unsigned uring_buffers(void);
+#endif
+__thread TStats *thread_stats = &workers[0].stats;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hello_timer = -1;	// HELLO retransmission and connect ttl
+static int stats_timer = -1;	// stats and compression tables
 
 static void send_config(int socket) {
 	char msg[10 + sizeof(TOverlay)];
@@ -35,299 +119,1768 @@ static void send_config(int socket) {
 		errExit("write");
 }
 
+// arm a timer to fire in first seconds, and then every interval seconds;
+// first 0 fires the timer right away
+static void timer_set(int fd, int first, int interval) {
+	struct itimerspec ts;
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = first;
+	if (first == 0)
+		ts.it_value.tv_nsec = 1;
+	ts.it_interval.tv_sec = interval;
+	if (timerfd_settime(fd, 0, &ts, NULL) == -1)
+		errExit("timerfd_settime");
+}
 
-void child(int socket) {
-	// init select loop
-	struct timeval timeout;
-	timeout.tv_sec = TIMEOUT;
-	timeout.tv_usec = 0;
-
-	// init packet storage
-	PacketMem *pktmem = malloc(sizeof(PacketMem));
-	if (!pktmem)
+static int timer_create_fd(int first, int interval) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+		errExit("timerfd_create");
+	timer_set(fd, first, interval);
+	return fd;
+}
+
+// read the expiration counter, the timer is level-triggered in epoll
+static void timer_ack(int fd) {
+	uint64_t cnt;
+	if (read(fd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+		perror("read timerfd");
+}
+
+static void epoll_add(Worker *w, int fd, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		errExit("epoll_ctl");
+}
+
+// change the events monitored on fd; current holds the events already enabled
+static void epoll_mod(Worker *w, int fd, uint32_t *current, uint32_t events) {
+	if (*current == events)
+		return;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+		errExit("epoll_ctl");
+	*current = events;
+}
+
+static void worker_init(Worker *w, int id, int socket) {
+	memset(w, 0, sizeof(Worker));
+	w->id = id;
+	w->tapfd = tunnel.tapfd[id];
+	w->udpfd = tunnel.udpfd[id];
+	w->socket = socket;
+
+	// bounded queues, room for a few batches in each direction
+	unsigned qlen = 4 * arg_batch;
+	if (qlen < QUEUE_LEN_MIN)
+		qlen = QUEUE_LEN_MIN;
+
+	// packet buffers: the two queues, the receive buffers used when tapq is full,
+	// the control packets, and the io_uring buffers
+	unsigned bufs = 2 * qlen + arg_batch + 1;
+#ifdef HAVE_URING
+	if (arg_engine == ENGINE_URING)
+		bufs += uring_buffers();
+#endif
+	pool_init(&w->pool, bufs);
+	if (id == 0)
+		dbg_printf("%u packet buffers, %lu bytes each%s\n", bufs, sizeof(PacketMem),
+			   (w->pool.huge)? ", hugepages": "");
+	queue_init(&w->tapq, qlen, &w->pool);
+	queue_init(&w->udpq, qlen, &w->pool);
+	w->ctlframe = &pool_get(&w->pool)->f;
+
+	w->rxmem = malloc(arg_batch * sizeof(PacketMem *));
+	w->rxmsg = malloc(arg_batch * sizeof(struct mmsghdr));
+	w->txmsg = malloc(arg_batch * sizeof(struct mmsghdr));
+	w->rxiov = malloc(arg_batch * sizeof(struct iovec));
+	w->txiov = malloc(arg_batch * sizeof(struct iovec));
+	w->rxaddr = malloc(arg_batch * sizeof(struct sockaddr_in));
+	w->txseg = malloc(arg_batch * sizeof(int));
+	w->txctl = malloc(arg_batch * sizeof(GsoCtl));
+	w->hashpkt = malloc(arg_batch * sizeof(uint8_t *));
+	w->hashlen = malloc(arg_batch * sizeof(unsigned));
+	w->auth = malloc(arg_batch);
+	if (!w->rxmem || !w->rxmsg || !w->txmsg || !w->rxiov || !w->txiov || !w->rxaddr ||
+	    !w->txseg || !w->txctl || !w->hashpkt || !w->hashlen || !w->auth)
 		errExit("malloc");
-	memset(pktmem, 0, sizeof(PacketMem));
-	UdpFrame *udpframe = &pktmem->f;
-	int hlen = sizeof(PacketHeader);
 
-	if (!arg_server) {
-		pkt_send_hello(udpframe, tunnel.udpfd);
-		printf("Connecting..."); fflush(0);
-		timeout.tv_sec = 2;
+	// the single pass is faster unless the packets are hashed in parallel
+	w->fused = scramble_fused &&
+		(arg_engine == ENGINE_URING || arg_batch == 1 || !blake2b_mb_enabled());
+	if (id == 0)
+		dbg_printf("single-pass scramble and BLAKE2 %s\n", (w->fused)? "enabled": "disabled");
+	int i;
+	for (i = 0; i < arg_batch; i++)
+		w->rxmem[i] = pool_get(&w->pool);
+	memset(w->rxmsg, 0, arg_batch * sizeof(struct mmsghdr));
+	memset(w->txmsg, 0, arg_batch * sizeof(struct mmsghdr));
+	memset(w->txctl, 0, arg_batch * sizeof(GsoCtl));
+
+	// send the packets of a batch in UDP_SEGMENT buffers if the kernel supports it
+	if (arg_batch > 1 && !arg_nogso)
+		w->gso = net_udp_gso(w->udpfd);
+	if (id == 0)
+		dbg_printf("UDP segmentation offload %s\n", (w->gso)? "enabled": "disabled");
+
+	// receive coalesced datagrams; the io_uring engine receives single datagrams
+	if (arg_batch > 1 && !arg_nogro && arg_engine != ENGINE_URING)
+		w->gro = net_udp_gro(w->udpfd);
+	if (w->gro) {
+		w->grobuf = malloc(GRO_BUFS * GRO_BYTES);
+		w->rxctl = malloc(GRO_BUFS * sizeof(GsoCtl));
+		if (!w->grobuf || !w->rxctl)
+			errExit("malloc");
 	}
+	if (id == 0)
+		dbg_printf("UDP receive coalescing %s\n", (w->gro)? "enabled": "disabled");
 
-	// select loop
-	while (1) {
-		fd_set set;
-		FD_ZERO (&set);
-		int nfds = 0;
-		FD_SET(tunnel.tapfd, &set);
-		nfds = (tunnel.tapfd > nfds) ? tunnel.tapfd : nfds;
-		FD_SET(tunnel.udpfd, &set);
-		nfds = (tunnel.udpfd > nfds) ? tunnel.udpfd : nfds;
+	if (arg_tso) {
+		w->tsobuf = malloc(TSO_BYTES);
+		if (!w->tsobuf)
+			errExit("malloc");
+	}
+
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd == -1)
+		errExit("epoll_create1");
+	w->tap_events = EPOLLIN;
+	epoll_add(w, w->tapfd, w->tap_events);
+	w->udp_events = EPOLLIN;
+	epoll_add(w, w->udpfd, w->udp_events);
+	w->xsk = tunnel.xsk[id];
+	if (w->xsk)
+		epoll_add(w, w->xsk->fd, EPOLLIN);
+
+	// the timers are handled by worker 0
+	if (id == 0) {
+		// a disconnected client tries every 2 seconds
+		if (arg_server)
+			hello_timer = timer_create_fd(TIMEOUT, TIMEOUT);
+		else
+			hello_timer = timer_create_fd(2, 2);
+		stats_timer = timer_create_fd(STATS_TIMEOUT_MAX * TIMEOUT, STATS_TIMEOUT_MAX * TIMEOUT);
+		epoll_add(w, hello_timer, EPOLLIN);
+		epoll_add(w, stats_timer, EPOLLIN);
+	}
+}
+
+// add up the worker counters in tunnel.stats
+static void stats_collect(void) {
+	unsigned *dst = (unsigned *) &tunnel.stats;
+	memset(dst, 0, sizeof(TStats));
+
+	int i;
+	for (i = 0; i < arg_workers; i++) {
+		unsigned *src = (unsigned *) &workers[i].stats;
+		unsigned j;
+		for (j = 0; j < sizeof(TStats) / sizeof(unsigned); j++)
+			dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+	}
+}
+
+// Filter the frames read from the tap device; return 1 if the frame can go in the tunnel.
+static int frame_check(Worker *w, uint8_t *eth, int nbytes) {
+	dbg_printf("\ntap rx %d ", nbytes);
+
+	// eth header size of 14
+	if (nbytes <= 14) {
+		dbg_printf("error < 14\n");
+		return 0;
+	}
+	if (pkt_is_ipv6(eth, nbytes)) {
+		dbg_printf("ipv6 drop\n");
+		return 0;
+	}
+	if (pkt_is_dns_AAAA(eth, nbytes)) {
+		dbg_printf("DNS AAAA drop\n");
+		return 0;
+	}
+	if (pkt_is_dns(eth, nbytes))
+		w->stats.eth_rx_dns++;
+
+	return 1;
+}
+
+// the compression table of a data opcode
+static FlowTable *profile_table(Peer *peer, uint8_t opcode, int direction, int lane) {
+	switch (opcode) {
+	case O_DATA_COMPRESSED_L4:
+		return peer->compress_l4[direction][lane];
+	case O_DATA_COMPRESSED_UDP:
+		return peer->compress_udp[direction][lane];
+	case O_DATA_COMPRESSED_L3:
+		return peer->compress_l3[direction][lane];
+	case O_DATA_COMPRESSED_L2:
+		return peer->compress_l2[direction][lane];
+	}
+	return NULL;
+}
 
+// Build a tunnel packet for peer in place from the Ethernet frame stored in udpframe->eth.
+// Return the length of the UDP payload starting at *start, or 0 if the frame was dropped.
+// The room for the BLAKE2 tag is reserved in the tailroom, the tag is added later for the
+// whole batch, see udp_sign(). In single-pass mode, or with a scrambler plugin, the frame
+// is also scrambled there.
+static int encap_frame(Worker *w, Peer *peer, UdpFrame *udpframe, int nbytes, uint8_t **start) {
+	if (peer->state != S_CONNECTED) {
+		dbg_printf("error not connected\n");
+		return 0;
+	}
+
+	// each frame belongs to one compression profile, the first one able to parse it; the
+	// receiver finds the same profile in decap_packet()
+	int direction = (arg_server)? S2C: C2S;
+	uint8_t *eth = udpframe->eth;
+	uint8_t profile;
+	uint16_t cid;	// context id
+	int compress;
+	if (pkt_is_ip(eth, nbytes)) {
+		profile = O_DATA_COMPRESSED_L4;
+		compress = classify_l4(peer, eth, nbytes, &cid, direction, w->id);
+		if (compress < 0) {
+			profile = O_DATA_COMPRESSED_UDP;
+			compress = classify_udp(peer, eth, nbytes, &cid, direction, w->id);
+		}
+		if (compress < 0) {
+			profile = O_DATA_COMPRESSED_L3;
+			compress = classify_l3(peer, eth, &cid, direction, w->id);
+		}
+	}
+	else {
+		profile = O_DATA_COMPRESSED_L2;
+		compress = classify_l2(peer, eth, &cid, direction, w->id);
+	}
+
+	// the header is built in place, in front of the (compressed) frame
+	uint16_t seq = peer_next_seq(peer);
+	uint8_t *ethptr = eth;
+	uint8_t opcode = O_DATA;
+	if (compress) {
 		int rv;
-		if ((rv = select(nfds + 1, &set, NULL, NULL, &timeout)) < 0)
-			errExit("select");
+		if (profile == O_DATA_COMPRESSED_L4) {
+			dbg_printf("compressing L4 ");
+			rv = compress_l4(peer, eth, nbytes, cid, direction, w->id);
+			w->stats.compress_l4_saved += rv;
+		}
+		else if (profile == O_DATA_COMPRESSED_UDP) {
+			dbg_printf("compressing UDP ");
+			rv = compress_udp(peer, eth, nbytes, cid, direction, w->id);
+			w->stats.compress_udp_saved += rv;
+		}
+		else if (profile == O_DATA_COMPRESSED_L3) {
+			dbg_printf("compressing L3");
+			rv = compress_l3(peer, eth, nbytes, cid, direction, w->id);
+			w->stats.compress_l3_saved += rv;
+		}
+		else {
+			dbg_printf("compressing L2 ");
+			rv = compress_l2(peer, eth, nbytes, cid, direction, w->id);
+			w->stats.compress_l2_saved += rv;
+		}
+		if (rv) {
+			nbytes -= rv;
+			ethptr += rv;
+			opcode = profile;
 
-		if (rv == 0) {
-			timeout.tv_sec = TIMEOUT;
-			// a disconnected client tries every 2 seconds
-			if (!arg_server && tunnel.state == S_DISCONNECTED) {
-				timeout.tv_sec = 2;
-				printf("."); fflush(0);
+			// the high byte of a 16-bit context id goes in front of the compressed header
+			if (cid > 0xff) {
+				*--ethptr = cid >> 8;
+				nbytes++;
 			}
-			timeout.tv_usec = 0;
-			logcnt = 0;
-
-			// send HELLO packet
-			// the client always sends it, regardless of the connection status
-			if (tunnel.state == S_CONNECTED || !arg_server) {
-				dbg_printf("\ntunnel tx hello ");
-				pkt_send_hello(udpframe, tunnel.udpfd);
-				dbg_printf("\n");
+		}
+		else
+			compress = 0;	// the context is gone, the full header goes out
+	}
+	if (cid > 0xff) {
+		// a full header: the high byte replaces the high byte of the IPv4 ethertype, the L2
+		// profile doesn't go above 255
+		if (!compress)
+			eth[12] = cid >> 8;
+		opcode += O_DATA_CID16 - O_DATA;
+	}
+
+	// payload compression, the opcode of the profile goes in front of the compressed frame
+	if (arg_lz) {
+		int rv = lz_encode(peer, profile_table(peer, profile, direction, w->id), cid,
+				   ethptr, nbytes, opcode, direction, w->id);
+		if (rv) {
+			dbg_printf("lz %d -> %d ", nbytes, rv);
+			nbytes = rv;
+			opcode = O_DATA_LZ;
+		}
+	}
+
+	PacketHeader *hdr = (PacketHeader *) (ethptr - hlen);
+	pkt_set_header(hdr, opcode, seq);
+	hdr->sid = (uint8_t) cid;
+	hdr->flags |= w->id << F_LANE_SHIFT;
+
+	if (!w->fused && !arg_plugin)
+		scramble(ethptr, nbytes, hdr);
+	peer_stats_add(&peer->stats.tx_pkt, 1);
+
+	*start = ethptr - hlen;
+	return nbytes + hlen + KEY_LEN;
+}
+
+// HELLO packet received, called with state_lock held
+static void hello_rx(Worker *w, Peer *peer, UdpFrame *udpframe) {
+	dbg_printf("hello ");
+
+	if (peer->state == S_DISCONNECTED) {
+		peer->state = S_CONNECTED;
+		peer->seq = 0;
+		logmsg("%d.%d.%d.%d:%d connected\n",
+		       PRINT_IP(ntohl(peer->addr.sin_addr.s_addr)),
+		       ntohs(peer->addr.sin_port));
+		compress_l2_init(peer);
+		compress_l3_init(peer);
+		compress_l4_init(peer);
+		compress_udp_init(peer);
+
+		// force a hello out to the client
+		if (arg_server)
+			pkt_send_hello(peer, w->ctlframe, w->udpfd);
+		else {
+			printf("\n");
+			timer_set(hello_timer, TIMEOUT, TIMEOUT);
+		}
+	}
+	else if (udpframe->header.flags & F_SYNC) {
+		// the other end starts a new session, its contexts are new
+		logmsg("sync requested by %d.%d.%d.%d:%d\n",
+		       PRINT_IP(ntohl(peer->addr.sin_addr.s_addr)),
+		       ntohs(peer->addr.sin_port));
+		compress_l2_init(peer);
+		compress_l3_init(peer);
+		compress_l4_init(peer);
+		compress_udp_init(peer);
+	}
+	peer->connect_ttl = CONNECT_TTL;
+
+	// update overlay data if we are the client
+	if (!arg_server) {
+		descramble(udpframe->eth, 7 * sizeof(uint32_t), &udpframe->header);
+
+		uint32_t *ptr = (uint32_t *) &udpframe->eth[0];
+		TOverlay o;
+		o.netaddr = ntohl(*ptr++);
+		o.netmask = ntohl(*ptr++);
+		o.defaultgw = ntohl(*ptr++);
+		o.mtu = ntohl(*ptr++);
+		o.dns1 = ntohl(*ptr++);
+		o.dns2 = ntohl(*ptr++);
+		o.dns3 = ntohl(*ptr++);
+
+		if (memcmp(&tunnel.overlay, &o, sizeof(TOverlay))) {
+			memcpy(&tunnel.overlay, &o, sizeof(TOverlay));
+			logmsg("Tunnel: %d.%d.%d.%d/%d, default gw %d.%d.%d.%d, mtu %d\n",
+			       PRINT_IP(tunnel.overlay.netaddr), mask2bits(tunnel.overlay.netmask),
+			       PRINT_IP(tunnel.overlay.defaultgw), tunnel.overlay.mtu);
+			logmsg("Tunnel: DNS %d.%d.%d.%d, %d.%d.%d.%d, %d.%d.%d.%d\n",
+			       PRINT_IP(tunnel.overlay.dns1), PRINT_IP(tunnel.overlay.dns2), PRINT_IP(tunnel.overlay.dns3));
+
+			// send tunnel configuration to the parent
+			send_config(w->socket);
+		}
+	}
+	dbg_printf("\n");
+}
+
+// send the NACKs collected in the receive batch
+static void nack_flush(Worker *w) {
+	if (w->nack_cnt == 0)
+		return;
+	dbg_printf("\ntunnel tx nack %d ", w->nack_cnt);
+	pkt_send_nack(w->nack_peer, w->ctlframe, w->udpfd, w->nack, w->nack_cnt);
+	w->nack_cnt = 0;
+}
+
+// ask the peer for a full header of context cid
+static void nack_add(Worker *w, Peer *peer, uint8_t opcode, int lane, uint16_t cid) {
+	if (w->nack_cnt && (w->nack_peer != peer || w->nack_cnt == NACK_MAX))
+		nack_flush(w);
+	w->nack_peer = peer;
+	uint8_t *p = w->nack + w->nack_cnt * NACK_ENTRY;
+	p[0] = opcode;
+	p[1] = (uint8_t) lane;
+	p[2] = cid >> 8;
+	p[3] = cid & 0xff;
+	w->nack_cnt++;
+}
+
+// Process a UDP packet received from the remote end of the tunnel.
+// Return the length of the Ethernet frame starting at *start if the frame needs to be
+// written to the tap device, 0 for a control packet, -1 if the packet was dropped.
+// auth is the result of the BLAKE2 check if it was already done for the whole batch,
+// AUTH_UNKNOWN otherwise. The peer of an authenticated packet is stored in from,
+// if not NULL.
+static int decap_packet(Worker *w, UdpFrame *udpframe, int nbytes, struct sockaddr_in *client_addr,
+			int auth, uint8_t **start, Peer **from) {
+	int rv;
+
+	// update stats
+	w->stats.udp_rx_pkt++;
+	dbg_printf("\ntunnel rx %d ", nbytes);
+
+	// in single-pass mode the data is descrambled together with the BLAKE2 check
+	uint8_t opcode = (nbytes >= hlen)? udpframe->header.opcode: O_MAX;
+	int data = opcode_is_data(opcode);
+	int descrambled = 0;
+
+	// only a HELLO packet can start a new session on the server
+	Peer *peer = peer_find(client_addr);
+	if (!peer && !(arg_server && nbytes >= hlen && udpframe->header.opcode == O_HELLO)) {
+		w->stats.udp_rx_drop_addr_pkt++;
+		w->stats.udp_rx_drop_pkt++;
+		logmsg("Address mismatch %d.%d.%d.%d:%d\n",
+		       PRINT_IP(ntohl(client_addr->sin_addr.s_addr)),
+		       ntohs(client_addr->sin_port));
+		return -1;
+	}
+
+	if (auth == AUTH_DESCRAMBLED) {
+		auth = AUTH_OK;
+		descrambled = 1;
+	}
+	else if (w->fused && auth == AUTH_UNKNOWN && data && nbytes >= hlen + KEY_LEN) {
+		auth = descramble_verify(&udpframe->header, nbytes - hlen - KEY_LEN);
+		descrambled = 1;
+	}
+	if (!pkt_check_header(peer, udpframe, nbytes, client_addr, auth)) { // also does BLAKE2 authentication
+		dbg_printf("drop\n");
+		w->stats.udp_rx_drop_pkt++;
+		return -1;
+	}
+
+	if (!peer) {
+		pthread_mutex_lock(&state_lock);
+		peer = peer_find(client_addr);
+		if (!peer)
+			peer = peer_add(client_addr);
+		pthread_mutex_unlock(&state_lock);
+		if (!peer) {
+			logmsg("Error: too many clients, %d.%d.%d.%d:%d dropped\n",
+			       PRINT_IP(ntohl(client_addr->sin_addr.s_addr)),
+			       ntohs(client_addr->sin_port));
+			w->stats.udp_rx_drop_pkt++;
+			return -1;
+		}
+	}
+	peer_stats_add(&peer->stats.rx_pkt, 1);
+	if (from)
+		*from = peer;
+
+	if (peer->state == S_CONNECTED)
+		peer->connect_ttl = CONNECT_TTL;
+	if (data) {
+		dbg_printf("data ");
+
+		// descramble
+		nbytes -= hlen + KEY_LEN;
+		if (!descrambled && arg_plugin) {
+			uint8_t *pkt = (uint8_t *) &udpframe->header;
+			unsigned len = hlen + nbytes;
+			plugin_descramble(&pkt, &len, 1);
+		}
+		else if (!descrambled)
+			descramble(udpframe->eth, nbytes, &udpframe->header);
+		if (opcode == O_DATA_LZ) {
+			dbg_printf("lz ");
+			nbytes = lz_decode(udpframe->eth, nbytes, &opcode);
+			if (nbytes < 0) {
+				w->stats.udp_rx_drop_compress_pkt++;
+				w->stats.udp_rx_drop_pkt++;
+				return -1;
+			}
+		}
+		int direction = (arg_server)? C2S: S2C;
+		int lane = (udpframe->header.flags & F_LANE_MASK) >> F_LANE_SHIFT;
+		uint8_t *ethstart = udpframe->eth;
+		uint16_t cid = udpframe->header.sid;
+		if (opcode >= O_DATA_CID16) {
+			opcode -= O_DATA_CID16 - O_DATA;
+			if (nbytes < ((opcode == O_DATA)? 14: 1)) {
+				w->stats.udp_rx_drop_pkt++;
+				return -1;
+			}
+			if (opcode == O_DATA) {
+				cid |= ethstart[12] << 8;
+				ethstart[12] = 0x08;
 			}
+			else {
+				cid |= ethstart[0] << 8;
+				ethstart++;
+				nbytes--;
+			}
+		}
 
-			// check connect ttl
-			if (--tunnel.connect_ttl < 1) {
-				tunnel.state = S_DISCONNECTED;
-				tunnel.seq = 0;
-				if (tunnel.connect_ttl == 0) {
-					logmsg("%d.%d.%d.%d:%d disconnected\n",
-					       PRINT_IP(ntohl(tunnel.remote_sock_addr.sin_addr.s_addr)),
-					       ntohs(tunnel.remote_sock_addr.sin_port));
-					if (arg_server)
-						memset(&tunnel.remote_sock_addr, 0, sizeof(tunnel.remote_sock_addr));
-					compress_l2_init();
-					compress_l3_init();
-				}
+		rv = 0;
+		if (opcode == O_DATA_COMPRESSED_L4) {
+			dbg_printf("decompress L4 ");
+			rv = decompress_l4(peer, ethstart, nbytes, cid, direction, lane);
+		}
+		else if (opcode == O_DATA_COMPRESSED_UDP) {
+			dbg_printf("decompress UDP ");
+			rv = decompress_udp(peer, ethstart, nbytes, cid, direction, lane);
+		}
+		else if (opcode == O_DATA_COMPRESSED_L3) {
+			dbg_printf("decompress ");
+			rv = decompress_l3(peer, ethstart, nbytes, cid, direction, lane);
+		}
+		else if (opcode == O_DATA_COMPRESSED_L2) {
+			dbg_printf("decompress L2 ");
+			rv = decompress_l2(peer, ethstart, nbytes, cid, direction, lane);
+		}
+		if (rv < 0) {
+			// the frames lost on the way left the context behind, the sender is asked
+			// for a full header
+			spin_lock(&peer->compress_lock[direction][lane]);
+			int damaged = flow_damaged(profile_table(peer, opcode, direction, lane), cid);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+			if (damaged)
+				nack_add(w, peer, opcode, lane, cid);
+			w->stats.udp_rx_drop_pkt++;
+			return -1;
+		}
+		ethstart -= rv;
+		nbytes += rv;
+
+		// the context cid follows the frame, the profile is picked the same way as in encap_frame();
+		// the tables don't grow above their size for the peer, a context out of range is dropped
+		int learned;
+		if (pkt_is_ip(ethstart, nbytes)) {
+			learned = learn_l4(peer, ethstart, nbytes, cid, direction, lane);
+			if (!learned)
+				learned = learn_udp(peer, ethstart, nbytes, cid, direction, lane);
+			if (!learned)
+				learned = learn_l3(peer, ethstart, cid, direction, lane);
+		}
+		else
+			learned = learn_l2(peer, ethstart, cid, direction, lane);
+		if (learned < 0) {
+			w->stats.udp_rx_drop_compress_pkt++;
+			w->stats.udp_rx_drop_pkt++;
+			return -1;
+		}
+
+		// the frames for this source address go to this peer
+		if (arg_server)
+			peer_learn(peer, ethstart + 6);
+
+		*start = ethstart;
+		return nbytes;
+	}
+
+	else if (opcode == O_HELLO) {
+		pthread_mutex_lock(&state_lock);
+		hello_rx(w, peer, udpframe);
+		pthread_mutex_unlock(&state_lock);
+	}
+
+	else if (opcode == O_NACK) {
+		// the loss measured by the peer sets the refresh interval of our contexts; the
+		// entries are the contexts the peer could not decompress
+		dbg_printf("nack\n");
+		nbytes -= hlen + KEY_LEN;
+		if (nbytes < 2) {
+			w->stats.udp_rx_drop_pkt++;
+			return -1;
+		}
+		uint16_t loss;
+		memcpy(&loss, udpframe->eth, 2);
+		flow_loss(peer, ntohs(loss));
+
+		int direction = (arg_server)? S2C: C2S;
+		uint8_t *p = udpframe->eth + 2;
+		int cnt = (nbytes - 2) / NACK_ENTRY;
+		int i;
+		for (i = 0; i < cnt; i++, p += NACK_ENTRY) {
+			int lane = p[1];
+			if (lane >= WORKERS_MAX)
+				continue;
+			FlowTable *t = profile_table(peer, p[0], direction, lane);
+			if (!t)
+				continue;
+			spin_lock(&peer->compress_lock[direction][lane]);
+			flow_nack(t, (p[2] << 8) | p[3]);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+			w->stats.compress_nack_rx++;
+		}
+	}
+
+	else if (opcode == O_MESSAGE) {
+		dbg_printf("message\n");
+		if (peer->state == S_DISCONNECTED || arg_server) {
+			// quietly drop the packet, it could be a very old one
+		}
+		else {
+			printf("%s\n", (char *) udpframe->eth);
+		}
+	}
+
+	return 0;
+}
+
+// HELLO retransmission and connect ttl
+static void hello_tick(Worker *w) {
+	pthread_mutex_lock(&state_lock);
+	logcnt = 0;
+	if (!arg_server && peers[0]->state == S_DISCONNECTED) {
+		printf("."); fflush(0);
+	}
+
+	int i;
+	for (i = 0; i < peers_cnt; i++) {
+		Peer *peer = peers[i];
+		if (arg_server && peer->addr.sin_port == 0)	// free slot
+			continue;
+
+		// send HELLO packet
+		// the client always sends it, regardless of the connection status
+		if (peer->state == S_CONNECTED || !arg_server) {
+			dbg_printf("\ntunnel tx hello ");
+			pkt_send_hello(peer, w->ctlframe, w->udpfd);
+			dbg_printf("\n");
+		}
 
-				tunnel.connect_ttl = 0;
+		// report the loss of the packets coming from the peer
+		if (peer->state == S_CONNECTED) {
+			peer_rx_loss(peer);
+			pkt_send_nack(peer, w->ctlframe, w->udpfd, NULL, 0);
+		}
+
+		// check connect ttl
+		if (--peer->connect_ttl < 1) {
+			int was_connected = (peer->state == S_CONNECTED);
+			peer->state = S_DISCONNECTED;
+			peer->seq = 0;
+			if (peer->connect_ttl == 0) {
+				logmsg("%d.%d.%d.%d:%d disconnected\n",
+				       PRINT_IP(ntohl(peer->addr.sin_addr.s_addr)),
+				       ntohs(peer->addr.sin_port));
+				compress_l2_init(peer);
+				compress_l3_init(peer);
+				compress_l4_init(peer);
+				compress_udp_init(peer);
+				replay_init(&peer->replay);
 			}
 
-			// print stats
-			if (++statscnt >= STATS_TIMEOUT_MAX) {
-				statscnt = 0;
-				pkt_print_stats(udpframe, tunnel.udpfd);
+			// the server releases the session
+			if (arg_server)
+				peer_remove(peer);
+
+			// a disconnected client tries every 2 seconds
+			if (!arg_server && was_connected)
+				timer_set(hello_timer, 2, 2);
+			peer->connect_ttl = 0;
+		}
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+static void stats_tick(Worker *w) {
+	stats_collect();
+	pkt_print_stats(w->ctlframe, w->udpfd);
+
+	if (arg_debug || arg_debug_compress) {
+		int direction = (arg_server)? S2C: C2S;
+		int i;
+		for (i = 0; i < peers_cnt; i++) {
+			Peer *peer = peers[i];
+			if (peer->state != S_CONNECTED)
+				continue;
+			printf("Peer %d.%d.%d.%d:%d\n",
+			       PRINT_IP(ntohl(peer->addr.sin_addr.s_addr)),
+			       ntohs(peer->addr.sin_port));
+			print_compress_l2_table(peer, direction);
+			print_compress_l3_table(peer, direction);
+			print_compress_l4_table(peer, direction);
+			print_compress_udp_table(peer, direction);
+			print_lz_table(peer, direction);
+		}
+		printf("\n");
+	}
+}
+
+// Send the packets at the head of udpq on the AF_XDP socket. We stop at the first packet for
+// a peer we didn't hear from on the AF_XDP socket yet; the rest of the queue goes out on
+// the UDP socket.
+static void xdp_flush(Worker *w) {
+	Xsk *x = w->xsk;
+	unsigned sent = 0;
+	while (sent < w->udpq.cnt) {
+		QueueEntry *e = queue_entry(&w->udpq, sent);
+		XdpRoute route;
+		spin_lock(&e->peer->route_lock);
+		memcpy(&route, &e->peer->route, sizeof(XdpRoute));
+		spin_unlock(&e->peer->route_lock);
+		if (!route.valid || e->len > XDP_PAYLOAD_MAX)
+			break;
+
+		uint8_t *frame = xsk_tx_alloc(x);
+		if (!frame)
+			break;
+		xsk_tx_push(x, frame, xdp_build(x, frame, &route, &e->peer->addr, e->start, e->len));
+		sent++;
+	}
+
+	if (sent) {
+		dbg_printf("sent tunnel xdp batch %u\n", sent);
+		queue_pop(&w->udpq, sent);
+		w->udpq_signed -= sent;
+		w->stats.udp_tx_pkt += sent;
+		w->stats.udp_tx_xdp_pkt += sent;
+		w->stats.udp_tx_batch++;
+	}
+	// also the frames left in the ring by the previous calls
+	xsk_tx_kick(x);
+}
+
+// add the BLAKE2 tags to the packets queued since the last call
+static void udp_sign(Worker *w) {
+	if (w->fused) {
+		for (; w->udpq_signed < w->udpq.cnt; w->udpq_signed++) {
+			QueueEntry *e = queue_entry(&w->udpq, w->udpq_signed);
+			scramble_sign((PacketHeader *) e->start, e->len - hlen - KEY_LEN);
+		}
+		return;
+	}
+
+	while (w->udpq_signed < w->udpq.cnt) {
+		unsigned cnt = w->udpq.cnt - w->udpq_signed;
+		if (cnt > (unsigned) arg_batch)
+			cnt = arg_batch;
+		unsigned i;
+		for (i = 0; i < cnt; i++) {
+			QueueEntry *e = queue_entry(&w->udpq, w->udpq_signed + i);
+			w->hashpkt[i] = e->start;
+			w->hashlen[i] = e->len - KEY_LEN;
+		}
+		if (arg_plugin)
+			plugin_scramble(w->hashpkt, w->hashlen, cnt);
+		pkt_sign_batch(w->hashpkt, w->hashlen, cnt);
+		w->udpq_signed += cnt;
+	}
+}
+
+// send the packets waiting in udpq
+static void udp_flush(Worker *w) {
+	udp_sign(w);
+	if (w->xsk)
+		xdp_flush(w);
+
+	while (w->udpq.cnt) {
+		int rv;
+		if (arg_batch == 1) {
+			// no batching
+			QueueEntry *e = queue_entry(&w->udpq, 0);
+			rv = sendto(w->udpfd, e->start, e->len, 0,
+				    (const struct sockaddr *) &e->peer->addr,
+				    sizeof(struct sockaddr_in));
+			dbg_printf("sent tunnel %d\n", rv);
+			if (rv != -1)
+				rv = 1;
+		}
+		else {
+			int cnt = (w->udpq.cnt < (unsigned) arg_batch)? w->udpq.cnt: (unsigned) arg_batch;
+			int msgs = 0;
+			int i = 0;
+			while (i < cnt) {
+				QueueEntry *e = queue_entry(&w->udpq, i);
+				w->txiov[i].iov_base = e->start;
+				w->txiov[i].iov_len = e->len;
+				int segs = 1;
+
+				// With GSO, the packets for the same peer are chained in a single buffer, and the
+				// kernel cuts it in e->len datagrams. All the datagrams have the same size,
+				// only the last one can be shorter.
+				if (w->gso) {
+					unsigned total = e->len;
+					while (i + segs < cnt && segs < GSO_SEGS_MAX) {
+						QueueEntry *next = queue_entry(&w->udpq, i + segs);
+						if (next->peer != e->peer || next->len > e->len ||
+						    total + next->len > GSO_BYTES_MAX)
+							break;
+						w->txiov[i + segs].iov_base = next->start;
+						w->txiov[i + segs].iov_len = next->len;
+						total += next->len;
+						segs++;
+						if (next->len < e->len)
+							break;
+					}
+				}
+
+				struct msghdr *msg = &w->txmsg[msgs].msg_hdr;
+				msg->msg_name = &e->peer->addr;
+				msg->msg_namelen = sizeof(struct sockaddr_in);
+				msg->msg_iov = &w->txiov[i];
+				msg->msg_iovlen = segs;
+				msg->msg_control = NULL;
+				msg->msg_controllen = 0;
+				if (segs > 1) {
+					msg->msg_control = w->txctl[msgs].buf;
+					msg->msg_controllen = sizeof(w->txctl[msgs].buf);
+					struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+					cm->cmsg_level = SOL_UDP;
+					cm->cmsg_type = UDP_SEGMENT;
+					cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+					uint16_t gso_size = e->len;
+					memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+				}
+				w->txseg[msgs++] = segs;
+				i += segs;
 			}
 
-			if (++compresscnt >= COMPRESS_TIMEOUT_MAX) {
-				compresscnt = 0;
-				if (arg_debug || arg_debug_compress) {
-					int direction = (arg_server)? S2C: C2S;
-					print_compress_l2_table(direction);
-					print_compress_l3_table(direction);
-					printf("\n");
+			rv = sendmmsg(w->udpfd, w->txmsg, msgs, 0);
+			dbg_printf("sent tunnel batch %d\n", rv);
+			if (rv > 0) {
+				w->stats.udp_tx_batch++;
+				// count the queue entries for the buffers sent
+				int sent = 0;
+				for (i = 0; i < rv; i++) {
+					sent += w->txseg[i];
+					if (w->txseg[i] > 1)
+						w->stats.udp_tx_gso_pkt += w->txseg[i];
 				}
+				rv = sent;
+			}
+			else if (rv == -1 && w->txseg[0] > 1 &&
+				 (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+				// the kernel or the outgoing device cannot segment the buffer,
+				// continue with one datagram for each packet
+				fprintf(stderr, "Warning: UDP segmentation offload failed (%s), disabled\n",
+					strerror(errno));
+				w->gso = 0;
+				continue;
 			}
+		}
+
+		if (rv == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			// the packet is dropped
+			perror("sendmmsg");
+			rv = 1;
+		}
+		else
+			w->stats.udp_tx_pkt += rv;
+		queue_pop(&w->udpq, rv);
+		w->udpq_signed -= rv;
+	}
+
+	// wait for the socket to become writable if we still have packets in the queue,
+	// stop reading the tap device while the queue is full
+	epoll_mod(w, w->udpfd, &w->udp_events, (w->udpq.cnt)? EPOLLIN | EPOLLOUT: EPOLLIN);
+	epoll_mod(w, w->tapfd, &w->tap_events,
+		  (w->tapq.cnt? EPOLLOUT: 0) | ((queue_free(&w->udpq) >= (unsigned) arg_batch)? EPOLLIN: 0));
+}
+
+// write a frame to the tap device
+static int tap_write(Worker *w, uint8_t *start, int len) {
+	dbg_printf("send tap ");
+	int rv;
+	if (arg_tso) {
+		// the frame was checksummed by the sender and authenticated by us
+		static struct virtio_net_hdr vh = { .flags = VIRTIO_NET_HDR_F_DATA_VALID };
+		struct iovec iov[2] = {
+			{ .iov_base = &vh, .iov_len = sizeof(vh) },
+			{ .iov_base = start, .iov_len = len }
+		};
+		rv = writev(w->tapfd, iov, 2);
+	}
+	else
+		rv = write(w->tapfd, start, len);
+	dbg_printf("%d\n", rv);
+	return rv;
+}
+
+// write the frames waiting in tapq to the tap device
+static void tap_flush(Worker *w) {
+	while (w->tapq.cnt) {
+		QueueEntry *e = queue_entry(&w->tapq, 0);
+		int rv = tap_write(w, e->start, e->len);
+		if (rv == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("write");
+		}
+		queue_pop(&w->tapq, 1);
+	}
+
+	epoll_mod(w, w->tapfd, &w->tap_events,
+		  (w->tapq.cnt? EPOLLOUT: 0) | ((queue_free(&w->udpq) >= (unsigned) arg_batch)? EPOLLIN: 0));
+}
 
+// Send the frame stored in the first free entry of udpq to all the connected peers,
+// except the one the frame came from. Each peer gets a copy in the next free entry,
+// the last one gets the original buffer.
+static void tap_flood(Worker *w, int nbytes) {
+	uint8_t *raw = queue_free_entry(&w->udpq, 0)->mem->f.eth;
+	Peer *src = peer_lookup_mac(raw + 6);
+	Peer *pending = NULL;
+
+	int cnt = __atomic_load_n(&peers_cnt, __ATOMIC_ACQUIRE);
+	int i;
+	for (i = 0; i < cnt; i++) {
+		Peer *peer = peers[i];
+		if (peer->state != S_CONNECTED || peer == src)
 			continue;
+
+		if (pending) {
+			if (queue_free(&w->udpq) < 2)
+				break;
+			// after the push, the original frame is back in the first free entry
+			QueueEntry *e = queue_free_entry(&w->udpq, 1);
+			memcpy(e->mem->f.eth, raw, nbytes);
+			e->len = encap_frame(w, pending, &e->mem->f, nbytes, &e->start);
+			if (e->len) {
+				e->peer = pending;
+				queue_push(&w->udpq, 1);
+			}
+			raw = queue_free_entry(&w->udpq, 0)->mem->f.eth;
 		}
+		pending = peer;
+	}
+
+	if (pending) {
+		QueueEntry *e = queue_free_entry(&w->udpq, 0);
+		e->len = encap_frame(w, pending, &e->mem->f, nbytes, &e->start);
+		if (e->len) {
+			e->peer = pending;
+			queue_push(&w->udpq, 0);
+		}
+	}
+}
+
+// send the frame stored in the first free entry of udpq in the tunnel
+static void tap_send(Worker *w, int nbytes) {
+	QueueEntry *e = queue_free_entry(&w->udpq, 0);
+	UdpFrame *udpframe = &e->mem->f;
+	if (!frame_check(w, udpframe->eth, nbytes))
+		return;
 
-		// tap
-		if (FD_ISSET (tunnel.tapfd, &set)) {
-			int nbytes;
+	// broadcast, multicast and unknown destinations go to all the clients
+	Peer *peer = peer_lookup_mac(udpframe->eth);
+	if (!peer) {
+		tap_flood(w, nbytes);
+		return;
+	}
+
+	e->len = encap_frame(w, peer, udpframe, nbytes, &e->start);
+	if (e->len) {
+		e->peer = peer;
+		queue_push(&w->udpq, 0);
+	}
+}
+
+// Read a frame and its virtio-net header from the tap device. A regular frame is left in
+// udpframe, and its length is returned. TSO super-frames are segmented and sent here, 0 is returned.
+// Return -1 if there is nothing to read.
+static int tap_read_vnet(Worker *w, UdpFrame *udpframe) {
+	// the frame goes in udpframe, and continues in tsobuf if it is too long
+	struct virtio_net_hdr vh;
+	struct iovec iov[3] = {
+		{ .iov_base = &vh, .iov_len = sizeof(vh) },
+		{ .iov_base = udpframe->eth, .iov_len = TSO_FRAME_MAX },
+		{ .iov_base = w->tsobuf + TSO_FRAME_MAX, .iov_len = TSO_BYTES - TSO_FRAME_MAX }
+	};
+	int nbytes = readv(w->tapfd, iov, 3);
+	if (nbytes == -1)
+		return -1;
+	nbytes -= sizeof(vh);
+	if (nbytes <= 0)
+		return 0;
+
+	if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE) {
+		if ((unsigned) nbytes > TSO_FRAME_MAX)
+			return 0;
+		if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && !tso_checksum(udpframe->eth, nbytes, &vh))
+			return 0;
+		return nbytes;
+	}
+
+	// TCP segmentation
+	dbg_printf("\ntap rx tso %d ", nbytes);
+	memcpy(w->tsobuf, udpframe->eth, ((unsigned) nbytes < TSO_FRAME_MAX)? (unsigned) nbytes: TSO_FRAME_MAX);
+	Tso tso;
+	if (!tso_init(&tso, &vh, w->tsobuf, nbytes)) {
+		dbg_printf("invalid super-frame\n");
+		return 0;
+	}
+	while (1) {
+		// make room in udpq; if the socket is not keeping up, TCP will retransmit
+		if (queue_free(&w->udpq) == 0)
+			udp_flush(w);
+		if (queue_free(&w->udpq) == 0) {
+			w->stats.eth_rx_drop_pkt++;
+			break;
+		}
 
-			// get data from tap device
-			nbytes = read(tunnel.tapfd, udpframe->eth, sizeof(UdpFrame) - hlen);
-			if (nbytes == -1)
+		int len = tso_next(&tso, queue_free_entry(&w->udpq, 0)->mem->f.eth);
+		if (len == 0)
+			break;
+		w->stats.eth_rx_tso_pkt++;
+		tap_send(w, len);
+	}
+
+	return 0;
+}
+
+// read up to arg_batch frames from the tap device into udpq
+static void tap_rx(Worker *w) {
+	int i;
+	for (i = 0; i < arg_batch && queue_free(&w->udpq); i++) {
+		UdpFrame *udpframe = &queue_free_entry(&w->udpq, 0)->mem->f;
+
+		// get data from tap device
+		int nbytes;
+		if (arg_tso)
+			nbytes = tap_read_vnet(w, udpframe);
+		else
+			nbytes = read(w->tapfd, udpframe->eth, sizeof(UdpFrame) - hlen);
+		if (nbytes == -1) {
+			if (errno != EAGAIN)
 				perror("read");
-			dbg_printf("\ntap rx %d ", nbytes);
-
-			// eth header size of 14
-			if (nbytes <=14)
-				dbg_printf("error < 14\n");
-			else if (tunnel.state != S_CONNECTED)
-				dbg_printf("error not connected\n");
-			else if (pkt_is_ipv6(udpframe->eth, nbytes))
-				dbg_printf("ipv6 drop\n");
-			else if (pkt_is_dns_AAAA(udpframe->eth, nbytes))
-				dbg_printf("DNS AAAA drop\n");
-			else {
-				int compression_l2 = 0;
-				int compression_l3 = 0;
-				uint8_t sid;	// session id if compression is set
-				if (pkt_is_dns(udpframe->eth, nbytes))
-					tunnel.stats.eth_rx_dns++;
-
-				int direction = (arg_server)? S2C: C2S;
-				if (pkt_is_ip(udpframe->eth, nbytes))
-					compression_l3 = classify_l3(udpframe->eth, &sid, direction);
-				else
-					compression_l2 = classify_l2(udpframe->eth, &sid, direction);
-
-				// set header
-				tunnel.seq++;
-				PacketHeader hdr;
-				memset(&hdr, 0, sizeof(hdr));
-				uint8_t *ethptr = udpframe->eth;
-				if (compression_l3) {
-					dbg_printf("compressing L3");
-					int rv = compress_l3(udpframe->eth, nbytes, sid, direction);
-					nbytes -= rv;
-					ethptr += rv;
-					pkt_set_header(&hdr, O_DATA_COMPRESSED_L3, tunnel.seq);
-					hdr.sid = sid;
-				}
-				else if (compression_l2) {
-					dbg_printf("compressing L2 ");
-					int rv = compress_l2(udpframe->eth, nbytes, sid, direction);
-					nbytes -= rv;
-					ethptr += rv;
-					pkt_set_header(&hdr, O_DATA_COMPRESSED_L2, tunnel.seq);
-					hdr.sid = sid;
-				}
-				else
-					pkt_set_header(&hdr, O_DATA, tunnel.seq);
+			break;
+		}
+		if (nbytes)
+			tap_send(w, nbytes);
+	}
 
-				scramble(ethptr, nbytes, &hdr);
-				memcpy(ethptr - hlen, &hdr, hlen);
+	udp_flush(w);
+}
 
-				// add BLAKE2 authentication
-				uint8_t *hash = get_hash(ethptr - hlen, nbytes + hlen,
-							 ntohl(hdr.timestamp), tunnel.seq);
-				memcpy(ethptr + nbytes, hash, KEY_LEN);
+// Descramble with the plugin the data packets of a batch that passed the BLAKE2 check,
+// in a single call. hashpkt, hashlen and auth hold the result of pkt_verify_batch().
+static void plugin_rx(Worker *w, int n) {
+	int cnt = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		PacketHeader *hdr = (PacketHeader *) w->hashpkt[i];
+		if (w->auth[i] != AUTH_OK)
+			continue;
+		if (!opcode_is_data(hdr->opcode))
+			continue;
+		w->hashpkt[cnt] = w->hashpkt[i];
+		w->hashlen[cnt] = w->hashlen[i] - KEY_LEN;
+		cnt++;
+		w->auth[i] = AUTH_DESCRAMBLED;
+	}
+	if (cnt)
+		plugin_descramble(w->hashpkt, w->hashlen, cnt);
+}
+
+// read up to arg_batch packets from the UDP socket, the data frames go in tapq
+static void udp_rx(Worker *w) {
+	// receive directly in the free entries of tapq; if the tap device is not keeping up,
+	// we continue to process the control packets and drop the data
+	unsigned cnt = queue_free(&w->tapq);
+	if (cnt > (unsigned) arg_batch)
+		cnt = arg_batch;
+	int full = (cnt == 0);
+	if (full)
+		cnt = arg_batch;
 
-				rv = sendto(tunnel.udpfd, ethptr - hlen, nbytes + hlen + KEY_LEN, 0,
-					    (const struct sockaddr *) &tunnel.remote_sock_addr,
-					    sizeof(struct sockaddr_in));
-				dbg_printf("sent tunnel %d\n", rv);
-				if (rv == -1)
-					perror("sendto");
+	unsigned i;
+	for (i = 0; i < cnt; i++) {
+		w->rxiov[i].iov_base = (full)? &w->rxmem[i]->f: &queue_free_entry(&w->tapq, i)->mem->f;
+		w->rxiov[i].iov_len = sizeof(UdpFrame);
+	}
 
-				tunnel.stats.udp_tx_pkt++;
+	int n;
+	if (arg_batch == 1) {
+		// no batching
+		unsigned socklen = sizeof(struct sockaddr_in);
+		n = recvfrom(w->udpfd, w->rxiov[0].iov_base, w->rxiov[0].iov_len, 0,
+			     (struct sockaddr *) &w->rxaddr[0], &socklen);
+		if (n != -1) {
+			w->rxmsg[0].msg_len = n;
+			n = 1;
+		}
+	}
+	else {
+		for (i = 0; i < cnt; i++) {
+			struct msghdr *msg = &w->rxmsg[i].msg_hdr;
+			msg->msg_name = &w->rxaddr[i];
+			msg->msg_namelen = sizeof(struct sockaddr_in);
+			msg->msg_iov = &w->rxiov[i];
+			msg->msg_iovlen = 1;
+		}
+		n = recvmmsg(w->udpfd, w->rxmsg, cnt, MSG_DONTWAIT, NULL);
+		if (n > 0) {
+			dbg_printf("\ntunnel rx batch %d ", n);
+			w->stats.udp_rx_batch++;
+		}
+	}
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("recvmmsg");
+		return;
+	}
+
+	// check the BLAKE2 tags of the whole batch
+	for (i = 0; i < (unsigned) n; i++) {
+		w->hashpkt[i] = w->rxiov[i].iov_base;
+		w->hashlen[i] = w->rxmsg[i].msg_len;
+		w->auth[i] = AUTH_UNKNOWN;
+	}
+	if (!w->fused)
+		pkt_verify_batch(w->hashpkt, w->hashlen, n, w->auth);
+	if (arg_plugin)
+		plugin_rx(w, n);
+
+	// the packets committed to tapq are moved at the tail of the queue in the order they arrived
+	unsigned committed = 0;
+	for (i = 0; i < (unsigned) n; i++) {
+		uint8_t *start;
+		int len = decap_packet(w, w->rxiov[i].iov_base, w->rxmsg[i].msg_len, &w->rxaddr[i],
+				       w->auth[i], &start, NULL);
+		if (len <= 0)
+			continue;
+		if (full) {
+			w->stats.eth_tx_drop_pkt++;
+			continue;
+		}
+
+		QueueEntry *e = queue_free_entry(&w->tapq, i - committed);
+		e->start = start;
+		e->len = len;
+		queue_push(&w->tapq, i - committed);
+		committed++;
+	}
+
+	tap_flush(w);
+	nack_flush(w);
+}
+
+// read coalesced UDP_GRO buffers from the UDP socket and split them into datagrams;
+// the data frames go in tapq
+static void udp_rx_gro(Worker *w) {
+	unsigned cnt = (arg_batch < GRO_BUFS)? arg_batch: GRO_BUFS;
+	unsigned i;
+	for (i = 0; i < cnt; i++) {
+		w->rxiov[i].iov_base = w->grobuf + i * GRO_BYTES;
+		w->rxiov[i].iov_len = GRO_BYTES;
+		struct msghdr *msg = &w->rxmsg[i].msg_hdr;
+		msg->msg_name = &w->rxaddr[i];
+		msg->msg_namelen = sizeof(struct sockaddr_in);
+		msg->msg_iov = &w->rxiov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = w->rxctl[i].buf;
+		msg->msg_controllen = sizeof(w->rxctl[i].buf);
+	}
+
+	int n = recvmmsg(w->udpfd, w->rxmsg, cnt, MSG_DONTWAIT, NULL);
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("recvmmsg");
+		return;
+	}
+	dbg_printf("\ntunnel rx gro batch %d ", n);
+	w->stats.udp_rx_batch++;
+
+	int j;
+	for (j = 0; j < n; j++) {
+		struct msghdr *msg = &w->rxmsg[j].msg_hdr;
+		uint8_t *ptr = w->rxiov[j].iov_base;
+		int len = w->rxmsg[j].msg_len;
+
+		// the datagram size is passed in a control message if the buffer was coalesced
+		int segsize = len;
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+			if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+				memcpy(&segsize, CMSG_DATA(cm), sizeof(int));
+				break;
 			}
 		}
+		if (segsize <= 0)
+			segsize = len;
+		if (segsize < len)
+			w->stats.udp_rx_gro_pkt += (len + segsize - 1) / segsize;
 
-		// udp
-		if (FD_ISSET (tunnel.udpfd, &set)) {
-			int nbytes;
-			struct sockaddr_in client_addr;
-			unsigned socklen = sizeof(client_addr);
-
-			// get data from udp socket
-			nbytes = recvfrom(tunnel.udpfd, udpframe, sizeof(UdpFrame), 0,
-					  (struct sockaddr *) &client_addr, &socklen);
-			if (nbytes == -1)
-				perror("recvfrom");
-
-			// update stats
-			tunnel.stats.udp_rx_pkt++;
-			dbg_printf("\ntunnel rx %d ", nbytes);
-
-			if (pkt_check_header(udpframe, nbytes, &client_addr)) { // also does BLAKE2 authentication
-				if (tunnel.state == S_CONNECTED)
-					tunnel.connect_ttl = CONNECT_TTL;
-				if (udpframe->header.flags & F_SYNC) {
-					logmsg("sync requested by %d.%d.%d.%d:%d\n",
-					       PRINT_IP(ntohl(client_addr.sin_addr.s_addr)),
-					       ntohs(client_addr.sin_port));
-					compress_l2_init();
-					compress_l3_init();
-				}
+		unsigned seg = 0;
+		while (len > 0) {
+			int dlen = (len < segsize)? len: segsize;
 
-				uint8_t opcode = udpframe->header.opcode;
-				if (opcode == O_DATA || opcode == O_DATA_COMPRESSED_L3 ||
-				    opcode == O_DATA_COMPRESSED_L2) {
-					dbg_printf("data ");
-
-					// descramble
-					descramble(udpframe->eth, nbytes - hlen - KEY_LEN, &udpframe->header);
-					nbytes -= hlen + KEY_LEN;
-					int direction = (arg_server)? C2S: S2C;
-					uint8_t *ethstart = udpframe->eth;
-					if (opcode == O_DATA_COMPRESSED_L3) {
-						dbg_printf("decompress ");
-						rv = decompress_l3(ethstart, nbytes, udpframe->header.sid, direction);
-						ethstart -= rv;
-						nbytes += rv;
-					}
-					else if (opcode == O_DATA_COMPRESSED_L2) {
-						dbg_printf("decompress L2 ");
-						rv = decompress_l2(ethstart, nbytes, udpframe->header.sid, direction);
-						ethstart -= rv;
-						nbytes += rv;
-					}
-					if (pkt_is_ip(ethstart, nbytes) || pkt_is_udp(ethstart, nbytes))
-						classify_l3(ethstart, NULL, direction);
-					else
-						classify_l2(ethstart, NULL, direction);
-
-					// write to tap device
-					dbg_printf("send tap ");
-					rv = write(tunnel.tapfd, ethstart, nbytes);
-					dbg_printf("%d\n", rv);
-					if (rv == -1)
-						perror("write");
+			// check the BLAKE2 tags of the next datagrams in a single batch, in the GRO buffer
+			if (seg % arg_batch == 0 && !w->fused) {
+				uint8_t *p = ptr;
+				int left = len;
+				int k;
+				for (k = 0; k < arg_batch && left > 0; k++) {
+					w->hashpkt[k] = p;
+					w->hashlen[k] = (left < segsize)? left: segsize;
+					p += w->hashlen[k];
+					left -= w->hashlen[k];
 				}
+				pkt_verify_batch(w->hashpkt, w->hashlen, k, w->auth);
+				if (arg_plugin)
+					plugin_rx(w, k);
+			}
+			int auth = (w->fused)? AUTH_UNKNOWN: w->auth[seg % arg_batch];
+			seg++;
 
-				else if (opcode == O_HELLO) {
-					dbg_printf("hello ");
-
-					if (tunnel.state == S_DISCONNECTED) {
-						tunnel.state = S_CONNECTED;
-						tunnel.seq = 0;
-						// update remote data
-						// force a hello out to the client
-						if (arg_server) {
-							memcpy(&tunnel.remote_sock_addr, &client_addr, sizeof(struct sockaddr_in));
-							timeout.tv_sec = 0;
-							timeout.tv_usec = 0;
-						}
-						else
-							printf("\n");
-
-						logmsg("%d.%d.%d.%d:%d connected\n",
-						       PRINT_IP(ntohl(tunnel.remote_sock_addr.sin_addr.s_addr)),
-						       ntohs(tunnel.remote_sock_addr.sin_port));
-						compress_l2_init();
-						compress_l3_init();
-					}
-					tunnel.connect_ttl = CONNECT_TTL;
-
-					// update overlay data if we are the client
-					if (!arg_server) {
-						descramble(udpframe->eth, 7 * sizeof(uint32_t), &udpframe->header);
-
-						uint32_t *ptr = (uint32_t *) &udpframe->eth[0];
-						TOverlay o;
-						o.netaddr = ntohl(*ptr++);
-						o.netmask = ntohl(*ptr++);
-						o.defaultgw = ntohl(*ptr++);
-						o.mtu = ntohl(*ptr++);
-						o.dns1 = ntohl(*ptr++);
-						o.dns2 = ntohl(*ptr++);
-						o.dns3 = ntohl(*ptr++);
-
-						if (memcmp(&tunnel.overlay, &o, sizeof(TOverlay))) {
-							memcpy(&tunnel.overlay, &o, sizeof(TOverlay));
-							logmsg("Tunnel: %d.%d.%d.%d/%d, default gw %d.%d.%d.%d, mtu %d\n",
-							       PRINT_IP(tunnel.overlay.netaddr), mask2bits(tunnel.overlay.netmask),
-							       PRINT_IP(tunnel.overlay.defaultgw), tunnel.overlay.mtu);
-							logmsg("Tunnel: DNS %d.%d.%d.%d, %d.%d.%d.%d, %d.%d.%d.%d\n",
-							       PRINT_IP(tunnel.overlay.dns1), PRINT_IP(tunnel.overlay.dns2), PRINT_IP(tunnel.overlay.dns3));
-
-							// send tunnel configuration to the parent
-							send_config(socket);
-						}
-					}
-					dbg_printf("\n");
+			// make room in tapq; if the tap device is not keeping up,
+			// we continue to process the control packets and drop the data
+			if (queue_free(&w->tapq) == 0)
+				tap_flush(w);
+			int full = (queue_free(&w->tapq) == 0);
+			UdpFrame *udpframe = (full)? &w->rxmem[0]->f: &queue_free_entry(&w->tapq, 0)->mem->f;
+
+			if ((unsigned) dlen > sizeof(UdpFrame)) {
+				w->stats.udp_rx_pkt++;
+				w->stats.udp_rx_drop_pkt++;
+			}
+			else {
+				// each datagram goes through the regular checks
+				uint8_t *start;
+				memcpy(udpframe, ptr, dlen);
+				int elen = decap_packet(w, udpframe, dlen, &w->rxaddr[j], auth, &start, NULL);
+				if (elen > 0 && full)
+					w->stats.eth_tx_drop_pkt++;
+				else if (elen > 0) {
+					QueueEntry *e = queue_free_entry(&w->tapq, 0);
+					e->start = start;
+					e->len = elen;
+					queue_push(&w->tapq, 0);
 				}
+			}
+			ptr += dlen;
+			len -= dlen;
+		}
+	}
 
-				else if (opcode == O_MESSAGE) {
-					dbg_printf("message\n");
-					if (tunnel.state == S_DISCONNECTED || arg_server) {
-						// quietly drop the packet, it could be a very old one
-					}
-					else {
-						printf("%s\n", (char *) udpframe->eth);
-					}
+	tap_flush(w);
+	nack_flush(w);
+}
+
+// Read up to arg_batch packets from the AF_XDP socket. The packets are processed in the
+// UMEM frames, and the data frames are written to the tap device before the frames go back
+// to the kernel.
+static void xdp_rx(Worker *w) {
+	Xsk *x = w->xsk;
+	unsigned n = xsk_rx_peek(x, arg_batch);
+	if (n == 0)
+		return;
+	dbg_printf("\ntunnel rx xdp batch %u ", n);
+	w->stats.udp_rx_batch++;
+	w->stats.udp_rx_xdp_pkt += n;
+
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		unsigned flen;
+		uint8_t *frame = xsk_rx_frame(x, i, &flen);
+		struct sockaddr_in addr;
+		XdpRoute route;
+		int len;
+		UdpFrame *udpframe = (UdpFrame *) xdp_parse(frame, flen, &addr, &route, &len);
+		if (!udpframe) {
+			w->stats.udp_rx_pkt++;
+			w->stats.udp_rx_drop_pkt++;
+			continue;
+		}
+
+		// the Ethernet/IP/UDP headers are not needed anymore, decompression can expand
+		// the frame over them
+		uint8_t *start;
+		Peer *peer = NULL;
+		int elen = decap_packet(w, udpframe, len, &addr, AUTH_UNKNOWN, &start, &peer);
+		if (elen < 0)
+			continue;
+
+		// the packets accepted teach us the way back to the peer
+		if (peer) {
+			spin_lock(&peer->route_lock);
+			if (memcmp(&peer->route, &route, sizeof(XdpRoute)))
+				memcpy(&peer->route, &route, sizeof(XdpRoute));
+			spin_unlock(&peer->route_lock);
+		}
+
+		if (elen && tap_write(w, start, elen) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				w->stats.eth_tx_drop_pkt++;
+			else
+				perror("write");
+		}
+	}
+	xsk_rx_release(x, n);
+	nack_flush(w);
+}
+
+#ifdef HAVE_URING
+//*****************************************************
+// io_uring engine (--engine=uring)
+//*****************************************************
+// - tap: arg_batch reads are always posted, each one in its own buffer; the frame is
+//   encapsulated in place and sent from the same buffer, then the read is posted again
+// - UDP: a multishot receive using a ring of provided buffers; the data frames are written
+//   to the tap device straight from the receive buffer, and the buffer goes back in the ring
+// - the buffers come from the worker pool, the pool mapping is registered with the kernel;
+//   the tap device and the UDP socket are registered as fixed files
+// - the requests prepared while processing the completions go to the kernel in a single
+//   io_uring_enter() call, together with the wait for the next completions
+enum {
+	U_TAP_READ = 1,
+	U_UDP_SEND,
+	U_UDP_RECV,
+	U_TAP_WRITE,
+	U_TIMER
+};
+#define U_DATA(type, index) (((uint64_t) (type) << 32) | (uint32_t) (index))
+#define U_FILE_TAP 0	// fixed file index
+#define U_FILE_UDP 1
+#define U_BGID 0	// provided buffer group
+// struct io_uring_recvmsg_out and the source address go in front of the received packet
+#define U_RECV_HDR (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in))
+
+typedef struct uring_slot_t {
+	struct msghdr msg;
+	struct iovec iov;
+} UringSlot;
+
+typedef struct uring_engine_t {
+	Uring ring;
+	UringBufRing bufring;
+	PacketMem **buf;	// tap buffers, followed by the UDP receive buffers
+	unsigned tap_cnt;
+	unsigned recv_cnt;	// power of 2
+	UringSlot *slot;	// one for each tap buffer
+	struct msghdr recvmsg;	// multishot receive template
+	int recv_armed;
+	int recv_nobufs;	// the receive stopped for lack of buffers
+	unsigned recycled;	// buffers back in the ring in the current loop
+	time_t err_time;	// last error logged
+	unsigned err_cnt;	// errors since then
+	unsigned rx_cnt;	// packets received and sent in the current loop
+	unsigned tx_cnt;
+} UringEngine;
+
+static inline PacketMem *uring_recv_mem(UringEngine *u, unsigned bid) {
+	return u->buf[u->tap_cnt + bid];
+}
+
+static void uring_post_tap_read(UringEngine *u, unsigned i) {
+	struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = U_FILE_TAP;
+	sqe->addr = (uint64_t) (uintptr_t) u->buf[i]->f.eth;
+	sqe->len = sizeof(UdpFrame) - hlen;
+	sqe->buf_index = 0;
+	sqe->user_data = U_DATA(U_TAP_READ, i);
+}
+
+static void uring_post_recv(UringEngine *u) {
+	struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->fd = U_FILE_UDP;
+	sqe->addr = (uint64_t) (uintptr_t) &u->recvmsg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = U_BGID;
+	sqe->user_data = U_DATA(U_UDP_RECV, 0);
+	u->recv_armed = 1;
+}
+
+static void uring_post_timer(UringEngine *u, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = U_DATA(U_TIMER, fd);
+}
+
+// the packet lands at the same offset as in a queue buffer, there is room for header expansion
+static void uring_recycle(UringEngine *u, unsigned bid) {
+	uint8_t *buf = (uint8_t *) &uring_recv_mem(u, bid)->f - U_RECV_HDR;
+	uring_bufring_add(&u->bufring, buf, U_RECV_HDR + sizeof(UdpFrame), bid);
+	u->recycled++;
+}
+
+// An I/O request failed; the first error is logged, then one message every TIMEOUT seconds
+// at most, with the number of errors since the last one.
+static void uring_error(UringEngine *u, const char *what, int res) {
+	u->err_cnt++;
+	time_t now = time(NULL);
+	if (u->err_time && now - u->err_time < TIMEOUT)
+		return;
+	if (u->err_cnt > 1)
+		logmsg("Error: %s: %s, %u errors in the last %d seconds\n", what, strerror(-res),
+		       u->err_cnt, (int) (now - u->err_time));
+	else
+		logmsg("Error: %s: %s\n", what, strerror(-res));
+	u->err_time = now;
+	u->err_cnt = 0;
+}
+
+// UDP receive buffers, a power of 2
+static unsigned uring_recv_cnt(void) {
+	unsigned cnt = 16;
+	while (cnt < 2 * (unsigned) arg_batch)
+		cnt <<= 1;
+	return cnt;
+}
+
+// packet buffers reserved in the worker pool
+static unsigned uring_buffers(void) {
+	return arg_batch + uring_recv_cnt();
+}
+
+// set up the engine; return 0 if done, -1 if the kernel doesn't support it
+static int uring_engine_init(Worker *w) {
+	UringEngine *u = malloc(sizeof(UringEngine));
+	if (!u)
+		errExit("malloc");
+	memset(u, 0, sizeof(UringEngine));
+	u->tap_cnt = arg_batch;
+	u->recv_cnt = uring_recv_cnt();
+
+	// every request in flight has a completion queue entry
+	unsigned entries = 16;
+	while (entries < u->tap_cnt + u->recv_cnt + 8)
+		entries <<= 1;
+	if (uring_init(&u->ring, entries, 2 * entries) == -1) {
+		fprintf(stderr, "Warning: io_uring not available (%s), using epoll\n", strerror(errno));
+		free(u);
+		return -1;
+	}
+
+	// buffers
+	unsigned i;
+	u->buf = malloc((u->tap_cnt + u->recv_cnt) * sizeof(PacketMem *));
+	u->slot = malloc(u->tap_cnt * sizeof(UringSlot));
+	if (!u->buf || !u->slot)
+		errExit("malloc");
+	for (i = 0; i < u->tap_cnt + u->recv_cnt; i++)
+		u->buf[i] = pool_get(&w->pool);
+	memset(u->slot, 0, u->tap_cnt * sizeof(UringSlot));
+
+	// the whole pool is registered, the buffers can be swapped with the queue buffers
+	struct iovec iov = { .iov_base = w->pool.mem, .iov_len = w->pool.len };
+	int files[2] = { w->tapfd, w->udpfd };
+	if (uring_register(&u->ring, IORING_REGISTER_BUFFERS, &iov, 1) == -1 ||
+	    uring_register(&u->ring, IORING_REGISTER_FILES, files, 2) == -1 ||
+	    uring_bufring_init(&u->ring, &u->bufring, u->recv_cnt, U_BGID) == -1) {
+		fprintf(stderr, "Warning: io_uring engine not supported by the kernel (%s), using epoll\n",
+			strerror(errno));
+		uring_free(&u->ring);
+		for (i = 0; i < u->tap_cnt + u->recv_cnt; i++)
+			pool_put(&w->pool, u->buf[i]);
+		free(u->buf);
+		free(u->slot);
+		free(u);
+		return -1;
+	}
+
+	for (i = 0; i < u->recv_cnt; i++)
+		uring_recycle(u, i);
+	uring_bufring_commit(&u->bufring);
+	u->recvmsg.msg_namelen = sizeof(struct sockaddr_in);
+
+	// The tap reads wait in the kernel for the data: io_uring completes a read on a non-blocking
+	// file with -EAGAIN, the tap descriptor goes back in blocking mode. The UDP socket stays
+	// non-blocking, the socket requests wait in the kernel anyway, and the flood path sends
+	// with sendmmsg() from the worker thread.
+	int flags = fcntl(w->tapfd, F_GETFL);
+	if (flags == -1 || fcntl(w->tapfd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+		errExit("fcntl");
+
+	for (i = 0; i < u->tap_cnt; i++)
+		uring_post_tap_read(u, i);
+	uring_post_recv(u);
+	if (w->id == 0) {
+		uring_post_timer(u, hello_timer);
+		uring_post_timer(u, stats_timer);
+	}
+
+	w->uring = u;
+	if (w->id == 0)
+		dbg_printf("io_uring engine, %u ring entries\n", entries);
+	return 0;
+}
+
+// frame read from the tap device in buffer i
+static void uring_tap_rx(Worker *w, unsigned i, int nbytes) {
+	UringEngine *u = w->uring;
+	if (nbytes < 0) {
+		if (nbytes != -EAGAIN && nbytes != -EINTR)
+			uring_error(u, "tap read", nbytes);
+		uring_post_tap_read(u, i);
+		return;
+	}
+
+	UdpFrame *udpframe = &u->buf[i]->f;
+	if (!frame_check(w, udpframe->eth, nbytes)) {
+		uring_post_tap_read(u, i);
+		return;
+	}
+
+	// broadcast, multicast and unknown destinations go to all the clients using the queue
+	Peer *peer = peer_lookup_mac(udpframe->eth);
+	if (!peer) {
+		if (queue_free(&w->udpq)) {
+			// the frame moves to the queue, the next read goes in the queue buffer
+			QueueEntry *e = queue_free_entry(&w->udpq, 0);
+			PacketMem *mem = e->mem;
+			e->mem = u->buf[i];
+			u->buf[i] = mem;
+			tap_flood(w, nbytes);
+			udp_flush(w);
+		}
+		uring_post_tap_read(u, i);
+		return;
+	}
+
+	uint8_t *start;
+	int len = encap_frame(w, peer, udpframe, nbytes, &start);
+	if (len == 0) {
+		uring_post_tap_read(u, i);
+		return;
+	}
+	if (w->fused)
+		scramble_sign((PacketHeader *) start, len - hlen - KEY_LEN);
+	else {
+		unsigned datalen = len - KEY_LEN;
+		if (arg_plugin)
+			plugin_scramble(&start, &datalen, 1);
+		pkt_sign_batch(&start, &datalen, 1);
+	}
+
+	// send it from the same buffer
+	UringSlot *s = &u->slot[i];
+	s->iov.iov_base = start;
+	s->iov.iov_len = len;
+	s->msg.msg_name = &peer->addr;
+	s->msg.msg_namelen = sizeof(struct sockaddr_in);
+	s->msg.msg_iov = &s->iov;
+	s->msg.msg_iovlen = 1;
+	struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = U_FILE_UDP;
+	sqe->addr = (uint64_t) (uintptr_t) &s->msg;
+	sqe->len = 1;
+	sqe->user_data = U_DATA(U_UDP_SEND, i);
+	u->tx_cnt++;
+}
+
+// packet received in a provided buffer
+static void uring_udp_rx(Worker *w, struct io_uring_cqe *cqe) {
+	UringEngine *u = w->uring;
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		u->recv_armed = 0;
+	if (cqe->res < 0) {
+		// -ENOBUFS: all the buffers are waiting for the tap device, the receive is posted again
+		// once some of them are released
+		if (cqe->res == -ENOBUFS)
+			u->recv_nobufs = 1;
+		else if (cqe->res != -EINTR)
+			uring_error(u, "UDP receive", cqe->res);
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+
+	unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	uint8_t *buf = (uint8_t *) &uring_recv_mem(u, bid)->f - U_RECV_HDR;
+	struct io_uring_recvmsg_out out;
+	memcpy(&out, buf, sizeof(out));
+	if ((out.flags & MSG_TRUNC) || out.namelen < sizeof(struct sockaddr_in)) {
+		uring_recycle(u, bid);
+		return;
+	}
+
+	// the address is copied out, decompression can expand the packet over it
+	struct sockaddr_in addr;
+	memcpy(&addr, buf + sizeof(out), sizeof(addr));
+	UdpFrame *udpframe = &uring_recv_mem(u, bid)->f;
+	u->rx_cnt++;
+
+	uint8_t *start;
+	int len = decap_packet(w, udpframe, out.payloadlen, &addr, AUTH_UNKNOWN, &start, NULL);
+	if (len <= 0) {
+		uring_recycle(u, bid);
+		return;
+	}
+
+	struct io_uring_sqe *sqe = uring_sqe(&u->ring);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = U_FILE_TAP;
+	sqe->addr = (uint64_t) (uintptr_t) start;
+	sqe->len = len;
+	sqe->buf_index = 0;
+	sqe->user_data = U_DATA(U_TAP_WRITE, bid);
+}
+
+static void uring_loop(Worker *w) {
+	UringEngine *u = w->uring;
+	while (1) {
+		// submit everything prepared in the previous round and wait for more work
+		if (uring_submit(&u->ring, 1) == -1 && errno != EINTR && errno != EBUSY)
+			errExit("io_uring_enter");
+
+		u->rx_cnt = 0;
+		u->tx_cnt = 0;
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_cqe(&u->ring)) != NULL) {
+			unsigned type = cqe->user_data >> 32;
+			unsigned index = (uint32_t) cqe->user_data;
+			int res = cqe->res;
+			uint32_t flags = cqe->flags;
+
+			switch (type) {
+			case U_TAP_READ:
+				uring_tap_rx(w, index, res);
+				break;
+
+			case U_UDP_SEND:
+				if (res < 0)
+					uring_error(u, "UDP send", res);
+				else
+					w->stats.udp_tx_pkt++;
+				uring_post_tap_read(u, index);
+				break;
+
+			case U_UDP_RECV:
+				uring_udp_rx(w, cqe);
+				break;
+
+			case U_TAP_WRITE:
+				if (res < 0)
+					uring_error(u, "tap write", res);
+				uring_recycle(u, index);
+				break;
+
+			case U_TIMER:
+				if ((int) index == hello_timer) {
+					timer_ack(hello_timer);
+					hello_tick(w);
 				}
+				else if ((int) index == stats_timer) {
+					timer_ack(stats_timer);
+					stats_tick(w);
+				}
+				if (!(flags & IORING_CQE_F_MORE))
+					uring_post_timer(u, index);
+				break;
 			}
-			else {
-				dbg_printf("drop\n");
-				tunnel.stats.udp_rx_drop_pkt++;
+			uring_cqe_seen(&u->ring);
+		}
+
+		// the buffers released go back to the kernel; a receive stopped by -ENOBUFS waits
+		// for some of them
+		uring_bufring_commit(&u->bufring);
+		nack_flush(w);
+		if (!u->recv_armed && (!u->recv_nobufs || u->recycled)) {
+			u->recv_nobufs = 0;
+			uring_post_recv(u);
+		}
+		u->recycled = 0;
+
+		// packets moved by a single io_uring_enter() call
+		if (u->rx_cnt)
+			w->stats.udp_rx_batch++;
+		if (u->tx_cnt)
+			w->stats.udp_tx_batch++;
+	}
+}
+#endif
+
+static void worker_loop(Worker *w) {
+	thread_stats = &w->stats;
+
+	// pin the worker on its CPU
+	if (arg_cpu_cnt) {
+		int cpu = arg_cpu[w->id % arg_cpu_cnt];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "Warning: cannot pin worker %d on CPU %d\n", w->id, cpu);
+	}
+
+	if (w->id == 0 && !arg_server) {
+		pkt_send_hello(peers[0], w->ctlframe, w->udpfd);
+		printf("Connecting..."); fflush(0);
+	}
+
+#ifdef HAVE_URING
+	if (arg_engine == ENGINE_URING && uring_engine_init(w) == 0) {
+		uring_loop(w);
+		return;
+	}
+#endif
+
+	// event loop
+	while (1) {
+		struct epoll_event events[4];
+		int nfds = epoll_wait(w->epfd, events, 4, -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			errExit("epoll_wait");
+		}
+
+		int i;
+		for (i = 0; i < nfds; i++) {
+			int fd = events[i].data.fd;
+			if (fd == hello_timer) {
+				timer_ack(hello_timer);
+				hello_tick(w);
 			}
+			else if (fd == stats_timer) {
+				timer_ack(stats_timer);
+				stats_tick(w);
+			}
+			else if (fd == w->tapfd) {
+				if (events[i].events & EPOLLOUT)
+					tap_flush(w);
+				if (events[i].events & EPOLLIN)
+					tap_rx(w);
+			}
+			else if (fd == w->udpfd) {
+				if (events[i].events & EPOLLOUT)
+					udp_flush(w);
+				if ((events[i].events & EPOLLIN) && w->gro)
+					udp_rx_gro(w);
+				else if (events[i].events & EPOLLIN)
+					udp_rx(w);
+			}
+			else if (w->xsk && fd == w->xsk->fd)
+				xdp_rx(w);
 		}
 	}
 }
+
+static void *worker_thread(void *arg) {
+	worker_loop((Worker *) arg);
+	return NULL;
+}
+
+void child(int socket) {
+	peer_init();
+
+	int i;
+	for (i = 0; i < arg_workers; i++)
+		worker_init(&workers[i], i, socket);
+
+	// worker 0 runs in this thread
+	for (i = 1; i < arg_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]))
+			errExit("pthread_create");
+	}
+	worker_loop(&workers[0]);
+}
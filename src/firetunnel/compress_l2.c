@@ -24,9 +24,10 @@ typedef struct session_t {	// offset
 	uint8_t mac[14];	// 0 - ethernet header
 } __attribute__((__packed__)) Session;	// 38
 #define FULL_HEADER_LEN 14
+#define CHECK_LEN 1	// compressed header: check of the flow key, see flow_check()
 
 int compress_l2_size(void) {
-	return FULL_HEADER_LEN ;
+	return FULL_HEADER_LEN - CHECK_LEN;
 }
 
 // fill up a session structure; ptr is the start of eth packet
@@ -42,94 +43,122 @@ static void print_session(Session *s) {
 }
 
 typedef struct mac_connection_t {
-	int active;
-	int cnt;
-	Session s;
+	Session s;		// flow key, see flow.c
 } Connection;
-static Connection connection_s2c[256];
-static Connection connection_c2s[256];
+#define TABLE_MAX 256	// a full header carries a context id of 8 bits, see encap_frame() in child.c
+
+// each peer has one flow table for each direction and tunnel lane, allocated on first use;
+// the caller holds peer->compress_lock
+static FlowTable *get_table(Peer *peer, int direction, int lane) {
+	return flow_table(&peer->compress_l2[direction][lane], sizeof(Connection), sizeof(Session),
+			  TABLE_MAX, &peer->compress_used[direction]);
+}
 
-void compress_l2_init(void) {
-	memset(connection_s2c, 0, sizeof(connection_s2c));
-	memset(connection_c2s, 0, sizeof(connection_c2s));
+void compress_l2_init(Peer *peer) {
+	int direction;
+	for (direction = S2C; direction <= C2S; direction++) {
+		int lane;
+		for (lane = 0; lane < WORKERS_MAX; lane++) {
+			FlowTable *t = peer->compress_l2[direction][lane];
+			if (!t)
+				continue;
+			spin_lock(&peer->compress_lock[direction][lane]);
+			flow_clear(t);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+		}
+	}
 }
 
-void print_compress_l2_table(int direction) {
-	Connection *conn = (direction == S2C)? connection_s2c: connection_c2s;
-	printf("Compression L2 hash table:\n");
-	int i;
-	for (i = 0; i < 256; i++, conn++) {
-		if (conn->active) {
-			char buf[22];
-			snprintf(buf, 22, "   %d:%d", i, conn->cnt);
-			printf("%-21s", buf);
-			print_session(&conn->s);
+void print_compress_l2_table(Peer *peer, int direction) {
+	printf("Compression L2 table:\n");
+	int lane;
+	for (lane = 0; lane < WORKERS_MAX; lane++) {
+		FlowTable *t = peer->compress_l2[direction][lane];
+		if (!t)
+			continue;
+		spin_lock(&peer->compress_lock[direction][lane]);
+		uint32_t i;
+		for (i = 0; i < t->count; i++) {
+			Connection *conn = (Connection *) t->ctx + i;
+			if (t->ctl[i].cnt) {
+				char buf[32];
+				snprintf(buf, 32, "   %d:%u:%u", lane, i, t->ctl[i].cnt);
+				printf("%-21s", buf);
+				print_session(&conn->s);
+			}
 		}
+		spin_unlock(&peer->compress_lock[direction][lane]);
 	}
 }
 
 
-// record the session and return 1 if the packet can be compressed
-// store the hash in sid if sid not null
-int classify_l2(uint8_t *pkt, uint8_t *sid, int direction) {
-	int rv = 0;
+// record the session and return 1 if the packet can be compressed, sender side;
+// store the context id in cid
+int classify_l2(Peer *peer, uint8_t *pkt, uint16_t *cid, int direction, int lane) {
 	Session s;
 	set_session(pkt, &s);
 
-	uint8_t hash = 0;
-	unsigned i;
-	uint8_t *ptr = (uint8_t *) &s;
-	for ( i = 0; i < sizeof(s); i++, ptr++)
-		hash ^= *ptr;
-	if (sid)
-		*sid = hash;
-
-	Connection *conn = (direction == S2C)? &connection_s2c[hash]: &connection_c2s[hash];
-	if (conn->active) {
-		if (memcmp(&s, &conn->s, sizeof(Session)) == 0) {
-			conn->cnt++;
-			int cnt = conn->cnt;
-
-			if (cnt > 50 && cnt % 50)
-				rv = 1;
-			else if (cnt > 20 && cnt % 20)
-				rv = 1;
-			else if (cnt > 3 && cnt % 8)
-				rv = 1;
-		}
-		else {
-			dbg_printf("replace l2 hash %d\n", hash);
-			tunnel.stats.compress_hash_collision++;
-			memcpy(&conn->s, &s, sizeof(Session));
-			conn->cnt = 1;
-		}
-	}
-	else {
-		memcpy(&conn->s, &s, sizeof(Session));
-		conn->cnt = 1;
-		conn->active = 1;
-	}
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowTable *t = get_table(peer, direction, lane);
+	flow_find(t, &s, cid, &found);
+	if (!found)
+		dbg_printf("new l2 context %u\n", *cid);
+	int rv = !flow_refresh(peer, t, *cid);
+	if (!rv)
+		flow_full(t, *cid);
+	spin_unlock(&peer->compress_lock[direction][lane]);
 
 	return rv;
 }
 
-int compress_l2(uint8_t *pkt, int nbytes, uint8_t sid, int direction) {
-	(void) pkt;
-	(void) nbytes;
-	(void) sid;
-	(void) direction;
-	tunnel.stats.udp_tx_compressed_pkt++;
-	return FULL_HEADER_LEN;
+// record the session of a frame coming out of the tunnel in context cid, receiver side;
+// return -1 if cid is out of range
+int learn_l2(Peer *peer, uint8_t *pkt, uint16_t cid, int direction, int lane) {
+	Session s;
+	set_session(pkt, &s);
+
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	void *conn = flow_learn(get_table(peer, direction, lane), cid, &s, &found);
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	return (conn)? 1: -1;
 }
 
-int decompress_l2(uint8_t *pkt, int nbytes, uint8_t sid, int direction) {
+int compress_l2(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
 	(void) nbytes;
-	Connection *conn = (direction == S2C)? &connection_s2c[sid]: &connection_c2s[sid];
-	Session *s = &conn->s;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	pkt[FULL_HEADER_LEN - CHECK_LEN] = flow_check(get_table(peer, direction, lane), cid);
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	thread_stats->udp_tx_compressed_pkt++;
+	peer_stats_add(&peer->stats.tx_compressed_pkt, 1);
+	return FULL_HEADER_LEN - CHECK_LEN;
+}
+
+// return the number of bytes added, or -1 if the frame doesn't match the context
+int decompress_l2(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	// the table is shared by all the workers receiving from this peer lane
+	Connection conn;
+	int ok = 0;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowTable *t = get_table(peer, direction, lane);
+	Connection *c = flow_get(t, cid);
+	if (c && nbytes >= CHECK_LEN && pkt[0] == flow_check(t, cid)) {
+		conn = *c;
+		ok = 1;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	if (!ok) {
+		dbg_printf("l2 context %u out of sync\n", cid);
+		thread_stats->udp_rx_drop_compress_pkt++;
+		return -1;
+	}
+	Session *s = &conn.s;
 
 	// build the real header
-	pkt -= FULL_HEADER_LEN;
+	pkt += CHECK_LEN - FULL_HEADER_LEN;
 	memcpy(pkt, s->mac, 14);
 
-	return FULL_HEADER_LEN;
+	return FULL_HEADER_LEN - CHECK_LEN;
 }
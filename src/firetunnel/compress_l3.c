@@ -32,6 +32,7 @@ typedef struct session_t {	// offset
 	uint8_t addr[8];	// 26
 } __attribute__((__packed__)) Session;	// 34
 #define FULL_HEADER_LEN 34
+#define CHECK_LEN 1	// check of the flow key, see flow_check()
 
 // fields not included in params above
 typedef struct new_header_t {	// offset
@@ -41,7 +42,7 @@ typedef struct new_header_t {	// offset
 } __attribute__((__packed__)) NewHeader;
 
 int compress_l3_size(void) {
-	return FULL_HEADER_LEN - sizeof(NewHeader);
+	return FULL_HEADER_LEN - CHECK_LEN - sizeof(NewHeader);
 }
 
 // fill up a session structure; ptr is the start of eth packet
@@ -74,106 +75,136 @@ static void set_new_header(uint8_t *ptr, NewHeader *h) {
 
 
 typedef struct tcp_connection_t {
-	int active;
-	int cnt;
-	Session s;
+	Session s;		// flow key, see flow.c
 } Connection;
-static Connection connection_s2c[256];
-static Connection connection_c2s[256];
 
-void compress_l3_init(void) {
-	memset(connection_s2c, 0, sizeof(connection_s2c));
-	memset(connection_c2s, 0, sizeof(connection_c2s));
+// each peer has one flow table for each direction and tunnel lane, allocated on first use;
+// the caller holds peer->compress_lock
+static FlowTable *get_table(Peer *peer, int direction, int lane) {
+	return flow_table(&peer->compress_l3[direction][lane], sizeof(Connection), sizeof(Session),
+			  (arg_lowmem)? FLOW_MAX_LOWMEM: FLOW_MAX, &peer->compress_used[direction]);
+}
+
+void compress_l3_init(Peer *peer) {
+	int direction;
+	for (direction = S2C; direction <= C2S; direction++) {
+		int lane;
+		for (lane = 0; lane < WORKERS_MAX; lane++) {
+			FlowTable *t = peer->compress_l3[direction][lane];
+			if (!t)
+				continue;
+			spin_lock(&peer->compress_lock[direction][lane]);
+			flow_clear(t);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+		}
+	}
 }
 
-void print_compress_l3_table(int direction) {
-	Connection *conn = (direction == S2C)? &connection_s2c[0]: &connection_c2s[0];
+void print_compress_l3_table(Peer *peer, int direction) {
 	printf("Compression L3 table:\n");
-	int i;
-	for (i = 0; i < 256; i++, conn++) {
-		if (conn->active) {
-			char buf[22];
-			snprintf(buf, 22, "   %d:%d", i, conn->cnt);
-			printf("%-21s", buf);
-			print_session(&conn->s);
+	int lane;
+	for (lane = 0; lane < WORKERS_MAX; lane++) {
+		FlowTable *t = peer->compress_l3[direction][lane];
+		if (!t)
+			continue;
+		spin_lock(&peer->compress_lock[direction][lane]);
+		uint32_t i;
+		for (i = 0; i < t->count; i++) {
+			Connection *conn = (Connection *) t->ctx + i;
+			if (t->ctl[i].cnt) {
+				char buf[32];
+				snprintf(buf, 32, "   %d:%u:%u", lane, i, t->ctl[i].cnt);
+				printf("%-21s", buf);
+				print_session(&conn->s);
+			}
 		}
+		spin_unlock(&peer->compress_lock[direction][lane]);
 	}
 }
 
-// record the session and return 1 if the packet can be compressed
-// store the hash in sid if sid not null
-int classify_l3(uint8_t *pkt, uint8_t *sid, int direction) {
-	int rv = 0;
+// record the session and return 1 if the packet can be compressed, sender side;
+// store the context id in cid
+int classify_l3(Peer *peer, uint8_t *pkt, uint16_t *cid, int direction, int lane) {
 	Session s;
 	set_session(pkt, &s);
 
-	uint8_t hash = 0;
-	unsigned i;
-	uint8_t *ptr = (uint8_t *) &s;
-	for ( i = 0; i < sizeof(s); i++, ptr++)
-		hash ^= *ptr;
-	if (sid)
-		*sid = hash;
-
-	Connection *conn = (direction == S2C)? &connection_s2c[hash]: &connection_c2s[hash];
-	if (conn->active) {
-		if (memcmp(&s, &conn->s, sizeof(Session)) == 0) {
-			conn->cnt++;
-			int cnt = conn->cnt;
-
-			if (cnt > 50 && cnt % 50)
-				rv = 1;
-			else if (cnt > 20 && cnt % 20)
-				rv = 1;
-			else if (cnt > 3 && cnt % 8)
-				rv = 1;
-		}
-		else {
-			dbg_printf("replace l2 hash %d\n", hash);
-			tunnel.stats.compress_hash_collision++;
-			memcpy(&conn->s, &s, sizeof(Session));
-			conn->cnt = 1;
-		}
-	}
-	else {
-		memcpy(&conn->s, &s, sizeof(Session));
-		conn->cnt = 1;
-		conn->active = 1;
-	}
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowTable *t = get_table(peer, direction, lane);
+	flow_find(t, &s, cid, &found);
+	if (!found)
+		dbg_printf("new l3 context %u\n", *cid);
+	int rv = !flow_refresh(peer, t, *cid);
+	if (!rv)
+		flow_full(t, *cid);
+	spin_unlock(&peer->compress_lock[direction][lane]);
 
 	return rv;
 }
 
-int compress_l3(uint8_t *pkt, int nbytes, uint8_t sid, int direction) {
+// record the session of a frame coming out of the tunnel in context cid, receiver side;
+// return -1 if cid is out of range
+int learn_l3(Peer *peer, uint8_t *pkt, uint16_t cid, int direction, int lane) {
+	Session s;
+	set_session(pkt, &s);
+
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	void *conn = flow_learn(get_table(peer, direction, lane), cid, &s, &found);
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	return (conn)? 1: -1;
+}
+
+int compress_l3(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
 //uint16_t len;
 //memcpy(&len, pkt + 14 + 2, 2);
 //len = ntohs(len);
 //printf("len %u, nbytes %d\n", len, nbytes);
 
-	(void) direction;
 	(void) nbytes;
-	(void) sid;
-	tunnel.stats.udp_tx_compressed_pkt++;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	uint8_t check = flow_check(get_table(peer, direction, lane), cid);
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	thread_stats->udp_tx_compressed_pkt++;
+	peer_stats_add(&peer->stats.tx_compressed_pkt, 1);
 	NewHeader h;
 	set_new_header(pkt, &h);
 	memcpy(pkt + FULL_HEADER_LEN - sizeof(h), &h, sizeof(h));
+	pkt[FULL_HEADER_LEN - sizeof(h) - CHECK_LEN] = check;
 
-	return FULL_HEADER_LEN - sizeof(NewHeader);
+	return FULL_HEADER_LEN - CHECK_LEN - sizeof(NewHeader);
 }
 
-int decompress_l3(uint8_t *pkt, int nbytes, uint8_t sid, int direction) {
-	Connection *conn = (direction == S2C)? &connection_s2c[sid]: &connection_c2s[sid];
-	Session *s = &conn->s;
+// return the number of bytes added, or -1 if the frame doesn't match the context
+int decompress_l3(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	// the table is shared by all the workers receiving from this peer lane
+	Connection conn;
+	int ok = 0;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowTable *t = get_table(peer, direction, lane);
+	Connection *c = flow_get(t, cid);
+	if (c && nbytes >= (int) (CHECK_LEN + sizeof(NewHeader)) && pkt[0] == flow_check(t, cid)) {
+		conn = *c;
+		ok = 1;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	if (!ok) {
+		dbg_printf("l3 context %u out of sync\n", cid);
+		thread_stats->udp_rx_drop_compress_pkt++;
+		return -1;
+	}
+	Session *s = &conn.s;
 	NewHeader h;
-	memcpy(&h, pkt, sizeof(h));
+	memcpy(&h, pkt + CHECK_LEN, sizeof(h));
 
 	// build the real header
-	pkt += sizeof(h) - FULL_HEADER_LEN;
+	pkt += CHECK_LEN + sizeof(h) - FULL_HEADER_LEN;
 	memcpy(pkt, s->mac, 14);
 	memcpy(pkt + 14, &s->ver_ihl_tos, 2);
 
 	// recalculate len
-	uint16_t len = nbytes + FULL_HEADER_LEN - sizeof(h) - 14;
+	uint16_t len = nbytes + FULL_HEADER_LEN - CHECK_LEN - sizeof(h) - 14;
 //printf("nbytes %d, new len %d\n", nbytes, len);
 	len = htons(len);
 	memcpy(pkt + 16, &len, 2);
@@ -196,5 +227,5 @@ int decompress_l3(uint8_t *pkt, int nbytes, uint8_t sid, int direction) {
 	checksum = ~checksum;
 	memcpy(pkt + 24, &checksum, 2);
 
-	return FULL_HEADER_LEN - sizeof(NewHeader);
+	return FULL_HEADER_LEN - CHECK_LEN - sizeof(NewHeader);
 }
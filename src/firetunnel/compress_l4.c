@@ -0,0 +1,649 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include <arpa/inet.h>
+
+// TCP header compression scheme based on RFC 2507, with ROHC-style field encoding
+// - one context for each TCP flow, keyed on the Ethernet header, the IP addresses and the
+//   TCP ports; the fields not changing for the life of the flow are kept in the context
+//   (Session), the compressed header carries only the fields that changed
+// - sequence and acknowledgment numbers, IP id and the timestamps option go out as their 8 or
+//   24 least significant bits, and the receiver picks the value closest to its context (W-LSB
+//   encoding); the number of bits covers the change since the last full header, so any frame
+//   received after the last full header is a good context, and a burst of lost packets doesn't
+//   break it
+// - for the same reason a field changed since the last full header is sent in every frame,
+//   even when it didn't change in that frame
+// - IP length and checksum are recalculated; the TCP checksum goes out in full and it is
+//   verified after decompression, a mismatch means the context is out of sync and the frame
+//   is dropped
+// - full headers are sent on the cadence of the L3 compressor, for SYN/FIN/RST segments, and
+//   when TCP reports a loss: a retransmitted segment or a duplicate ACK refresh the context
+// - the context is updated from every frame of the flow on both sides: the sender in
+//   classify_l4() or compress_l4(), the receiver in learn_l4() after decompress_l4()
+// - only IPv4 without options, unfragmented, and TCP without options or with the timestamps
+//   option alone in the usual layout; the other frames go to the L3 compressor
+
+typedef struct session_t {
+	uint8_t mac[14];	// ethernet header
+	uint16_t ver_ihl_tos;	// ip
+	uint16_t offset;	// fragment offset and flags, DF only
+	uint8_t ttl;
+	uint8_t addr[8];
+	uint16_t port[2];	// tcp
+	uint8_t doff;		// tcp header length in 32-bit words, 5 or 8 with timestamps
+} __attribute__((__packed__)) Session;
+
+// fields changing from one segment to the next, host byte order
+typedef struct tcp_fields_t {
+	uint32_t seq;
+	uint32_t ack;
+	uint32_t ts_val;
+	uint32_t ts_ecr;
+	uint16_t window;
+	uint16_t id;
+	uint8_t flags;
+	int len;		// tcp payload length
+} TcpFields;
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+#define TS_OPTION 0x0101080a	// NOP, NOP, timestamps kind and length
+
+// compressed header:
+//    | mask | ts mask (doff 8) | seq | ack | id | window | flags | ts_val | ts_ecr | tcp checksum |
+// the mask holds a 2-bit code for seq, ack and id, and a bit for window and flags; the ts
+// mask holds the codes for ts_val and ts_ecr; the codes are in firetunnel.h, see flow_encode()
+#define M_SEQ 0
+#define M_ACK 2
+#define M_ID 4
+#define M_WINDOW 0x40
+#define M_FLAGS 0x80
+#define M_TS_VAL 0
+#define M_TS_ECR 2
+#define COMPRESSED_MAX 25
+enum {
+	F_SEQ = 0,
+	F_ACK,
+	F_ID,
+	F_WINDOW,
+	F_FLAGS,
+	F_TS_VAL,
+	F_TS_ECR,
+	F_CNT
+};
+
+typedef struct tcp_connection_t {
+	Session s;		// flow key, see flow.c
+	TcpFields f;		// last frame
+	TcpFields full;		// last full header sent
+	unsigned dirty;		// fields changed since the last full header
+} Connection;
+
+// Fill up the session and the fields from the frame in pkt; return 1 if the frame can be
+// compressed, 0 otherwise.
+static int parse(uint8_t *pkt, int nbytes, Session *s, TcpFields *f) {
+	if (!pkt_is_tcp(pkt, nbytes) || pkt[14] != 0x45)
+		return 0;
+	uint16_t iplen;
+	memcpy(&iplen, pkt + 16, 2);
+	uint16_t offset;
+	memcpy(&offset, pkt + 20, 2);
+	if (14 + ntohs(iplen) != nbytes || (ntohs(offset) & 0xbfff))
+		return 0;
+
+	uint8_t *tcp = pkt + 34;
+	int doff = tcp[12] >> 4;
+	uint16_t urg;
+	memcpy(&urg, tcp + 18, 2);
+	if ((tcp[12] & 0x0f) || (tcp[13] & TCP_URG) || urg)
+		return 0;
+	if (doff == 8) {
+		uint32_t opt;
+		memcpy(&opt, tcp + 20, 4);
+		if (ntohl(opt) != TS_OPTION)
+			return 0;
+	}
+	else if (doff != 5)
+		return 0;
+	int len = ntohs(iplen) - 20 - doff * 4;
+	if (len < 0)
+		return 0;
+
+	memcpy(s->mac, pkt, 14);
+	memcpy(&s->ver_ihl_tos, pkt + 14, 2);
+	s->offset = offset;
+	s->ttl = pkt[22];
+	memcpy(s->addr, pkt + 26, 8);
+	memcpy(s->port, tcp, 4);
+	s->doff = doff;
+
+	uint32_t v32;
+	uint16_t v16;
+	memcpy(&v32, tcp + 4, 4);
+	f->seq = ntohl(v32);
+	memcpy(&v32, tcp + 8, 4);
+	f->ack = ntohl(v32);
+	memcpy(&v16, tcp + 14, 2);
+	f->window = ntohs(v16);
+	memcpy(&v16, pkt + 18, 2);
+	f->id = ntohs(v16);
+	f->flags = tcp[13];
+	f->ts_val = 0;
+	f->ts_ecr = 0;
+	if (doff == 8) {
+		memcpy(&v32, tcp + 24, 4);
+		f->ts_val = ntohl(v32);
+		memcpy(&v32, tcp + 28, 4);
+		f->ts_ecr = ntohl(v32);
+	}
+	f->len = len;
+	return 1;
+}
+
+static void print_session(Session *s) {
+	uint32_t ip1;
+	uint32_t ip2;
+	memcpy(&ip1, s->addr, 4);
+	ip1 = ntohl(ip1);
+	memcpy(&ip2, s->addr + 4, 4);
+	ip2 = ntohl(ip2);
+	printf("%d.%d.%d.%d:%u -> %d.%d.%d.%d:%u\n",
+	       PRINT_IP(ip1), ntohs(s->port[0]), PRINT_IP(ip2), ntohs(s->port[1]));
+}
+
+// Store the fields of a new frame in the context; return the fields changed since the last
+// full header, they are sent even if they didn't change in this frame.
+static unsigned update(Connection *conn, TcpFields *f) {
+	TcpFields *ref = &conn->f;
+	int changed[F_CNT] = {
+		f->seq != ref->seq,
+		f->ack != ref->ack,
+		f->id != ref->id,
+		f->window != ref->window,
+		f->flags != ref->flags,
+		f->ts_val != ref->ts_val,
+		f->ts_ecr != ref->ts_ecr
+	};
+	int i;
+	for (i = 0; i < F_CNT; i++) {
+		if (changed[i])
+			conn->dirty |= 1 << i;
+	}
+	conn->f = *f;
+	return conn->dirty;
+}
+
+// each peer has one flow table for each direction and tunnel lane, allocated on first use;
+// the caller holds peer->compress_lock
+static FlowTable *get_table(Peer *peer, int direction, int lane) {
+	return flow_table(&peer->compress_l4[direction][lane], sizeof(Connection), sizeof(Session),
+			  (arg_lowmem)? FLOW_MAX_LOWMEM: FLOW_MAX, &peer->compress_used[direction]);
+}
+
+void compress_l4_init(Peer *peer) {
+	int direction;
+	for (direction = S2C; direction <= C2S; direction++) {
+		int lane;
+		for (lane = 0; lane < WORKERS_MAX; lane++) {
+			FlowTable *t = peer->compress_l4[direction][lane];
+			if (!t)
+				continue;
+			spin_lock(&peer->compress_lock[direction][lane]);
+			flow_clear(t);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+		}
+	}
+}
+
+void print_compress_l4_table(Peer *peer, int direction) {
+	printf("Compression L4 table:\n");
+	int lane;
+	for (lane = 0; lane < WORKERS_MAX; lane++) {
+		FlowTable *t = peer->compress_l4[direction][lane];
+		if (!t)
+			continue;
+		spin_lock(&peer->compress_lock[direction][lane]);
+		uint32_t i;
+		for (i = 0; i < t->count; i++) {
+			Connection *conn = (Connection *) t->ctx + i;
+			if (t->ctl[i].cnt) {
+				char buf[32];
+				snprintf(buf, 32, "   %d:%u:%u", lane, i, t->ctl[i].cnt);
+				printf("%-21s", buf);
+				print_session(&conn->s);
+			}
+		}
+		spin_unlock(&peer->compress_lock[direction][lane]);
+	}
+}
+
+// TCP reports a loss: a segment sent again, or a duplicate ACK
+static int tcp_loss(TcpFields *ref, TcpFields *f) {
+	if (f->len && (int32_t) (f->seq - ref->seq) < ref->len)
+		return 1;
+	if (!f->len && !ref->len && f->ack == ref->ack && f->seq == ref->seq &&
+	    f->window == ref->window && f->flags == TCP_ACK)
+		return 1;
+	return 0;
+}
+
+// Find the context of the flow, sender side; store the context id in cid and return 1 if the
+// frame can be compressed, 0 for a full header, -1 if the frame doesn't fit this profile.
+int classify_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t *cid, int direction, int lane) {
+	Session s;
+	TcpFields f;
+	if (!parse(pkt, nbytes, &s, &f))
+		return -1;
+
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowTable *t = get_table(peer, direction, lane);
+	Connection *conn = flow_find(t, &s, cid, &found);
+	if (!found)
+		dbg_printf("new l4 context %u\n", *cid);
+	int rv = !flow_refresh(peer, t, *cid);
+	if (f.flags & (TCP_SYN | TCP_FIN | TCP_RST))
+		rv = 0;
+	else if (rv && tcp_loss(&conn->f, &f)) {
+		thread_stats->compress_l4_refresh++;
+		rv = 0;
+	}
+
+	// a compressed frame updates the context in compress_l4()
+	if (!rv) {
+		flow_full(t, *cid);
+		update(conn, &f);
+		conn->full = f;
+		conn->dirty = 0;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	return rv;
+}
+
+// Store a frame coming out of the tunnel in the context cid, receiver side; return 0 if the
+// frame doesn't fit this profile, -1 if cid is out of range.
+int learn_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	Session s;
+	TcpFields f;
+	if (!parse(pkt, nbytes, &s, &f))
+		return 0;
+
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	Connection *conn = flow_learn(get_table(peer, direction, lane), cid, &s, &found);
+	if (conn) {
+		update(conn, &f);
+		conn->full = f;
+		conn->dirty = 0;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	return (conn)? 1: -1;
+}
+
+// Replace the headers with the compressed header; return the number of bytes removed from the
+// start of the frame, 0 if the frame goes out uncompressed.
+int compress_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	Session s;
+	TcpFields f;
+	if (!parse(pkt, nbytes, &s, &f))
+		return 0;	// classify_l4() said otherwise
+
+	// hello_tick() or peer_reset() can clear the table after classify_l4() released the lock
+	spin_lock(&peer->compress_lock[direction][lane]);
+	Connection *conn = flow_get(get_table(peer, direction, lane), cid);
+	if (!conn) {
+		spin_unlock(&peer->compress_lock[direction][lane]);
+		return 0;
+	}
+	TcpFields ref = conn->full;
+	unsigned force = update(conn, &f);
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	uint8_t buf[COMPRESSED_MAX];
+	uint8_t *p = buf + ((s.doff == 8)? 2: 1);
+	uint8_t mask = 0;
+	mask |= flow_encode(&p, f.seq, ref.seq, 32, force & (1 << F_SEQ)) << M_SEQ;
+	mask |= flow_encode(&p, f.ack, ref.ack, 32, force & (1 << F_ACK)) << M_ACK;
+	mask |= flow_encode(&p, f.id, ref.id, 16, force & (1 << F_ID)) << M_ID;
+	if (force & (1 << F_WINDOW)) {
+		uint16_t v16 = htons(f.window);
+		memcpy(p, &v16, 2);
+		p += 2;
+		mask |= M_WINDOW;
+	}
+	if (force & (1 << F_FLAGS)) {
+		*p++ = f.flags;
+		mask |= M_FLAGS;
+	}
+	buf[0] = mask;
+	if (s.doff == 8) {
+		buf[1] = flow_encode(&p, f.ts_val, ref.ts_val, 32, force & (1 << F_TS_VAL)) << M_TS_VAL;
+		buf[1] |= flow_encode(&p, f.ts_ecr, ref.ts_ecr, 32, force & (1 << F_TS_ECR)) << M_TS_ECR;
+	}
+	memcpy(p, pkt + 34 + 16, 2);	// tcp checksum
+	p += 2;
+
+	int hdrlen = 34 + s.doff * 4;
+	int clen = p - buf;
+	memcpy(pkt + hdrlen - clen, buf, clen);
+
+	thread_stats->udp_tx_compressed_pkt++;
+	peer_stats_add(&peer->stats.tx_compressed_pkt, 1);
+	return hdrlen - clen;
+}
+
+// Rebuild the headers in front of the compressed header in pkt; return the number of bytes
+// added, or -1 if the frame doesn't match the context.
+int decompress_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	// the table is shared by all the workers receiving from this peer lane
+	Connection conn;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	Connection *c = flow_get(get_table(peer, direction, lane), cid);
+	if (c)
+		conn = *c;
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	if (!c) {
+		thread_stats->udp_rx_drop_compress_pkt++;
+		return -1;
+	}
+	Session *s = &conn.s;
+	TcpFields *ref = &conn.f;
+
+	// decode the fields
+	uint8_t *end = pkt + nbytes;
+	uint8_t *p = pkt + ((s->doff == 8)? 2: 1);
+	if (p > end)
+		goto errout;
+	uint8_t mask = pkt[0];
+	TcpFields f;
+	uint32_t v;
+	if (!flow_decode(&p, end, (mask >> M_SEQ) & 3, ref->seq, 32, &f.seq) ||
+	    !flow_decode(&p, end, (mask >> M_ACK) & 3, ref->ack, 32, &f.ack) ||
+	    !flow_decode(&p, end, (mask >> M_ID) & 3, ref->id, 16, &v))
+		goto errout;
+	f.id = (uint16_t) v;
+	f.window = ref->window;
+	if (mask & M_WINDOW) {
+		if (p + 2 > end)
+			goto errout;
+		uint16_t v16;
+		memcpy(&v16, p, 2);
+		f.window = ntohs(v16);
+		p += 2;
+	}
+	f.flags = ref->flags;
+	if (mask & M_FLAGS) {
+		if (p + 1 > end)
+			goto errout;
+		f.flags = *p++;
+	}
+	if (s->doff == 8 &&
+	    (!flow_decode(&p, end, (pkt[1] >> M_TS_VAL) & 3, ref->ts_val, 32, &f.ts_val) ||
+	     !flow_decode(&p, end, (pkt[1] >> M_TS_ECR) & 3, ref->ts_ecr, 32, &f.ts_ecr)))
+		goto errout;
+	if (p + 2 > end)
+		goto errout;
+	uint16_t checksum;
+	memcpy(&checksum, p, 2);
+	p += 2;
+
+	// build the real header
+	int clen = p - pkt;
+	int hdrlen = 34 + s->doff * 4;
+	int tcplen = s->doff * 4 + (nbytes - clen);
+	pkt += clen - hdrlen;
+	memcpy(pkt, s->mac, 14);
+	uint8_t *ip = pkt + 14;
+	memcpy(ip, &s->ver_ihl_tos, 2);
+	uint16_t v16 = htons(20 + tcplen);
+	memcpy(ip + 2, &v16, 2);
+	v16 = htons(f.id);
+	memcpy(ip + 4, &v16, 2);
+	memcpy(ip + 6, &s->offset, 2);
+	ip[8] = s->ttl;
+	ip[9] = 6;
+	memset(ip + 10, 0, 2);
+	memcpy(ip + 12, s->addr, 8);
+	v16 = csum_fold(csum_add(0, ip, 20));
+	memcpy(ip + 10, &v16, 2);
+
+	uint8_t *tcp = ip + 20;
+	memcpy(tcp, s->port, 4);
+	v = htonl(f.seq);
+	memcpy(tcp + 4, &v, 4);
+	v = htonl(f.ack);
+	memcpy(tcp + 8, &v, 4);
+	tcp[12] = s->doff << 4;
+	tcp[13] = f.flags;
+	v16 = htons(f.window);
+	memcpy(tcp + 14, &v16, 2);
+	memcpy(tcp + 16, &checksum, 2);
+	memset(tcp + 18, 0, 2);
+	if (s->doff == 8) {
+		v = htonl(TS_OPTION);
+		memcpy(tcp + 20, &v, 4);
+		v = htonl(f.ts_val);
+		memcpy(tcp + 24, &v, 4);
+		v = htonl(f.ts_ecr);
+		memcpy(tcp + 28, &v, 4);
+	}
+
+	// the TCP checksum tells if the context was in sync
+	uint32_t sum = csum_add(0, ip + 12, 8);	// pseudo-header: addresses, protocol, TCP length
+	sum += htons(6);
+	sum += htons(tcplen);
+	if (csum_fold(csum_add(sum, tcp, tcplen)) != 0)
+		goto errout;
+
+	return hdrlen - clen;
+
+errout:
+	dbg_printf("l4 context %u out of sync\n", cid);
+	thread_stats->udp_rx_drop_compress_pkt++;
+	return -1;
+}
+
+#ifdef TESTING
+// A bulk TCP transfer and its ACKs across a lossy tunnel, random losses and bursts of 100 lost
+// packets: every frame coming out of the decompressor is compared with the frame sent, and the
+// average header size is printed. The receiver NACKs a damaged context, the NACK reaches the
+// sender one round trip later unless it is lost too.
+//     gcc -O2 -c flow.c offload.c
+//     gcc -O2 -DTESTING compress_l4.c flow.o offload.o -o tcp-compress-test && ./tcp-compress-test 2
+#include <time.h>
+int arg_debug = 0;
+int arg_lowmem = 0;
+int arg_lz = 0;
+static TStats stats;
+__thread TStats *thread_stats = &stats;
+
+#define TEST_PKTS 200000
+static Peer tx;
+static Peer rx;
+
+// Ethernet/IPv4/TCP frame with the timestamps option, checksums included
+static int build(uint8_t *pkt, int dir, uint16_t id, uint32_t seq, uint32_t ack, uint32_t ts_val,
+		 uint32_t ts_ecr, uint8_t flags, int len) {
+	static const uint8_t mac[12] = {2, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 2};
+	static const uint8_t addr[8] = {10, 10, 20, 1, 10, 10, 20, 2};
+	memset(pkt, 0, 66);
+	memcpy(pkt, mac + 6 * dir, 6);
+	memcpy(pkt + 6, mac + 6 * !dir, 6);
+	pkt[12] = 0x08;
+	uint8_t *ip = pkt + 14;
+	ip[0] = 0x45;
+	uint16_t v16 = htons(20 + 32 + len);
+	memcpy(ip + 2, &v16, 2);
+	v16 = htons(id);
+	memcpy(ip + 4, &v16, 2);
+	ip[6] = 0x40;
+	ip[8] = 64;
+	ip[9] = 6;
+	memcpy(ip + 12, addr + 4 * dir, 4);
+	memcpy(ip + 16, addr + 4 * !dir, 4);
+	v16 = csum_fold(csum_add(0, ip, 20));
+	memcpy(ip + 10, &v16, 2);
+
+	uint8_t *tcp = ip + 20;
+	uint16_t port[2] = {htons(40000), htons(80)};
+	memcpy(tcp, &port[dir], 2);
+	memcpy(tcp + 2, &port[!dir], 2);
+	uint32_t v = htonl(seq);
+	memcpy(tcp + 4, &v, 4);
+	v = htonl(ack);
+	memcpy(tcp + 8, &v, 4);
+	tcp[12] = 8 << 4;
+	tcp[13] = flags;
+	v16 = htons(501);
+	memcpy(tcp + 14, &v16, 2);
+	v = htonl(TS_OPTION);
+	memcpy(tcp + 20, &v, 4);
+	v = htonl(ts_val);
+	memcpy(tcp + 24, &v, 4);
+	v = htonl(ts_ecr);
+	memcpy(tcp + 28, &v, 4);
+	int i;
+	for (i = 0; i < len; i++)
+		tcp[32 + i] = (uint8_t) (seq + i);
+	uint32_t sum = csum_add(0, ip + 12, 8);
+	sum += htons(6);
+	sum += htons(32 + len);
+	v16 = csum_fold(csum_add(sum, tcp, 32 + len));
+	memcpy(tcp + 16, &v16, 2);
+	return 66 + len;
+}
+
+static unsigned sent[2];
+static unsigned lost[2];
+static unsigned hdr_bytes[2];
+static unsigned errors;
+static unsigned drops;
+static unsigned nacks;
+
+// NACKs on their way back to the sender
+#define RTT 64		// frames
+static struct {
+	unsigned due;
+	uint16_t cid;
+	int dir;
+} pending[RTT];
+static unsigned now;
+
+// send a frame through the tunnel, with the loss rate in percent
+static void send_frame(uint8_t *frame, int len, int dir, int loss) {
+	static int burst = 0;
+	static uint8_t mem[256 + 2000];
+	uint8_t *pkt = mem + 256;
+	memcpy(pkt, frame, len);
+
+	now++;
+	int i;
+	for (i = 0; i < RTT; i++) {
+		if (pending[i].due == now) {
+			flow_nack(tx.compress_l4[pending[i].dir][0], pending[i].cid);
+			pending[i].due = 0;
+		}
+	}
+
+	uint16_t cid;
+	int rv = 0;
+	if (classify_l4(&tx, pkt, len, &cid, dir, 0) == 1)
+		rv = compress_l4(&tx, pkt, len, cid, dir, 0);
+	pkt += rv;
+	len -= rv;
+	sent[dir]++;
+	hdr_bytes[dir] += 66 - rv;
+	if (loss && rand() % 5000 == 0)
+		burst = 100;
+	if (burst) {
+		burst--;
+		lost[dir]++;
+		return;
+	}
+	if (rand() % 100 < loss) {
+		lost[dir]++;
+		return;
+	}
+
+	if (rv) {
+		rv = decompress_l4(&rx, pkt, len, cid, dir, 0);
+		if (rv < 0) {
+			drops++;
+			if (flow_damaged(rx.compress_l4[dir][0], cid) && rand() % 100 >= loss) {
+				nacks++;
+				pending[now % RTT].due = now + RTT;
+				pending[now % RTT].cid = cid;
+				pending[now % RTT].dir = dir;
+			}
+			return;
+		}
+		pkt -= rv;
+		len += rv;
+	}
+	if (memcmp(pkt, frame, len)) {
+		if (errors++ < 10)
+			printf("error: direction %d, frame %u\n", dir, sent[dir]);
+		return;
+	}
+	learn_l4(&rx, pkt, len, cid, dir, 0);
+}
+
+int main(int argc, char **argv) {
+	int loss = (argc > 1)? atoi(argv[1]): 0;
+	uint8_t frame[2000];
+	uint32_t seq = 1000;
+	uint32_t ack = 5000;
+	uint32_t ts = 100;
+	uint16_t id[2] = {1, 7000};
+	flow_init();
+	flow_loss(&tx, loss * 10);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	send_frame(frame, build(frame, C2S, id[C2S]++, seq - 1, 0, ts, 0, TCP_SYN, 0), C2S, 0);
+	int i;
+	for (i = 0; i < TEST_PKTS; i++) {
+		if (i % 8 == 0)
+			ts++;
+		int len = build(frame, C2S, id[C2S]++, seq, ack, ts, ts - 1, TCP_ACK, 1448);
+		send_frame(frame, len, C2S, loss);
+		seq += 1448;
+
+		// an ACK every two segments
+		if (i % 2)
+			send_frame(frame, build(frame, S2C, id[S2C]++, ack, seq, ts, ts, TCP_ACK, 0), S2C, loss);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+	printf("loss %d%%: data %u frames, header %.1f bytes; ACK %u frames, header %.1f bytes\n", loss,
+	       sent[C2S], (double) hdr_bytes[C2S] / sent[C2S], sent[S2C], (double) hdr_bytes[S2C] / sent[S2C]);
+	printf("%u lost, %u dropped out of sync, %u NACKs, %.1f ns/frame\n",
+	       lost[C2S] + lost[S2C], drops, nacks, ns / (sent[C2S] + sent[S2C]));
+	printf("%s\n", (errors)? "FAILED": "passed");
+	return (errors)? 1: 0;
+}
+#endif
@@ -0,0 +1,656 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include <arpa/inet.h>
+
+// UDP and RTP header compression scheme based on RFC 2508, with ROHC-style field encoding
+// - one context for each UDP flow, keyed on the Ethernet header, the IP addresses and the
+//   UDP ports, same as the TCP compressor in compress_l4.c
+// - UDP ports and length are never sent; the UDP checksum is dropped when the receiver can
+//   compute it again from the rebuilt frame, the payload is authenticated by the tunnel anyway
+// - IP id, RTP sequence number and RTP timestamp go out as their 8 or 24 least significant
+//   bits against the last full header (W-LSB encoding), fields changed since the last full
+//   header are sent in every frame
+// - an RTP timestamp growing at the same rate as the sequence number is not sent at all: the
+//   receiver extrapolates it from its context with the timestamp stride seen on both sides
+// - a CRC-8 over the original IP/UDP/RTP headers is sent in every frame, a mismatch after
+//   decompression means the context is out of sync and the frame is dropped
+// - RTP is detected on the payload: version 2, no padding, extension or CSRC list, not an
+//   RTCP packet type; the SSRC is kept in the context, a new SSRC or a non-RTP frame sends
+//   the RTP header in the payload until the next full header
+// - full headers are sent on the cadence of the L3 compressor
+// - only IPv4 without options, unfragmented; the other frames go to the L3 compressor
+
+typedef struct session_t {
+	uint8_t mac[14];	// ethernet header
+	uint16_t ver_ihl_tos;	// ip
+	uint16_t offset;	// fragment offset and flags, DF only
+	uint8_t ttl;
+	uint8_t addr[8];
+	uint16_t port[2];	// udp
+} __attribute__((__packed__)) Session;
+
+// fields changing from one datagram to the next, host byte order
+typedef struct udp_fields_t {
+	uint16_t id;
+	uint16_t checksum;	// network byte order
+	int rtp;		// RTP header detected
+	uint8_t m_pt;		// RTP marker and payload type
+	uint16_t rtp_seq;
+	uint32_t rtp_ts;
+	uint32_t ssrc;
+} UdpFields;
+
+// compressed header:
+//    | mask | rtp mask (RTP) | id | checksum | rtp seq | m/pt | rtp ts | crc |
+// the mask holds a 2-bit code for id and the checksum, and the RTP bit; the rtp mask holds
+// the codes for the sequence number and the timestamp; the codes are in firetunnel.h, see
+// flow_encode()
+#define M_ID 0
+#define M_CHECKSUM 2
+#define M_RTP 0x10
+#define M_RTP_SEQ 0
+#define M_RTP_TS 2
+#define M_RTP_SCALED 0x10	// timestamp extrapolated from the sequence number
+#define M_RTP_M_PT 0x20
+#define CSUM_ZERO 0		// no UDP checksum
+#define CSUM_REBUILD 1		// computed by the receiver
+#define CSUM_SENT 2		// sent in full
+#define COMPRESSED_MAX 14
+#define RTP_HLEN 12
+enum {
+	F_ID = 0,
+	F_RTP,		// a frame since the last full header was not RTP, or had another SSRC
+	F_RTP_SEQ,
+	F_RTP_TS,
+	F_STRIDE,	// a timestamp since the last full header was off the stride
+	F_M_PT,
+	F_CNT
+};
+
+typedef struct udp_connection_t {
+	Session s;		// flow key, see flow.c
+	UdpFields f;		// last frame
+	UdpFields full;		// last full header sent
+	uint32_t stride;	// RTP timestamp increment for each sequence number
+	unsigned dirty;		// fields changed since the last full header
+} Connection;
+
+// Fill up the session and the fields from the frame in pkt; return 1 if the frame can be
+// compressed, 0 otherwise.
+static int parse(uint8_t *pkt, int nbytes, Session *s, UdpFields *f) {
+	if (!pkt_is_udp(pkt, nbytes) || pkt[14] != 0x45)
+		return 0;
+	uint16_t iplen;
+	memcpy(&iplen, pkt + 16, 2);
+	uint16_t offset;
+	memcpy(&offset, pkt + 20, 2);
+	if (14 + ntohs(iplen) != nbytes || (ntohs(offset) & 0xbfff))
+		return 0;
+	uint8_t *udp = pkt + 34;
+	uint16_t udplen;
+	memcpy(&udplen, udp + 4, 2);
+	if (ntohs(udplen) != ntohs(iplen) - 20)
+		return 0;
+
+	memcpy(s->mac, pkt, 14);
+	memcpy(&s->ver_ihl_tos, pkt + 14, 2);
+	s->offset = offset;
+	s->ttl = pkt[22];
+	memcpy(s->addr, pkt + 26, 8);
+	memcpy(s->port, udp, 4);
+
+	uint16_t v16;
+	uint32_t v32;
+	memcpy(&v16, pkt + 18, 2);
+	f->id = ntohs(v16);
+	memcpy(&f->checksum, udp + 6, 2);
+
+	// RTP version 2 without padding, extension and CSRC, RTCP packet types 200 to 204 excluded
+	uint8_t *rtp = udp + 8;
+	int pt = rtp[1] & 0x7f;
+	f->rtp = (nbytes >= 42 + RTP_HLEN && rtp[0] == 0x80 && (pt < 72 || pt > 76));
+	f->m_pt = 0;
+	f->rtp_seq = 0;
+	f->rtp_ts = 0;
+	f->ssrc = 0;
+	if (f->rtp) {
+		f->m_pt = rtp[1];
+		memcpy(&v16, rtp + 2, 2);
+		f->rtp_seq = ntohs(v16);
+		memcpy(&v32, rtp + 4, 4);
+		f->rtp_ts = ntohl(v32);
+		memcpy(&v32, rtp + 8, 4);
+		f->ssrc = ntohl(v32);
+	}
+	return 1;
+}
+
+static void print_session(Session *s) {
+	uint32_t ip1;
+	uint32_t ip2;
+	memcpy(&ip1, s->addr, 4);
+	ip1 = ntohl(ip1);
+	memcpy(&ip2, s->addr + 4, 4);
+	ip2 = ntohl(ip2);
+	printf("%d.%d.%d.%d:%u -> %d.%d.%d.%d:%u\n",
+	       PRINT_IP(ip1), ntohs(s->port[0]), PRINT_IP(ip2), ntohs(s->port[1]));
+}
+
+// UDP checksum of the datagram at ip, as the receiver computes it
+static uint16_t udp_checksum(uint8_t *ip, int udplen) {
+	uint8_t *udp = ip + 20;
+	uint16_t saved;
+	memcpy(&saved, udp + 6, 2);
+	memset(udp + 6, 0, 2);
+	uint32_t sum = csum_add(0, ip + 12, 8);	// pseudo-header: addresses, protocol, UDP length
+	sum += htons(17);
+	sum += htons(udplen);
+	uint16_t checksum = csum_fold(csum_add(sum, udp, udplen));
+	if (checksum == 0)
+		checksum = 0xffff;
+	memcpy(udp + 6, &saved, 2);
+	return checksum;
+}
+
+// Store the fields of a new frame in the context and follow the RTP timestamp stride; return
+// the fields changed since the last full header, they are sent even if they didn't change in
+// this frame.
+static unsigned update(Connection *conn, UdpFields *f) {
+	UdpFields *ref = &conn->f;
+	int same_rtp = f->rtp && ref->rtp && f->ssrc == ref->ssrc;
+	int changed[F_CNT] = {
+		f->id != ref->id,
+		!same_rtp || !conn->full.rtp || f->ssrc != conn->full.ssrc,
+		f->rtp_seq != ref->rtp_seq,
+		f->rtp_ts != ref->rtp_ts,
+		0,
+		f->m_pt != ref->m_pt
+	};
+
+	if (same_rtp) {
+		int16_t dseq = (int16_t) (f->rtp_seq - ref->rtp_seq);
+		uint32_t dts = f->rtp_ts - ref->rtp_ts;
+		if (dseq <= 0 || dts != conn->stride * (uint32_t) dseq) {
+			changed[F_STRIDE] = 1;
+			if (dseq > 0 && dts % dseq == 0)
+				conn->stride = dts / dseq;
+		}
+	}
+	else
+		changed[F_STRIDE] = 1;
+
+	int i;
+	for (i = 0; i < F_CNT; i++) {
+		if (changed[i])
+			conn->dirty |= 1 << i;
+	}
+	conn->f = *f;
+	return conn->dirty;
+}
+
+// each peer has one flow table for each direction and tunnel lane, allocated on first use;
+// the caller holds peer->compress_lock
+static FlowTable *get_table(Peer *peer, int direction, int lane) {
+	return flow_table(&peer->compress_udp[direction][lane], sizeof(Connection), sizeof(Session),
+			  (arg_lowmem)? FLOW_MAX_LOWMEM: FLOW_MAX, &peer->compress_used[direction]);
+}
+
+void compress_udp_init(Peer *peer) {
+	int direction;
+	for (direction = S2C; direction <= C2S; direction++) {
+		int lane;
+		for (lane = 0; lane < WORKERS_MAX; lane++) {
+			FlowTable *t = peer->compress_udp[direction][lane];
+			if (!t)
+				continue;
+			spin_lock(&peer->compress_lock[direction][lane]);
+			flow_clear(t);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+		}
+	}
+}
+
+void print_compress_udp_table(Peer *peer, int direction) {
+	printf("Compression UDP table:\n");
+	int lane;
+	for (lane = 0; lane < WORKERS_MAX; lane++) {
+		FlowTable *t = peer->compress_udp[direction][lane];
+		if (!t)
+			continue;
+		spin_lock(&peer->compress_lock[direction][lane]);
+		uint32_t i;
+		for (i = 0; i < t->count; i++) {
+			Connection *conn = (Connection *) t->ctx + i;
+			if (t->ctl[i].cnt) {
+				char buf[32];
+				snprintf(buf, 32, "   %d:%u:%u%s", lane, i, t->ctl[i].cnt, (conn->f.rtp)? " rtp": "");
+				printf("%-21s", buf);
+				print_session(&conn->s);
+			}
+		}
+		spin_unlock(&peer->compress_lock[direction][lane]);
+	}
+}
+
+// Find the context of the flow, sender side; store the context id in cid and return 1 if the
+// frame can be compressed, 0 for a full header, -1 if the frame doesn't fit this profile.
+int classify_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t *cid, int direction, int lane) {
+	Session s;
+	UdpFields f;
+	if (!parse(pkt, nbytes, &s, &f))
+		return -1;
+
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowTable *t = get_table(peer, direction, lane);
+	Connection *conn = flow_find(t, &s, cid, &found);
+	if (!found)
+		dbg_printf("new udp context %u\n", *cid);
+	int rv = !flow_refresh(peer, t, *cid);
+
+	// a compressed frame updates the context in compress_udp(); after a full header the
+	// timestamp is extrapolated only if all the frames since the previous full header were
+	// on the stride, the receiver could have lost this one
+	if (!rv) {
+		flow_full(t, *cid);
+		conn->dirty = update(conn, &f) & (1 << F_STRIDE);
+		conn->full = f;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	return rv;
+}
+
+// Store a frame coming out of the tunnel in the context cid, receiver side; return 0 if the
+// frame doesn't fit this profile, -1 if cid is out of range.
+int learn_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	Session s;
+	UdpFields f;
+	if (!parse(pkt, nbytes, &s, &f))
+		return 0;
+
+	int found;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	Connection *conn = flow_learn(get_table(peer, direction, lane), cid, &s, &found);
+	if (conn) {
+		conn->dirty = update(conn, &f) & (1 << F_STRIDE);
+		conn->full = f;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	return (conn)? 1: -1;
+}
+
+// Replace the headers with the compressed header; return the number of bytes removed from the
+// start of the frame, 0 if the frame goes out uncompressed.
+int compress_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	Session s;
+	UdpFields f;
+	if (!parse(pkt, nbytes, &s, &f))
+		return 0;	// classify_udp() said otherwise
+
+	// hello_tick() or peer_reset() can clear the table after classify_udp() released the lock
+	spin_lock(&peer->compress_lock[direction][lane]);
+	Connection *conn = flow_get(get_table(peer, direction, lane), cid);
+	if (!conn) {
+		spin_unlock(&peer->compress_lock[direction][lane]);
+		return 0;
+	}
+	UdpFields ref = conn->full;
+	unsigned force = update(conn, &f);
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	int rtp = f.rtp && !(force & (1 << F_RTP));
+	int hdrlen = 42 + ((rtp)? RTP_HLEN: 0);
+	uint8_t crc = flow_crc8(pkt + 14, hdrlen - 14);
+
+	uint8_t buf[COMPRESSED_MAX];
+	uint8_t *p = buf + ((rtp)? 2: 1);
+	uint8_t mask = 0;
+	mask |= flow_encode(&p, f.id, ref.id, 16, force & (1 << F_ID)) << M_ID;
+	if (f.checksum == 0)
+		mask |= CSUM_ZERO << M_CHECKSUM;
+	else if (f.checksum == udp_checksum(pkt + 14, nbytes - 34))
+		mask |= CSUM_REBUILD << M_CHECKSUM;
+	else {
+		memcpy(p, &f.checksum, 2);
+		p += 2;
+		mask |= CSUM_SENT << M_CHECKSUM;
+	}
+	if (rtp) {
+		mask |= M_RTP;
+		uint8_t rmask = 0;
+		rmask |= flow_encode(&p, f.rtp_seq, ref.rtp_seq, 16, force & (1 << F_RTP_SEQ)) << M_RTP_SEQ;
+		if (force & (1 << F_M_PT)) {
+			*p++ = f.m_pt;
+			rmask |= M_RTP_M_PT;
+		}
+		if (!(force & (1 << F_STRIDE)))
+			rmask |= M_RTP_SCALED;
+		else
+			rmask |= flow_encode(&p, f.rtp_ts, ref.rtp_ts, 32, force & (1 << F_RTP_TS)) << M_RTP_TS;
+		buf[1] = rmask;
+	}
+	buf[0] = mask;
+	*p++ = crc;
+
+	int clen = p - buf;
+	memcpy(pkt + hdrlen - clen, buf, clen);
+
+	thread_stats->udp_tx_compressed_pkt++;
+	peer_stats_add(&peer->stats.tx_compressed_pkt, 1);
+	return hdrlen - clen;
+}
+
+// Rebuild the headers in front of the compressed header in pkt; return the number of bytes
+// added, or -1 if the frame doesn't match the context.
+int decompress_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane) {
+	// the table is shared by all the workers receiving from this peer lane
+	Connection conn;
+	spin_lock(&peer->compress_lock[direction][lane]);
+	Connection *c = flow_get(get_table(peer, direction, lane), cid);
+	if (c)
+		conn = *c;
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	if (!c || nbytes < 2) {
+		thread_stats->udp_rx_drop_compress_pkt++;
+		return -1;
+	}
+	Session *s = &conn.s;
+	UdpFields *ref = &conn.f;
+
+	// decode the fields
+	uint8_t *end = pkt + nbytes;
+	uint8_t mask = pkt[0];
+	int rtp = mask & M_RTP;
+	uint8_t *p = pkt + ((rtp)? 2: 1);
+	if (p > end || (mask & 0xe0) || (rtp && !ref->rtp))
+		goto errout;
+	UdpFields f;
+	uint32_t v;
+	if (!flow_decode(&p, end, (mask >> M_ID) & 3, ref->id, 16, &v))
+		goto errout;
+	f.id = (uint16_t) v;
+	int csum = (mask >> M_CHECKSUM) & 3;
+	f.checksum = 0;
+	if (csum == CSUM_SENT) {
+		if (p + 2 > end)
+			goto errout;
+		memcpy(&f.checksum, p, 2);
+		p += 2;
+	}
+	else if (csum != CSUM_ZERO && csum != CSUM_REBUILD)
+		goto errout;
+	if (rtp) {
+		uint8_t rmask = pkt[1];
+		if (!flow_decode(&p, end, (rmask >> M_RTP_SEQ) & 3, ref->rtp_seq, 16, &v))
+			goto errout;
+		f.rtp_seq = (uint16_t) v;
+		f.m_pt = ref->m_pt;
+		if (rmask & M_RTP_M_PT) {
+			if (p + 1 > end)
+				goto errout;
+			f.m_pt = *p++;
+		}
+		if (rmask & M_RTP_SCALED)
+			f.rtp_ts = ref->rtp_ts + conn.stride * (uint32_t) (int16_t) (f.rtp_seq - ref->rtp_seq);
+		else if (!flow_decode(&p, end, (rmask >> M_RTP_TS) & 3, ref->rtp_ts, 32, &f.rtp_ts))
+			goto errout;
+		f.ssrc = ref->ssrc;
+	}
+	if (p + 1 > end)
+		goto errout;
+	uint8_t crc = *p++;
+
+	// build the real header
+	int clen = p - pkt;
+	int hdrlen = 42 + ((rtp)? RTP_HLEN: 0);
+	int udplen = 8 + ((rtp)? RTP_HLEN: 0) + (nbytes - clen);
+	pkt += clen - hdrlen;
+	memcpy(pkt, s->mac, 14);
+	uint8_t *ip = pkt + 14;
+	memcpy(ip, &s->ver_ihl_tos, 2);
+	uint16_t v16 = htons(20 + udplen);
+	memcpy(ip + 2, &v16, 2);
+	v16 = htons(f.id);
+	memcpy(ip + 4, &v16, 2);
+	memcpy(ip + 6, &s->offset, 2);
+	ip[8] = s->ttl;
+	ip[9] = 17;
+	memset(ip + 10, 0, 2);
+	memcpy(ip + 12, s->addr, 8);
+	v16 = csum_fold(csum_add(0, ip, 20));
+	memcpy(ip + 10, &v16, 2);
+
+	uint8_t *udp = ip + 20;
+	memcpy(udp, s->port, 4);
+	v16 = htons(udplen);
+	memcpy(udp + 4, &v16, 2);
+	if (rtp) {
+		uint8_t *h = udp + 8;
+		h[0] = 0x80;
+		h[1] = f.m_pt;
+		v16 = htons(f.rtp_seq);
+		memcpy(h + 2, &v16, 2);
+		v = htonl(f.rtp_ts);
+		memcpy(h + 4, &v, 4);
+		v = htonl(f.ssrc);
+		memcpy(h + 8, &v, 4);
+	}
+	if (csum == CSUM_REBUILD)
+		f.checksum = udp_checksum(ip, udplen);
+	memcpy(udp + 6, &f.checksum, 2);
+
+	// the CRC tells if the context was in sync
+	if (flow_crc8(ip, hdrlen - 14) != crc)
+		goto errout;
+
+	return hdrlen - clen;
+
+errout:
+	dbg_printf("udp context %u out of sync\n", cid);
+	thread_stats->udp_rx_drop_compress_pkt++;
+	return -1;
+}
+
+#ifdef TESTING
+// A voice call (RTP, 20 ms frames, talkspurts and silence) and a plain UDP flow across a lossy
+// tunnel, random losses and bursts of 100 lost packets: every frame coming out of the
+// decompressor is compared with the frame sent, and the average header size is printed. The
+// receiver NACKs a damaged context, the NACK reaches the sender one round trip later unless it
+// is lost too.
+//     gcc -O2 -c flow.c offload.c
+//     gcc -O2 -DTESTING compress_udp.c flow.o offload.o -o udp-compress-test && ./udp-compress-test 2
+#include <time.h>
+int arg_debug = 0;
+int arg_lowmem = 0;
+int arg_lz = 0;
+static TStats stats;
+__thread TStats *thread_stats = &stats;
+
+#define TEST_PKTS 200000
+static Peer tx;
+static Peer rx;
+
+// Ethernet/IPv4/UDP frame, an RTP header if rtp is set, checksums included
+static int build(uint8_t *pkt, int dir, uint16_t id, int rtp, uint8_t m_pt, uint16_t seq, uint32_t ts,
+		 int len) {
+	static const uint8_t mac[12] = {2, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 2};
+	static const uint8_t addr[8] = {10, 10, 20, 1, 10, 10, 20, 2};
+	int udplen = 8 + ((rtp)? RTP_HLEN: 0) + len;
+	memset(pkt, 0, 42 + RTP_HLEN);
+	memcpy(pkt, mac + 6 * dir, 6);
+	memcpy(pkt + 6, mac + 6 * !dir, 6);
+	pkt[12] = 0x08;
+	uint8_t *ip = pkt + 14;
+	ip[0] = 0x45;
+	uint16_t v16 = htons(20 + udplen);
+	memcpy(ip + 2, &v16, 2);
+	v16 = htons(id);
+	memcpy(ip + 4, &v16, 2);
+	ip[6] = 0x40;
+	ip[8] = 64;
+	ip[9] = 17;
+	memcpy(ip + 12, addr + 4 * dir, 4);
+	memcpy(ip + 16, addr + 4 * !dir, 4);
+	v16 = csum_fold(csum_add(0, ip, 20));
+	memcpy(ip + 10, &v16, 2);
+
+	uint8_t *udp = ip + 20;
+	uint16_t port[2] = {htons(16384 + 2 * rtp), htons(16386)};
+	memcpy(udp, &port[dir], 2);
+	memcpy(udp + 2, &port[!dir], 2);
+	v16 = htons(udplen);
+	memcpy(udp + 4, &v16, 2);
+	uint8_t *data = udp + 8;
+	if (rtp) {
+		data[0] = 0x80;
+		data[1] = m_pt;
+		v16 = htons(seq);
+		memcpy(data + 2, &v16, 2);
+		uint32_t v = htonl(ts);
+		memcpy(data + 4, &v, 4);
+		v = htonl(0x12345678 + dir);
+		memcpy(data + 8, &v, 4);
+		data += RTP_HLEN;
+	}
+	int i;
+	for (i = 0; i < len; i++)
+		data[i] = (uint8_t) (seq + i + 1);
+	v16 = udp_checksum(ip, udplen);
+	memcpy(udp + 6, &v16, 2);
+	return 14 + 20 + udplen;
+}
+
+static unsigned sent;
+static unsigned lost;
+static unsigned hdr_bytes[2];
+static unsigned frames[2];
+static unsigned errors;
+static unsigned drops;
+static unsigned nacks;
+
+// NACKs on their way back to the sender
+#define RTT 16		// frames
+static struct {
+	unsigned due;
+	uint16_t cid;
+} pending[RTT];
+
+// send a frame through the tunnel, with the loss rate in percent
+static void send_frame(uint8_t *frame, int len, int rtp, int loss) {
+	static int burst = 0;
+	static uint8_t mem[256 + 2000];
+	uint8_t *pkt = mem + 256;
+	memcpy(pkt, frame, len);
+
+	int i;
+	for (i = 0; i < RTT; i++) {
+		if (pending[i].due == sent + 1) {
+			flow_nack(tx.compress_udp[C2S][0], pending[i].cid);
+			pending[i].due = 0;
+		}
+	}
+
+	uint16_t cid;
+	int rv = 0;
+	if (classify_udp(&tx, pkt, len, &cid, C2S, 0) == 1)
+		rv = compress_udp(&tx, pkt, len, cid, C2S, 0);
+	pkt += rv;
+	len -= rv;
+	sent++;
+	frames[rtp]++;
+	hdr_bytes[rtp] += 42 + ((rtp)? RTP_HLEN: 0) - rv;
+	if (loss && rand() % 5000 == 0)
+		burst = 100;
+	if (burst) {
+		burst--;
+		lost++;
+		return;
+	}
+	if (rand() % 100 < loss) {
+		lost++;
+		return;
+	}
+
+	if (rv) {
+		rv = decompress_udp(&rx, pkt, len, cid, C2S, 0);
+		if (rv < 0) {
+			drops++;
+			if (flow_damaged(rx.compress_udp[C2S][0], cid) && rand() % 100 >= loss) {
+				nacks++;
+				pending[sent % RTT].due = sent + RTT;
+				pending[sent % RTT].cid = cid;
+			}
+			return;
+		}
+		pkt -= rv;
+		len += rv;
+	}
+	if (memcmp(pkt, frame, len)) {
+		if (errors++ < 10)
+			printf("error: frame %u\n", sent);
+		return;
+	}
+	learn_udp(&rx, pkt, len, cid, C2S, 0);
+}
+
+int main(int argc, char **argv) {
+	int loss = (argc > 1)? atoi(argv[1]): 0;
+	uint8_t frame[2000];
+	uint16_t seq = 65000;
+	uint32_t ts = 0xfffff000;
+	uint16_t id = 1;
+	flow_init();
+	flow_loss(&tx, loss * 10);
+	compress_udp_init(&tx);
+	compress_udp_init(&rx);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int i;
+	for (i = 0; i < TEST_PKTS; i++) {
+		// 20 ms G.711 frames, talkspurts of 3 seconds followed by 1 second of silence
+		int talk = i % 200;
+		if (talk == 150)
+			ts += 50 * 160;
+		if (talk < 150) {
+			uint8_t m_pt = (talk == 0)? 0x80: 0;
+			send_frame(frame, build(frame, C2S, id++, 1, m_pt, seq++, ts, 160), 1, loss);
+			ts += 160;
+		}
+
+		// a plain UDP flow, the checksum is sent once in a while
+		int len = build(frame, C2S, id++, 0, 0, (uint16_t) i, 0, 100 + i % 1000);
+		if (i % 100 == 0)
+			memset(frame + 40, 0, 2);
+		send_frame(frame, len, 0, loss);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+
+	printf("loss %d%%: RTP %u frames, header %.1f bytes; UDP %u frames, header %.1f bytes\n", loss,
+	       frames[1], (double) hdr_bytes[1] / frames[1], frames[0], (double) hdr_bytes[0] / frames[0]);
+	printf("%u lost, %u dropped out of sync, %u NACKs, %.1f ns/frame\n", lost, drops, nacks, ns / sent);
+	printf("%s\n", (errors)? "FAILED": "passed");
+	return (errors)? 1: 0;
+}
+#endif
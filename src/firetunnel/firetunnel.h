@@ -30,6 +30,11 @@
 #include <netinet/in.h>
 #include <stdarg.h>
 #include <net/if.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define errExit(msg)    do { char msgout[500]; sprintf(msgout, "Error %s: %s:%d %s", msg, __FILE__, __LINE__, __FUNCTION__); perror(msgout); exit(1);} while (0)
 
@@ -102,6 +107,16 @@ static inline void dbg_memory(void *ptr, int len) {
 	printf("\n");
 }
 
+// lock for the data shared by the worker threads, the critical sections are very short
+static inline void spin_lock(int *lock) {
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static inline void spin_unlock(int *lock) {
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
 extern int arg_debug;
 extern int arg_debug_compress;
 static inline void dbg_printf(char *fmt, ...) {
@@ -139,10 +154,9 @@ static inline void dbg_printf(char *fmt, ...) {
 // Packet sequence
 // - it is incremented every time a packet is sent
 // - it is reseted when the session is disconnected
-// - a mechanism to filter packet duplicates is implemented in packet.c
-//        - this limits the incoming UDP speed to SEQ_DELTA_MAX packets per second
+// - duplicates and replayed packets are filtered with a sliding window over a 64-bit
+//   extended sequence number, see replay.c
 #define SEQ_DELTA_MAX 8192  // client/server maximum seq delta for accepting packets - power of 2
-#define SEQ_BITMAP (SEQ_DELTA_MAX - 1)
 
 // BLAKE2 configuration
 #define SECRET_FILE (SYSCONFDIR "/firetunnel.secret")	// use this file to generate a huge (KEY_MAX) list of keys
@@ -158,10 +172,23 @@ typedef struct packet_header_t {
 #define O_DATA  2
 #define O_DATA_COMPRESSED_L3  3
 #define O_DATA_COMPRESSED_L2  4
-#define O_MAX 5 // the last one
+#define O_DATA_COMPRESSED_L4  5
+#define O_DATA_COMPRESSED_UDP  6
+#define O_NACK 7	// loss measured by the receiver, compression contexts to refresh
+#define O_DATA_LZ  8	// payload compression, the original opcode goes in front of the compressed data
+// O_DATA to O_DATA_COMPRESSED_UDP for a context id above 255, the high byte travels with the
+// frame, see child.c
+#define O_DATA_CID16  9
+#define O_DATA_COMPRESSED_L3_CID16  10
+#define O_DATA_COMPRESSED_L2_CID16  11	// not sent, the L2 table holds 256 contexts
+#define O_DATA_COMPRESSED_L4_CID16  12
+#define O_DATA_COMPRESSED_UDP_CID16  13
+#define O_MAX 14 // the last one
 
 // flags
-#define F_SYNC 1
+#define F_SYNC 1	// hello: reset the compression contexts
+#define F_LANE_SHIFT 1	// data, bits 1 to 3: lane of the sending worker, it selects the compression tables
+#define F_LANE_MASK 0x0e
 
 #if BYTE_ORDER == BIG_ENDIAN
 	uint8_t opcode: 4;
@@ -171,26 +198,50 @@ typedef struct packet_header_t {
 	uint8_t opcode: 4;
 #endif
 
-	uint8_t sid;		// session id for header compression
+	uint8_t sid;		// header compression context id, low byte
 	uint16_t seq;	// packet sequence number
 	uint32_t timestamp;	// epoch timestamp
 } __attribute__((__packed__)) PacketHeader;	// 8 bytes
 
+static inline int opcode_is_data(uint8_t opcode) {
+	return (opcode >= O_DATA && opcode <= O_DATA_COMPRESSED_UDP) || opcode == O_DATA_LZ ||
+	       (opcode >= O_DATA_CID16 && opcode < O_MAX);
+}
+
+// the flags a packet may carry, a packet with any other flag is dropped
+static inline uint8_t opcode_flags(uint8_t opcode) {
+	if (opcode == O_HELLO)
+		return F_SYNC;
+	if (opcode_is_data(opcode))
+		return F_LANE_MASK;
+	return 0;
+}
+
 typedef struct udp_frame_t {
 	PacketHeader header;	// 8 bytes
 	uint8_t eth[2000];	// enough room to fit a 1500 eth packet in
 } UdpFrame;
 
+// Packet buffer
+// - headroom: the decompressed headers grow in front of the Ethernet frame, the io_uring
+//   engine also receives the source address there
+// - tailroom: the BLAKE2 tag goes after the largest frame read from the tap device
+// - the size is a multiple of the cache line, and the UDP payload starts on a cache line
+#define PKT_HEADROOM 128
+#define PKT_TAILROOM 64
 typedef struct packet_mem_t {
-	uint32_t header_expansion[32];
+	uint8_t headroom[PKT_HEADROOM];
 	UdpFrame f;
-} PacketMem;
+	uint8_t tailroom[PKT_TAILROOM];
+} __attribute__((aligned(64))) PacketMem;
 
 
 
 //****************************************************
 // Tunnel structure
 //****************************************************
+#define WORKERS_MAX 8	// the lane field in the packet header is 3 bits
+
 typedef enum connection_state_t {
 	S_DISCONNECTED,
 	S_CONNECTED,
@@ -208,9 +259,44 @@ typedef struct tstats_t {
 	unsigned udp_rx_drop_padding_pkt;
 	unsigned eth_rx_dns;
 
+	// batched I/O - number of recvmmsg()/sendmmsg() calls
+	unsigned udp_rx_batch;
+	unsigned udp_tx_batch;
+	unsigned udp_tx_gso_pkt;	// packets sent in UDP_SEGMENT buffers
+	unsigned udp_rx_gro_pkt;	// packets received in coalesced UDP_GRO buffers
+	unsigned udp_tx_xdp_pkt;	// packets sent on the AF_XDP socket
+	unsigned udp_rx_xdp_pkt;	// packets received on the AF_XDP socket
+
+	// frames dropped because the tap queue was full
+	unsigned eth_tx_drop_pkt;
+	// frames read from the tap device and dropped because the UDP queue was full
+	unsigned eth_rx_drop_pkt;
+	unsigned eth_rx_tso_pkt;	// segments cut from TSO super-frames
+
 	// header compression
-	unsigned compress_hash_collision;
+	unsigned compress_evict;	// flows evicted from a full flow table
+	unsigned compress_nack_tx;	// damaged contexts reported to the other end
+	unsigned compress_nack_rx;	// contexts refreshed on request of the other end
 	unsigned udp_tx_compressed_pkt;
+	unsigned compress_l4_refresh;	// full TCP headers sent after a loss reported by TCP
+	unsigned udp_rx_drop_compress_pkt;	// frames not matching the decompression context
+	unsigned compress_l2_saved;	// bytes removed by each compression profile
+	unsigned compress_l3_saved;
+	unsigned compress_l4_saved;
+	unsigned compress_udp_saved;
+
+	// payload compression
+	unsigned lz_in;			// bytes of the frames offered to the compressor
+	unsigned lz_out;		// bytes sent
+	unsigned lz_tried;		// bytes going through the compressor
+	unsigned lz_kcycles;		// CPU cycles in units of 1024
+	unsigned lz_pkt;		// frames compressed
+
+	// scrambler plugin, CPU cycles in units of 1024
+	unsigned plugin_tx_pkt;
+	unsigned plugin_rx_pkt;
+	unsigned plugin_tx_kcycles;
+	unsigned plugin_rx_kcycles;
 } TStats;
 
 typedef struct toverlay_t {
@@ -225,17 +311,12 @@ typedef struct toverlay_t {
 
 typedef struct tunnel_t {
 	// descriptors etc.
-	int udpfd;
-	int tapfd;
+	int udpfd[WORKERS_MAX];	// one UDP socket for each worker
+	int tapfd[WORKERS_MAX];	// one tap queue for each worker
+	struct xsk_t *xsk[WORKERS_MAX];	// AF_XDP sockets, NULL if not used
 	char tap_device_name[IFNAMSIZ + 1];
 	char bridge_device_name[IFNAMSIZ + 1];
 
-	// connection
-	ConnectionState state;
-	int connect_ttl;
-	struct sockaddr_in remote_sock_addr;
-	uint16_t seq;
-
 	// network overlay - the configuration takes place on the server side
 	TOverlay overlay;
 
@@ -247,6 +328,114 @@ inline static void reset_stats(Tunnel *t) {
 	memset(&t->stats, 0, sizeof(TStats));
 }
 
+// per peer statistics, updated by all the workers
+typedef struct peer_stats_t {
+	unsigned tx_pkt;
+	unsigned tx_compressed_pkt;
+	unsigned rx_pkt;
+} PeerStats;
+
+// Link and IP layer addresses used for building the packets sent on the AF_XDP socket,
+// learned from the packets received from the peer
+typedef struct xdp_route_t {
+	uint8_t mac[12];	// destination and source MAC addresses
+	uint32_t saddr;		// our IP address, network byte order
+	int valid;
+} XdpRoute;
+
+// replay window, see replay.c
+#define REPLAY_WORDS (SEQ_DELTA_MAX / 64)
+typedef struct replay_t {
+	int lock;
+	uint32_t max_ts;		// newest timestamp received
+	uint64_t top;			// newest extended sequence number received
+	uint64_t base;			// lowest sequence number received with timestamp max_ts
+	uint64_t prev_base;		// same for max_ts - 1
+	uint64_t bitmap[REPLAY_WORDS];	// packets received, a bit for each sequence number
+} Replay;
+
+// header compression contexts of a peer, for one direction and lane, see flow.c
+#define FLOW_MAX 65536		// the context id goes out in 16 bits
+#define FLOW_MAX_LOWMEM 1024	// --lowmem
+// contexts of a peer in all the tables of one direction, besides the first ones of each table
+#define FLOW_PEER_MAX 16384
+#define FLOW_PEER_MAX_LOWMEM 2048	// --lowmem
+typedef struct flow_ctl_t {
+	uint32_t cnt;		// frames of the flow, 0 for a free context
+	uint16_t since;		// sender: frames since the last full header
+	uint8_t ref;		// sender: CLOCK reference bit
+	uint8_t nack;		// sender: full header requested; receiver: frames lost since the last NACK
+} FlowCtl;
+
+typedef struct flow_lz_t {
+	uint64_t cycles;	// CPU cycles spent in the compressor
+	uint32_t in;		// bytes of the frames offered to the payload compressor
+	uint32_t out;		// bytes sent
+	uint32_t tried;		// bytes going through the compressor
+	uint16_t ratio;		// recent compression ratio, 1/256 units, 0 if not known yet
+	uint8_t miss;		// attempts without a gain in a row
+	uint8_t skip;		// frames to send as they are before the next attempt
+} FlowLz;
+
+typedef struct flow_table_t {
+	uint8_t *ctx;		// contexts, esize bytes each, starting with the flow key
+	uint32_t *hash;		// hash of the key of each context
+	FlowCtl *ctl;
+	FlowLz *lz;		// payload compression, sender side, NULL without --lz
+	uint32_t *index;	// open addressing, cid + 1 of the flow, 0 for an empty slot
+	int esize;
+	int klen;
+	uint32_t size;		// index slots, a power of 2
+	uint32_t count;		// contexts in use
+	uint32_t cap;		// contexts allocated
+	uint32_t max;		// contexts allowed, FLOW_MAX at most
+	uint32_t hand;		// CLOCK hand
+	uint32_t *used;		// contexts allocated by the peer in this direction, see flow_table()
+} FlowTable;
+
+// Peer session
+// - the server has one session for each client, the client has only one session, the server
+// - memory: about 2KB for the structure, plus about 120 bytes for each flow seen in a lane,
+//   FLOW_PEER_MAX flows in each direction
+typedef struct peer_t {
+	int id;				// index in the peer table
+	struct sockaddr_in addr;	// remote address
+	ConnectionState state;
+	int connect_ttl;
+	uint16_t seq;			// packet sequence
+	PeerStats stats;
+	XdpRoute route;			// AF_XDP return path, guarded by route_lock
+	int route_lock;
+
+	// header compression tables, allocated on first use
+	void *compress_l2[2][WORKERS_MAX];
+	void *compress_l3[2][WORKERS_MAX];
+	void *compress_l4[2][WORKERS_MAX];
+	void *compress_udp[2][WORKERS_MAX];
+	int compress_lock[2][WORKERS_MAX];
+	uint32_t compress_used[2];	// contexts allocated in each direction, FLOW_PEER_MAX at most
+
+	// header compression feedback, see flow.c
+	int rx_loss;			// loss measured on the packets from the peer, per mille
+	int tx_loss;			// loss reported by the peer
+	int compress_refresh;		// full header every compress_refresh frames of a flow
+	int compress_start;		// full headers starting a flow
+	unsigned loss_pkt;		// rx_pkt and replay top at the start of the loss measurement
+	uint64_t loss_top;
+
+	// replay protection, shared by all the workers
+	Replay replay;
+} Peer;
+
+// the packet sequence is shared by all the workers
+static inline uint16_t peer_next_seq(Peer *p) {
+	return __atomic_add_fetch(&p->seq, 1, __ATOMIC_RELAXED);
+}
+
+static inline void peer_stats_add(unsigned *counter, unsigned val) {
+	__atomic_add_fetch(counter, val, __ATOMIC_RELAXED);
+}
+
 
 // main.c
 #define RUN_DIR "/run/firetunnel"
@@ -261,6 +450,24 @@ extern int arg_noscrambling;	// no scrambling
 extern int arg_nonat;		// no NAT
 extern int arg_daemonize;	// run as a daemon
 extern int arg_noseccomp;
+#define DEFAULT_BATCH 32	// packets processed in one recvmmsg()/sendmmsg() call
+#define BATCH_MAX 1024
+extern int arg_batch;		// batch size; 1 disables batching
+extern int arg_nogso;		// UDP segmentation offload disabled
+extern int arg_nogro;		// UDP receive coalescing disabled
+extern int arg_tso;		// tap device offloads, TSO super-frames segmented in userspace
+extern int arg_hugepages;	// packet buffers on hugepages
+extern int arg_keycache;	// key dictionaries cached in RUN_DIR
+extern int arg_lowmem;		// keys derived on demand, no dictionaries in memory
+extern int arg_lz;		// payload compression
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+extern int arg_engine;		// I/O engine for the data path
+extern char *arg_xdp;		// network interface for the AF_XDP fast path, NULL if disabled
+extern int arg_workers;		// number of worker threads and tap queues
+extern int arg_cpu[WORKERS_MAX];	// CPU list for pinning the workers
+extern int arg_cpu_cnt;
+extern char *arg_plugin;	// scrambler plugin, NULL if not used
 
 // packet.c
 static inline int pkt_is_ipv6(uint8_t *pkt, int nbytes) { // pkt - start of the Ethernet frame
@@ -352,10 +559,34 @@ static inline int pkt_is_udp(uint8_t *pkt, int nbytes) { // pkt - start of the E
 
 
 void pkt_set_header(PacketHeader *header, uint8_t opcode, uint32_t seq) ;
-int pkt_check_header(UdpFrame *pkt, unsigned len, struct sockaddr_in *client_addr);
-void pkt_send_hello(UdpFrame *frame, int udpfd);
+enum {
+	AUTH_FAIL = 0,
+	AUTH_OK,
+	AUTH_UNKNOWN,		// the tag was not checked yet
+	AUTH_DESCRAMBLED	// the tag was checked and the data descrambled by the plugin
+};
+void pkt_sign_batch(uint8_t **pkt, unsigned *len, int n);
+void pkt_verify_batch(uint8_t **pkt, unsigned *len, int n, uint8_t *auth);
+int pkt_check_header(Peer *peer, UdpFrame *pkt, unsigned len, struct sockaddr_in *client_addr, int auth);
+void pkt_send_hello(Peer *peer, UdpFrame *frame, int udpfd);
+#define NACK_ENTRY 4
+#define NACK_MAX 256	// contexts in a NACK packet
+void pkt_send_nack(Peer *peer, UdpFrame *frame, int udpfd, const uint8_t *entries, int cnt);
 void pkt_print_stats(UdpFrame *frame, int udpfd);
 
+// peer.c
+#define PEERS_MAX 1024	// maximum number of clients connected to a server
+extern Peer *peers[PEERS_MAX];
+extern int peers_cnt;
+void peer_init(void);
+Peer *peer_find(struct sockaddr_in *addr);
+Peer *peer_add(struct sockaddr_in *addr);
+void peer_remove(Peer *p);
+void peer_learn(Peer *p, uint8_t *mac);
+Peer *peer_lookup_mac(uint8_t *mac);
+int peer_connected(void);
+int peer_rx_loss(Peer *p);
+
 // log.c
 #define LOG_MSGS_MAX_TIMEOUT 10	// don't allow not more then 10 messages per TIMEOUT interval
 extern int logcnt;
@@ -364,14 +595,56 @@ void logmsg(char *fmt, ...);
 // blake2-ref.c
 int blake2( void *out, size_t outlen, const void *in, size_t inlen, const void *key, size_t keylen );
 
+// blake2b-simd.c
+void blake2_select(void);
+int blake2b_mb_enabled(void);
+void blake2b_keyed_mb(uint8_t **out, size_t outlen, const uint64_t **h, uint8_t **in, const unsigned *inlen, int n);
+
 // secret.c
-uint8_t enc_dictionary[KEY_LEN * KEY_MAX];
+extern uint8_t *auth_dictionary;	// KEY_MAX keys of KEY_LEN bytes
+extern uint8_t *enc_dictionary;
 void init_keys(uint16_t port);
-uint8_t *get_hash(uint8_t *in, unsigned inlen, uint32_t timestamp, uint32_t seq);
+void get_hash(uint8_t *in, unsigned inlen, uint32_t timestamp, uint32_t seq, uint8_t *out);
+typedef struct hash_req_t {
+	uint8_t *in;
+	unsigned inlen;
+	uint32_t timestamp;
+	uint32_t seq;
+	uint8_t *out;		// KEY_LEN bytes
+} HashReq;
+#define HASH_BATCH 64		// packets hashed in a single get_hash_batch() call
+void get_hash_batch(HashReq *req, int n);
+const uint64_t *get_hash_state(uint32_t timestamp, uint32_t seq);
 
 // scramble.c
+extern int scramble_fused;
+void scramble_init(void);
 void scramble(uint8_t *ptr, int len, PacketHeader *hdr);
 void descramble(uint8_t *ptr, int len, PacketHeader *hdr);
+void scramble_sign(PacketHeader *hdr, int len);
+int descramble_verify(PacketHeader *hdr, int len);
+
+// replay.c
+void replay_init(Replay *r);
+int replay_check(Replay *r, uint16_t seq, uint32_t ts);
+int replay_update(Replay *r, uint16_t seq, uint32_t ts);
+
+// plugin.c
+void plugin_load(const char *fname);
+const char *plugin_name(void);
+void plugin_scramble(uint8_t **pkt, unsigned *len, int n);
+void plugin_descramble(uint8_t **pkt, unsigned *len, int n);
+
+// CPU cycles for the cost reports, the plugin and the payload compressor
+static inline uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
 // usage.c
 void usage(void);
@@ -383,9 +656,22 @@ void net_set_mtu(const char *ifname, int mtu);
 int net_get_mtu(const char *ifname);
 int net_add_bridge(const char *ifname);
 void net_bridge_add_interface(const char *bridge, const char *dev);
-int net_tap_open(char *devname);
-int net_udp_server(int port);
-int net_udp_client(void);
+void net_bridge_hairpin(const char *dev);
+int net_tap_open(char *devname, int *fds, int queues);
+void net_udp_server(int port, int *fds, int socks);
+void net_udp_client(int *fds, int socks);
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103	// missing in old libc headers
+#endif
+#define GSO_SEGS_MAX 64		// datagrams in a single UDP_SEGMENT buffer, UDP_MAX_SEGMENTS in the kernel
+#define GSO_BYTES_MAX 65000	// the buffer goes out as a single UDP packet before segmentation
+int net_udp_gso(int fd);
+#ifndef UDP_GRO
+#define UDP_GRO 104	// missing in old libc headers
+#endif
+#define GRO_BUFS 8		// coalesced buffers received in a single recvmmsg() call
+#define GRO_BYTES 65536		// size of a coalesced buffer
+int net_udp_gro(int fd);
 void net_ipforward(void);
 char *net_get_nat_if(void);
 void net_set_netfilter(char *ifname);
@@ -396,18 +682,179 @@ void seccomp(const char *id, const char *str);
 void switch_user(const char *username);
 
 // child.c
+extern __thread TStats *thread_stats;	// statistics of the current worker
 void child(int socket);
 
+// pool.c
+typedef struct packet_pool_t {
+	PacketMem *mem;		// size buffers
+	size_t len;		// length of the mapping
+	PacketMem **free;	// free buffers
+	unsigned cnt;
+	unsigned size;
+	int huge;		// the mapping sits on hugepages
+} PacketPool;
+
+void pool_init(PacketPool *p, unsigned size);
+PacketMem *pool_get(PacketPool *p);
+void pool_put(PacketPool *p, PacketMem *mem);
+
+// queue.c
+typedef struct queue_entry_t {
+	PacketMem *mem;	// packet buffer
+	Peer *peer;	// destination of a tunnel packet
+	uint8_t *start;	// start of the data in the buffer
+	int len;	// data length
+} QueueEntry;
+
+typedef struct queue_t {
+	QueueEntry *entry;
+	unsigned size;	// number of entries in the ring
+	unsigned head;	// first entry in use
+	unsigned cnt;	// number of entries in use
+} Queue;
+#define QUEUE_LEN_MIN 256	// the queues hold at least 4 batches
+
+static inline unsigned queue_free(Queue *q) {
+	return q->size - q->cnt;
+}
+
+void queue_init(Queue *q, unsigned size, PacketPool *pool);
+QueueEntry *queue_free_entry(Queue *q, unsigned i);
+void queue_push(Queue *q, unsigned i);
+QueueEntry *queue_entry(Queue *q, unsigned i);
+void queue_pop(Queue *q, unsigned n);
+
 // profile.c
 extern uint32_t profile_netaddr;
 extern uint32_t profile_netmask;
 extern uint32_t profile_defaultgw;
 extern uint32_t profile_mtu;
+extern int profile_batch;
+extern int profile_engine;
+extern int profile_workers;
+extern int profile_cpu[WORKERS_MAX];
+extern int profile_cpu_cnt;
 extern char *profile_child_seccomp;
 extern char *profile_parent_seccomp;
+extern char *profile_plugin;
+int profile_cpu_list(const char *str, int *cpu);
+int profile_engine_id(const char *name);
 void load_profile(const char *fname);
 void save_profile(const char *fname, TOverlay *o);
 
+// offload.c
+#define TSO_BYTES 65536		// largest frame read from the tap device with --tso
+#define TSO_FRAME_MAX (sizeof(((UdpFrame *) 0)->eth))	// largest segment
+typedef struct tso_t {
+	uint8_t *frame;		// TCP/IPv4 super-frame
+	int len;
+	int iplen;		// IP header length
+	int hdrlen;		// Ethernet + IP + TCP header length
+	int mss;		// TCP payload in each segment
+	int offset;		// next payload byte
+	int segment;		// segment number
+	uint16_t id;		// IP id of the first segment
+	uint32_t seq;		// TCP sequence number of the first segment
+} Tso;
+struct virtio_net_hdr;
+uint32_t csum_add(uint32_t sum, const uint8_t *ptr, int len);
+uint16_t csum_fold(uint32_t sum);
+int tso_checksum(uint8_t *frame, int len, struct virtio_net_hdr *vh);
+int tso_init(Tso *t, struct virtio_net_hdr *vh, uint8_t *frame, int len);
+int tso_next(Tso *t, uint8_t *dst);
+
+// uring.c
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef IORING_RECV_MULTISHOT	// multishot receive and provided buffer rings, Linux 6.0
+#define HAVE_URING
+typedef struct uring_t {
+	int fd;
+	void *ring;		// submission and completion rings
+	size_t ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned local_tail;	// entries prepared, not yet published
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+} Uring;
+
+typedef struct uring_bufring_t {
+	struct io_uring_buf_ring *br;
+	size_t len;
+	unsigned mask;
+	uint16_t tail;
+	uint16_t added;		// buffers added, not yet committed
+	int bgid;
+} UringBufRing;
+
+int uring_init(Uring *r, unsigned entries, unsigned cq_entries);
+void uring_free(Uring *r);
+int uring_register(Uring *r, unsigned opcode, void *arg, unsigned nr);
+struct io_uring_sqe *uring_sqe(Uring *r);
+int uring_submit(Uring *r, unsigned wait);
+struct io_uring_cqe *uring_cqe(Uring *r);
+void uring_cqe_seen(Uring *r);
+int uring_bufring_init(Uring *r, UringBufRing *b, unsigned entries, int bgid);
+void uring_bufring_add(UringBufRing *b, void *addr, unsigned len, uint16_t bid);
+void uring_bufring_commit(UringBufRing *b);
+#endif
+
+// xdp.c
+#define XSK_FRAME_SIZE 2048
+#define XSK_RING_SIZE 1024	// frames for receiving, and as many for sending
+#define XSK_FRAMES (2 * XSK_RING_SIZE)
+#define XSK_KICK_MAX 16		// sendto() calls for flushing the transmit ring
+#define XDP_HDR_LEN (14 + 20 + 8)	// Ethernet + IPv4 + UDP headers
+#define XDP_PAYLOAD_MAX (XSK_FRAME_SIZE - XDP_HDR_LEN)
+typedef struct xsk_ring_t {
+	unsigned *producer;
+	unsigned *consumer;
+	void *desc;		// struct xdp_desc for rx/tx, frame address for fill/completion
+	unsigned mask;
+	unsigned local;		// transmit entries queued, not yet published
+	void *map;
+	size_t map_len;
+} XskRing;
+
+typedef struct xsk_t {
+	int fd;
+	int queue;		// receive queue on the network interface
+	uint16_t port;		// local UDP port, network byte order
+	uint16_t ip_id;
+	uint8_t *umem;		// XSK_FRAMES frames
+	XskRing fill;
+	XskRing comp;
+	XskRing rx;
+	XskRing tx;
+	uint64_t *tx_free;	// free transmit frames
+	unsigned tx_free_cnt;
+} Xsk;
+
+int xdp_open(const char *ifname, int udpfd, Xsk **xsk, int workers);
+unsigned xsk_rx_peek(Xsk *x, unsigned max);
+uint8_t *xsk_rx_frame(Xsk *x, unsigned i, unsigned *len);
+void xsk_rx_release(Xsk *x, unsigned n);
+uint8_t *xsk_tx_alloc(Xsk *x);
+void xsk_tx_push(Xsk *x, uint8_t *frame, unsigned len);
+unsigned xsk_tx_kick(Xsk *x);
+uint8_t *xdp_parse(uint8_t *frame, unsigned flen, struct sockaddr_in *addr, XdpRoute *route, int *len);
+unsigned xdp_build(Xsk *x, uint8_t *frame, XdpRoute *route, struct sockaddr_in *dst,
+		   const uint8_t *payload, int len);
+
 // dns.c
 void dns_test(const char *server_ip);
 void dns_set_tunnel(void);
@@ -419,18 +866,66 @@ typedef enum {
 } Direction;
 
 int compress_l3_size(void);
-void compress_l3_init(void);
-void print_compress_l3_table(int direction);
-int classify_l3(uint8_t *pkt, uint8_t *sid, int directin);
-int compress_l3(uint8_t *pkt, int nbytes, uint8_t sid, int direction);
-int decompress_l3(uint8_t *pkt, int nbytes, uint8_t sid, int direction);
+void compress_l3_init(Peer *peer);
+void print_compress_l3_table(Peer *peer, int direction);
+int classify_l3(Peer *peer, uint8_t *pkt, uint16_t *cid, int direction, int lane);
+int learn_l3(Peer *peer, uint8_t *pkt, uint16_t cid, int direction, int lane);
+int compress_l3(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+int decompress_l3(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+
+// compress_l4.c
+void compress_l4_init(Peer *peer);
+void print_compress_l4_table(Peer *peer, int direction);
+int classify_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t *cid, int direction, int lane);
+int learn_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+int compress_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+int decompress_l4(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+
+// flow.c
+#define C_SAME 0	// not sent, same value as in the context
+#define C_LSB8 1	// 8 least significant bits
+#define C_LSB24 2	// 24 least significant bits
+#define C_FULL 3	// 32 or 16 bits
+void flow_init(void);
+FlowTable *flow_table(void **slot, int esize, int klen, uint32_t max, uint32_t *used);
+void flow_clear(FlowTable *t);
+void *flow_find(FlowTable *t, const void *key, uint16_t *cid, int *found);
+int flow_refresh(Peer *peer, FlowTable *t, uint16_t cid);
+void flow_full(FlowTable *t, uint16_t cid);
+void flow_nack(FlowTable *t, uint16_t cid);
+void *flow_learn(FlowTable *t, uint16_t cid, const void *key, int *found);
+void *flow_get(FlowTable *t, uint16_t cid);
+int flow_damaged(FlowTable *t, uint16_t cid);
+uint8_t flow_check(FlowTable *t, uint16_t cid);
+void flow_loss(Peer *peer, int loss);
+int flow_encode(uint8_t **p, uint32_t v, uint32_t ref, int bits, int force);
+int flow_decode(uint8_t **p, uint8_t *end, int code, uint32_t ref, int bits, uint32_t *v);
+uint8_t flow_crc8(const uint8_t *ptr, int len);
+
+// compress_udp.c
+void compress_udp_init(Peer *peer);
+void print_compress_udp_table(Peer *peer, int direction);
+int classify_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t *cid, int direction, int lane);
+int learn_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+int compress_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+int decompress_udp(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
 
 // compress_l2.c
 int compress_l2_size(void);
-void compress_l2_init(void);
-void print_compress_l2_table(int direction);
-int classify_l2(uint8_t *pkt, uint8_t *sid, int direction);
-int compress_l2(uint8_t *pkt, int nbytes, uint8_t sid, int direction);
-int decompress_l2(uint8_t *pkt, int nbytes, uint8_t sid, int direction);
+void compress_l2_init(Peer *peer);
+void print_compress_l2_table(Peer *peer, int direction);
+int classify_l2(Peer *peer, uint8_t *pkt, uint16_t *cid, int direction, int lane);
+int learn_l2(Peer *peer, uint8_t *pkt, uint16_t cid, int direction, int lane);
+int compress_l2(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+int decompress_l2(Peer *peer, uint8_t *pkt, int nbytes, uint16_t cid, int direction, int lane);
+
+// lz.c
+#define LZ_FRAME_MAX 1600	// largest frame compressed, it fits in an AF_XDP frame once decompressed
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int max);
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int max);
+int lz_encode(Peer *peer, FlowTable *t, uint16_t cid, uint8_t *pkt, int nbytes, uint8_t opcode,
+	      int direction, int lane);
+int lz_decode(uint8_t *pkt, int nbytes, uint8_t *opcode);
+void print_lz_table(Peer *peer, int direction);
 
 #endif
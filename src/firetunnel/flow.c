@@ -0,0 +1,704 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+
+// Flow table for the header compression contexts
+// - the contexts are numbered from 0, the number (cid) goes out in every packet of the flow,
+//   full headers included; the sender picks the cid of a new flow, the receiver stores the
+//   context at the cid it is given and it never looks up a flow
+// - the sender finds the cid with a CRC32C hash of the flow key, the static part of the
+//   headers kept at the start of the context, in an open addressing index with linear
+//   probing; the keys are compared only when the hashes match
+// - the table starts small and doubles up to its maximum size; a full table evicts a context
+//   with CLOCK: every lookup sets a reference bit, the hand clears the bits until it finds a
+//   context not used since its last pass
+// - the receiver doesn't grow the table above its maximum size either, whatever cid the
+//   peer sends; the frames of a context above the limit are dropped
+// - all the tables of a peer in one direction, the 4 profiles in every lane, share a budget of
+//   FLOW_PEER_MAX contexts on top of the first FLOW_START of each table; the sender evicts a
+//   flow instead of going over it, and the receiver drops the frames of a context it cannot
+//   allocate: a peer sending any cid it likes doesn't get more memory than a regular one
+// - the index is at most half full and it is rebuilt when the table grows; an evicted flow is
+//   removed from the index with backward shift deletion, there are no tombstones
+// - context resynchronization: the receiver asks for a full header (NACK) when a frame doesn't
+//   decompress, only the damaged flow is refreshed; the periodic refresh and the number of
+//   full headers starting a flow follow the packet loss measured by the receiver, see
+//   flow_loss()
+// - a compressed frame carries a check of the flow key when the compressor has no checksum
+//   of its own covering the static fields, see flow_check()
+// - with --lz the sender also keeps the payload compression history of each flow, see lz.c
+
+#define FLOW_START 64	// initial number of contexts
+#define REFRESH_MIN 8	// full header every REFRESH_MIN frames at most
+#define REFRESH_MAX 256	// and REFRESH_MAX frames at least
+#define START_MAX 8	// full headers starting a flow
+#define NACK_REPEAT 8	// a NACK goes out again after NACK_REPEAT more damaged frames
+
+static uint32_t crc_table[256];
+static uint8_t crc8_table[256];
+
+static uint32_t crc32c_ref(const uint8_t *ptr, int len) {
+	uint32_t crc = 0xffffffff;
+	while (len--)
+		crc = crc_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define FLOW_CRC32C_HW
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const uint8_t *ptr, int len) {
+	uint64_t crc = 0xffffffff;
+	for (; len >= 8; len -= 8, ptr += 8) {
+		uint64_t v;
+		memcpy(&v, ptr, 8);
+		crc = _mm_crc32_u64(crc, v);
+	}
+	uint32_t crc32 = (uint32_t) crc;
+	while (len--)
+		crc32 = _mm_crc32_u8(crc32, *ptr++);
+	return ~crc32;
+}
+#endif
+
+static int crc32c_hw = 0;	// a direct call, indirect branches go through a thunk
+
+static inline uint32_t crc32c(const uint8_t *ptr, int len) {
+#ifdef FLOW_CRC32C_HW
+	if (crc32c_hw)
+		return crc32c_sse42(ptr, len);
+#endif
+	return crc32c_ref(ptr, len);
+}
+
+// build the CRC tables and select the SSE4.2 instruction if the CPU has it
+void flow_init(void) {
+	int i;
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		int j;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1)? (crc >> 1) ^ 0x82f63b78: crc >> 1;
+		crc_table[i] = crc;
+	}
+
+	// CRC-8, polynomial x^8 + x^2 + x + 1
+	for (i = 0; i < 256; i++) {
+		uint8_t crc = i;
+		int j;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x80)? (crc << 1) ^ 0x07: crc << 1;
+		crc8_table[i] = crc;
+	}
+
+#ifdef FLOW_CRC32C_HW
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		const uint8_t test[] = "123456789";
+		if (crc32c_sse42(test, 9) == 0xe3069283)
+			crc32c_hw = 1;
+	}
+#endif
+}
+
+// Return the table in *slot, allocated on first use; the caller holds peer->compress_lock. The
+// contexts above the first FLOW_START are counted in *used, shared by the tables of the peer
+// in this direction.
+FlowTable *flow_table(void **slot, int esize, int klen, uint32_t max, uint32_t *used) {
+	FlowTable *t = *slot;
+	if (!t) {
+		t = malloc(sizeof(FlowTable));
+		if (!t)
+			errExit("malloc");
+		memset(t, 0, sizeof(FlowTable));
+		t->esize = esize;
+		t->klen = klen;
+		t->max = max;
+		t->used = used;
+		*slot = t;
+	}
+	return t;
+}
+
+void flow_clear(FlowTable *t) {
+	if (t->ctx)
+		memset(t->ctx, 0, (size_t) t->cap * t->esize);
+	if (t->index)
+		memset(t->index, 0, t->size * sizeof(uint32_t));
+	if (t->ctl)
+		memset(t->ctl, 0, t->cap * sizeof(FlowCtl));
+	if (t->lz)
+		memset(t->lz, 0, t->cap * sizeof(FlowLz));
+	t->count = 0;
+	t->hand = 0;
+}
+
+// grow the context arrays to cap entries, the new entries are zeroed
+static void grow(FlowTable *t, uint32_t cap) {
+	t->ctx = realloc(t->ctx, (size_t) cap * t->esize);
+	t->hash = realloc(t->hash, cap * sizeof(uint32_t));
+	t->ctl = realloc(t->ctl, cap * sizeof(FlowCtl));
+	if (!t->ctx || !t->hash || !t->ctl)
+		errExit("realloc");
+	memset(t->ctx + (size_t) t->cap * t->esize, 0, (size_t) (cap - t->cap) * t->esize);
+	memset(t->hash + t->cap, 0, (cap - t->cap) * sizeof(uint32_t));
+	memset(t->ctl + t->cap, 0, (cap - t->cap) * sizeof(FlowCtl));
+	if (arg_lz) {
+		t->lz = realloc(t->lz, cap * sizeof(FlowLz));
+		if (!t->lz)
+			errExit("realloc");
+		memset(t->lz + t->cap, 0, (cap - t->cap) * sizeof(FlowLz));
+	}
+	t->cap = cap;
+}
+
+// Take the contexts needed to grow the table to cap from the budget of the peer; return 0 if
+// the budget is spent. The tables of the peer are under different locks.
+static int charge(FlowTable *t, uint32_t cap) {
+	uint32_t n = cap - ((t->cap)? t->cap: FLOW_START);
+	if (n == 0)
+		return 1;
+	uint32_t budget = (arg_lowmem)? FLOW_PEER_MAX_LOWMEM: FLOW_PEER_MAX;
+	if (__atomic_add_fetch(t->used, n, __ATOMIC_RELAXED) <= budget)
+		return 1;
+	__atomic_sub_fetch(t->used, n, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void index_insert(FlowTable *t, uint32_t cid) {
+	uint32_t mask = t->size - 1;
+	uint32_t i = t->hash[cid] & mask;
+	while (t->index[i])
+		i = (i + 1) & mask;
+	t->index[i] = cid + 1;
+}
+
+// rebuild the index for the current number of contexts
+static void index_build(FlowTable *t) {
+	free(t->index);
+	t->size = 2 * t->cap;
+	t->index = malloc(t->size * sizeof(uint32_t));
+	if (!t->index)
+		errExit("malloc");
+	memset(t->index, 0, t->size * sizeof(uint32_t));
+	uint32_t cid;
+	for (cid = 0; cid < t->count; cid++)
+		index_insert(t, cid);
+}
+
+// remove cid from the index, the entries following it in the probe sequence move back
+static void index_remove(FlowTable *t, uint32_t cid) {
+	uint32_t mask = t->size - 1;
+	uint32_t i = t->hash[cid] & mask;
+	while (t->index[i] != cid + 1)
+		i = (i + 1) & mask;
+
+	uint32_t j = i;
+	while (1) {
+		t->index[i] = 0;
+		uint32_t home;
+		do {
+			j = (j + 1) & mask;
+			if (!t->index[j])
+				return;
+			home = t->hash[t->index[j] - 1] & mask;
+			// the entry at j stays if its home slot is cyclically in (i, j]
+		} while ((i <= j)? (i < home && home <= j): (i < home || home <= j));
+		t->index[i] = t->index[j];
+		i = j;
+	}
+}
+
+// compare two keys 8 bytes at a time, the keys are short
+static inline int key_equal(const uint8_t *a, const uint8_t *b, int len) {
+	uint64_t d = 0;
+	for (; len >= 8; len -= 8, a += 8, b += 8) {
+		uint64_t x, y;
+		memcpy(&x, a, 8);
+		memcpy(&y, b, 8);
+		d |= x ^ y;
+	}
+	while (len--)
+		d |= *a++ ^ *b++;
+	return d == 0;
+}
+
+// Find the context of the flow with this key, sender side. Return the context and store its
+// number in cid. A new flow gets a zeroed context with the key copied in, and *found is 0;
+// its cid is either a new one or the cid of the context evicted.
+void *flow_find(FlowTable *t, const void *key, uint16_t *cid, int *found) {
+	uint32_t hash = crc32c(key, t->klen);
+	if (t->index) {
+		uint32_t mask = t->size - 1;
+		uint32_t i = hash & mask;
+		uint32_t c;
+		while ((c = t->index[i]) != 0) {
+			c--;
+			uint8_t *ctx = t->ctx + (size_t) c * t->esize;
+			if (t->hash[c] == hash && key_equal(ctx, key, t->klen)) {
+				t->ctl[c].ref = 1;
+				*cid = c;
+				*found = 1;
+				return ctx;
+			}
+			i = (i + 1) & mask;
+		}
+	}
+
+	// a new flow
+	uint32_t c;
+	uint32_t cap = (t->cap)? 2 * t->cap: FLOW_START;
+	if (cap > t->max)
+		cap = t->max;
+	if (t->count < t->cap)
+		c = t->count++;
+	else if (t->cap < t->max && charge(t, cap)) {
+		grow(t, cap);
+		index_build(t);
+		c = t->count++;
+	}
+	else {
+		// CLOCK: second chance for the contexts used since the last pass of the hand
+		while (t->ctl[t->hand].ref) {
+			t->ctl[t->hand].ref = 0;
+			t->hand = (t->hand + 1) % t->cap;
+		}
+		c = t->hand;
+		t->hand = (t->hand + 1) % t->cap;
+		index_remove(t, c);
+		thread_stats->compress_evict++;
+	}
+
+	uint8_t *ctx = t->ctx + (size_t) c * t->esize;
+	memset(ctx, 0, t->esize);
+	memcpy(ctx, key, t->klen);
+	t->hash[c] = hash;
+	memset(&t->ctl[c], 0, sizeof(FlowCtl));
+	t->ctl[c].ref = 1;
+	if (t->lz)
+		memset(&t->lz[c], 0, sizeof(FlowLz));
+	index_insert(t, c);
+	*cid = c;
+	*found = 0;
+	return ctx;
+}
+
+// Count a frame of the context cid, sender side; return 1 if the frame goes out with a full
+// header: the first frames of a flow, the periodic refresh, or a NACK from the receiver.
+int flow_refresh(Peer *peer, FlowTable *t, uint16_t cid) {
+	FlowCtl *c = &t->ctl[cid];
+	c->cnt++;
+	c->since++;
+	return c->cnt <= (uint32_t) peer->compress_start || c->since >= peer->compress_refresh || c->nack;
+}
+
+// a full header of the context cid goes out, sender side
+void flow_full(FlowTable *t, uint16_t cid) {
+	t->ctl[cid].since = 0;
+	t->ctl[cid].nack = 0;
+}
+
+// the receiver asked for a full header of the context cid, sender side
+void flow_nack(FlowTable *t, uint16_t cid) {
+	if (cid < t->count && t->ctl[cid].cnt)
+		t->ctl[cid].nack = 1;
+}
+
+// the slot of context cid on the receiver side, the table grows as needed within the budget
+// of the peer; NULL if cid is out of range
+static uint8_t *slot(FlowTable *t, uint16_t cid) {
+	if (cid >= t->max)
+		return NULL;
+	if (cid >= t->cap) {
+		uint32_t cap = (t->cap)? t->cap: FLOW_START;
+		while (cap <= cid)
+			cap *= 2;
+		if (!charge(t, cap))
+			return NULL;
+		grow(t, cap);
+	}
+	if (cid >= t->count)
+		t->count = cid + 1;
+	return t->ctx + (size_t) cid * t->esize;
+}
+
+// Store the key of a frame coming out of the tunnel in the context cid, receiver side. A new
+// key starts a new context, zeroed, and *found is 0. Return NULL if cid is above the size
+// of the table.
+void *flow_learn(FlowTable *t, uint16_t cid, const void *key, int *found) {
+	uint8_t *ctx = slot(t, cid);
+	if (!ctx)
+		return NULL;
+	FlowCtl *c = &t->ctl[cid];
+	*found = c->cnt && key_equal(ctx, key, t->klen);
+	if (!*found) {
+		memset(ctx, 0, t->esize);
+		memcpy(ctx, key, t->klen);
+		t->hash[cid] = crc32c(key, t->klen);
+		memset(c, 0, sizeof(FlowCtl));
+	}
+	c->cnt++;
+	c->nack = 0;
+	return ctx;
+}
+
+// Return the context cid, or NULL if there is no flow with this id; the sender gets the
+// contexts from flow_find(), the receiver from flow_learn().
+void *flow_get(FlowTable *t, uint16_t cid) {
+	if (cid >= t->count || !t->ctl[cid].cnt)
+		return NULL;
+	return t->ctx + (size_t) cid * t->esize;
+}
+
+// A frame of the context cid could not be decompressed, receiver side. Return 1 if the sender
+// is to be asked for a full header; the request goes out again every NACK_REPEAT frames.
+int flow_damaged(FlowTable *t, uint16_t cid) {
+	if (!slot(t, cid))
+		return 0;
+	return t->ctl[cid].nack++ % NACK_REPEAT == 0;
+}
+
+// check of the flow key sent in the compressed frames, 8 bits of the hash
+uint8_t flow_check(FlowTable *t, uint16_t cid) {
+	return (uint8_t) (t->hash[cid] >> 24);
+}
+
+// Encode v against the value in the last full header, 32 or 16 bits. The least significant bits
+// are used when v is ahead of that value by less than a quarter of their range; the receiver
+// decodes them in a window reaching three quarters ahead of its own context, see flow_decode().
+int flow_encode(uint8_t **p, uint32_t v, uint32_t ref, int bits, int force) {
+	uint32_t d = v - ref;
+	if (bits == 16)
+		d &= 0xffff;
+	if (d == 0 && !force)
+		return C_SAME;
+	if (d < 64) {
+		*(*p)++ = (uint8_t) v;
+		return C_LSB8;
+	}
+	if (bits == 32 && d < (1u << 22)) {
+		v = htonl(v);
+		memcpy(*p, (uint8_t *) &v + 1, 3);
+		*p += 3;
+		return C_LSB24;
+	}
+	if (bits == 16) {
+		uint16_t v16 = htons((uint16_t) v);
+		memcpy(*p, &v16, 2);
+	}
+	else {
+		v = htonl(v);
+		memcpy(*p, &v, 4);
+	}
+	*p += bits / 8;
+	return C_FULL;
+}
+
+// Decode a field; return 0 if the compressed header is too short.
+int flow_decode(uint8_t **p, uint8_t *end, int code, uint32_t ref, int bits, uint32_t *v) {
+	int size = (code == C_SAME)? 0: (code == C_LSB8)? 1: (code == C_LSB24)? 3: bits / 8;
+	if (*p + size > end)
+		return 0;
+
+	uint32_t lsb = 0;
+	int k = 0;
+	if (code == C_SAME) {
+		*v = ref;
+		return 1;
+	}
+	else if (code == C_LSB8) {
+		lsb = **p;
+		k = 8;
+	}
+	else if (code == C_LSB24) {
+		lsb = ((*p)[0] << 16) | ((*p)[1] << 8) | (*p)[2];
+		k = 24;
+	}
+	else if (bits == 16) {
+		uint16_t v16;
+		memcpy(&v16, *p, 2);
+		lsb = ntohs(v16);
+		k = 16;
+	}
+	else {
+		memcpy(v, *p, 4);
+		*v = ntohl(*v);
+		*p += 4;
+		return 1;
+	}
+	*p += size;
+
+	uint32_t mask = (1u << k) - 1;
+	uint32_t base = ref - (1u << (k - 2));
+	*v = base + ((lsb - base) & mask);
+	return 1;
+}
+
+// CRC-8 of the headers rebuilt by the receiver, see compress_udp.c
+uint8_t flow_crc8(const uint8_t *ptr, int len) {
+	uint8_t crc = 0;
+	while (len--)
+		crc = crc8_table[crc ^ *ptr++];
+	return crc;
+}
+
+// The other end of the tunnel reports a loss, per mille, of the packets we send. A context is
+// refreshed about once for each packet lost, within REFRESH_MIN and REFRESH_MAX frames; a
+// new flow starts with enough full headers to get at least one of them across with a
+// probability of 99.9%.
+void flow_loss(Peer *peer, int loss) {
+	if (loss < 0)
+		loss = 0;
+	if (loss > 1000)
+		loss = 1000;
+	peer->tx_loss = loss;
+
+	int refresh = (loss)? 1000 / loss: REFRESH_MAX;
+	if (refresh < REFRESH_MIN)
+		refresh = REFRESH_MIN;
+	if (refresh > REFRESH_MAX)
+		refresh = REFRESH_MAX;
+	peer->compress_refresh = refresh;
+
+	int start = 1;
+	int p = loss;	// loss ^ start, per mille
+	while (p > 1 && start < START_MAX) {
+		p = p * loss / 1000;
+		start++;
+	}
+	peer->compress_start = start;
+}
+
+#ifdef TESTING
+// Many flows from many sandboxes: the 8-bit XOR hash used before against the flow table, the
+// share of the packets finding their own context, and the measured cost of one lookup: an XOR
+// lookup, a flow_find() on the sender, a flow_learn() on the receiver. The last two columns are
+// not measured, they are the lookups a TCP frame goes through on both ends of the tunnel
+// multiplied by the costs above: four XOR lookups before, the L4 and the L3 tables on the
+// sender and again on the receiver; now a lookup on the sender and an array access on the
+// receiver.
+//     gcc -O2 -DTESTING flow.c -o flow-test && ./flow-test
+#include <time.h>
+int arg_debug = 0;
+int arg_lowmem = 0;
+int arg_lz = 0;
+static TStats stats;
+__thread TStats *thread_stats = &stats;
+
+#define TEST_PKTS 4000000
+typedef struct test_key_t {	// same layout as the TCP session in compress_l4.c
+	uint8_t mac[14];
+	uint16_t ver_ihl_tos;
+	uint16_t offset;
+	uint8_t ttl;
+	uint8_t addr[8];
+	uint16_t port[2];
+	uint8_t doff;
+} __attribute__((__packed__)) TestKey;
+
+typedef struct test_ctx_t {
+	TestKey key;
+	int cnt;
+} TestCtx;
+
+static void make_key(TestKey *k, int flow) {
+	memset(k, 0, sizeof(TestKey));
+	k->mac[0] = 2;
+	k->mac[5] = (uint8_t) (flow % 50);	// 50 sandboxes on the bridge
+	k->mac[6] = 2;
+	k->mac[11] = 1;
+	k->mac[12] = 8;
+	k->ver_ihl_tos = htons(0x4500);
+	k->offset = htons(0x4000);
+	k->ttl = 64;
+	k->addr[0] = 10;
+	k->addr[1] = 10;
+	k->addr[2] = 20;
+	k->addr[3] = (uint8_t) (2 + flow % 50);
+	uint32_t dst = htonl(0x5db8d822 + flow / 50 % 7);
+	memcpy(k->addr + 4, &dst, 4);
+	k->port[0] = htons(32768 + flow);
+	k->port[1] = htons(443);
+	k->doff = 8;
+}
+
+static double elapsed(struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+int main(void) {
+	flow_init();
+	printf("crc32c %s\n", (crc32c_hw)? "sse4.2": "table");
+	int errors = 0;
+
+	int nflows[] = {10, 100, 1000, 10000, 100000};
+	unsigned n;
+	printf("%42s%-19s  %s\n", "", "ns/lookup, measured", "ns/frame, estimated");
+	printf(" flows  xor hit %%  table hit %%  contexts    xor   find  learn  xor x4  find+learn\n");
+	for (n = 0; n < sizeof(nflows) / sizeof(nflows[0]); n++) {
+		int flows = nflows[n];
+		TestKey *keys = malloc(flows * sizeof(TestKey));
+		int i;
+		for (i = 0; i < flows; i++)
+			make_key(&keys[i], i);
+		srand(1);
+		int *seq = malloc(TEST_PKTS * sizeof(int));
+		uint16_t *cids = malloc(TEST_PKTS * sizeof(uint16_t));
+		for (i = 0; i < TEST_PKTS; i++)
+			seq[i] = rand() % flows;
+
+		// 8-bit XOR hash, direct mapped
+		static TestCtx old[256];
+		memset(old, 0, sizeof(old));
+		unsigned hits = 0;
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < TEST_PKTS; i++) {
+			TestKey *k = &keys[seq[i]];
+			uint8_t hash = 0;
+			unsigned j;
+			uint8_t *ptr = (uint8_t *) k;
+			for (j = 0; j < sizeof(TestKey); j++, ptr++)
+				hash ^= *ptr;
+			if (memcmp(k, &old[hash].key, sizeof(TestKey)) == 0)
+				hits++;
+			else
+				old[hash].key = *k;
+		}
+		double ns_xor = elapsed(&t0) / TEST_PKTS;
+		double hit_old = 100.0 * hits / TEST_PKTS;
+
+		// flow table
+		void *slot = NULL;
+		uint32_t used = 0;
+		FlowTable *t = flow_table(&slot, sizeof(TestCtx), sizeof(TestKey), FLOW_MAX, &used);
+		hits = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < TEST_PKTS; i++) {
+			int found;
+			TestCtx *ctx = flow_find(t, &keys[seq[i]], &cids[i], &found);
+			hits += found;
+			ctx->cnt++;
+		}
+		double ns_find = elapsed(&t0) / TEST_PKTS;
+
+		// the receiver
+		void *rx_slot = NULL;
+		uint32_t rx_used = 0;
+		FlowTable *rx = flow_table(&rx_slot, sizeof(TestCtx), sizeof(TestKey), FLOW_MAX, &rx_used);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < TEST_PKTS; i++) {
+			int found;
+			TestCtx *ctx = flow_learn(rx, cids[i], &keys[seq[i]], &found);
+			ctx->cnt++;
+		}
+		double ns_learn = elapsed(&t0) / TEST_PKTS;
+
+		// a TCP frame went through 4 XOR lookups, it goes through a flow_find() and a
+		// flow_learn() now: these columns are derived from the measured ones
+		printf("%6d  %9.1f  %11.1f  %8u  %5.1f  %5.1f  %5.1f  %6.1f  %10.1f\n", flows, hit_old,
+		       100.0 * hits / TEST_PKTS, t->count, ns_xor, ns_find, ns_learn, 4 * ns_xor,
+		       ns_find + ns_learn);
+
+		// the contexts found match their keys
+		for (i = 0; i < flows; i++) {
+			uint16_t cid;
+			int found;
+			TestCtx *ctx = flow_find(t, &keys[i], &cid, &found);
+			if (memcmp(&ctx->key, &keys[i], sizeof(TestKey)))
+				errors++;
+		}
+
+		// the receiver never allocates more than the sender
+		if (rx_used > used || used > FLOW_PEER_MAX)
+			errors++;
+
+		// every flow is in the index, exactly once
+		uint32_t i2;
+		unsigned indexed = 0;
+		for (i2 = 0; i2 < t->size; i2++)
+			indexed += (t->index[i2] != 0);
+		if (indexed != t->count)
+			errors++;
+		free(t->index);
+		free(t->ctx);
+		free(t->hash);
+		free(t->ctl);
+		free(t);
+		free(rx->ctx);
+		free(rx->hash);
+		free(rx->ctl);
+		free(rx);
+		free(cids);
+		free(keys);
+		free(seq);
+	}
+
+	printf("%u flows evicted\n", stats.compress_evict);
+
+	// the receiver table doesn't grow above its size, whatever cid the peer sends
+	void *rx_slot = NULL;
+	uint32_t rx_used = 0;
+	FlowTable *rx = flow_table(&rx_slot, sizeof(TestCtx), sizeof(TestKey), FLOW_MAX_LOWMEM, &rx_used);
+	TestKey key;
+	make_key(&key, 1);
+	int found;
+	if (!flow_learn(rx, FLOW_MAX_LOWMEM - 1, &key, &found) ||
+	    flow_learn(rx, FLOW_MAX_LOWMEM, &key, &found) ||
+	    flow_learn(rx, 65535, &key, &found) ||
+	    flow_damaged(rx, 65535) ||
+	    rx->cap > FLOW_MAX_LOWMEM || rx->count != FLOW_MAX_LOWMEM) {
+		printf("error: receiver table above its size, %u contexts\n", rx->cap);
+		errors++;
+	}
+
+	// nor do all the tables of the peer go above its budget
+	void *slots[4] = {NULL, NULL, NULL, NULL};
+	uint32_t peer_used = 0;
+	int k;
+	for (k = 0; k < 4; k++) {
+		FlowTable *t = flow_table(&slots[k], sizeof(TestCtx), sizeof(TestKey), FLOW_MAX, &peer_used);
+		flow_learn(t, FLOW_PEER_MAX / 4 - 1, &key, &found);
+	}
+	if (!flow_learn(slots[0], FLOW_START - 1, &key, &found) ||
+	    flow_learn(slots[0], FLOW_PEER_MAX / 2 - 1, &key, &found) ||
+	    flow_learn(slots[1], 65535, &key, &found) ||
+	    peer_used > FLOW_PEER_MAX) {
+		printf("error: receiver tables above the peer budget, %u contexts\n", peer_used);
+		errors++;
+	}
+
+	// context refresh for the loss reported by the receiver
+	printf("\nloss %%  refresh  full headers starting a flow\n");
+	int loss[] = {0, 1, 10, 50, 100, 200, 500};
+	for (n = 0; n < sizeof(loss) / sizeof(loss[0]); n++) {
+		Peer peer;
+		flow_loss(&peer, loss[n]);
+		printf("%6.1f  %7d  %d\n", loss[n] / 10.0, peer.compress_refresh, peer.compress_start);
+	}
+
+	printf("%s\n", (errors)? "FAILED": "passed");
+	return (errors)? 1: 0;
+}
+#endif
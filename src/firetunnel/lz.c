@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+
+// Payload compression (--lz)
+// - LZ77 in the LZ4 block format: a token with the literal and match lengths, the literals,
+//   a 16-bit offset, the length bytes above 15; every packet is compressed on its own, a
+//   packet lost doesn't hurt the next ones
+// - the sender compresses the whole frame after header compression; the packet goes out
+//   with the O_DATA_LZ opcode, and the opcode of the header compression profile is the first
+//   byte of the compressed data
+// - a frame is sent compressed only if it gets LZ_GAIN_MIN bytes shorter, it never grows
+// - the frames of a flow skip the compressor when a sample of the frame looks random
+//   (compressed or encrypted data), or when the recent frames of the flow didn't compress
+//   well; the flow is tried again after a number of frames doubling up to LZ_SKIP_MAX
+// - the bytes in and out and the CPU cycles are counted for each flow (--debug-compress)
+//   and for each worker (stats)
+// - the receiver doesn't need --lz, it always decompresses
+
+#define LZ_MIN 128		// smaller frames are sent as they are
+#define LZ_GAIN_MIN 8		// bytes saved at least
+#define LZ_SAMPLE 128		// bytes sampled by the entropy estimate, at the end of the frame
+#define LZ_DISTINCT_MAX 88	// byte values in the sample: about 100 for random data, 30 to 60 for text
+#define LZ_RATIO_MAX 230	// out/in in 1/256 units, a flow saving less than 10% is skipped
+#define LZ_MISS_MAX 6		// skip up to 2^6 - 1 frames
+#define LZ_SKIP_MAX ((1 << LZ_MISS_MAX) - 1)
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5		// the last bytes are always literals
+#define MF_LIMIT 12		// no match starts in the last MF_LIMIT bytes
+#define HASH_BITS 12
+
+// positions of the 4-byte sequences, relative to the start of the frame; the table is not
+// cleared between frames, the candidates are checked against the current frame
+static __thread uint16_t hashtab[1 << HASH_BITS];
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline unsigned hash4(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// length above 14 in a token, continued in bytes of 255; return NULL if there is no room
+static uint8_t *put_len(uint8_t *op, uint8_t *oend, unsigned len) {
+	while (len >= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+// a sequence: the literals from anchor, then a match of mlen bytes at offset off (mlen 0
+// for the last sequence); return NULL if there is no room
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *anchor, unsigned lit,
+			unsigned off, unsigned mlen) {
+	if (op >= oend)
+		return NULL;
+	uint8_t *token = op++;
+	*token = ((lit < 15)? lit: 15) << 4;
+	if (lit >= 15 && (op = put_len(op, oend, lit - 15)) == NULL)
+		return NULL;
+	if ((unsigned) (oend - op) < lit)
+		return NULL;
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (mlen == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	mlen -= MIN_MATCH;
+	*token |= (mlen < 15)? mlen: 15;
+	if (mlen >= 15)
+		op = put_len(op, oend, mlen - 15);
+	return op;
+}
+
+// Compress len bytes from src in dst; return the compressed length, or 0 if it doesn't fit
+// in max bytes.
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int max) {
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + len;
+	const uint8_t *mlimit = iend - LAST_LITERALS;
+	const uint8_t *ilimit = iend - MF_LIMIT;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + max;
+
+	while (len > MF_LIMIT && ip < ilimit) {
+		uint32_t seq = read32(ip);
+		unsigned h = hash4(seq);
+		const uint8_t *ref = src + hashtab[h];
+		hashtab[h] = (uint16_t) (ip - src);
+		if (ref >= ip || read32(ref) != seq) {
+			// the step grows on data not matching
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		// extend the match forward, then backward over the pending literals
+		const uint8_t *m = ip + MIN_MATCH;
+		const uint8_t *r = ref + MIN_MATCH;
+		while (m + 8 <= mlimit && read64(m) == read64(r)) {
+			m += 8;
+			r += 8;
+		}
+		while (m < mlimit && *m == *r) {
+			m++;
+			r++;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+		if (!op)
+			return 0;
+		ip = m;
+		anchor = ip;
+		if (ip < ilimit)
+			hashtab[hash4(read32(ip - 2))] = (uint16_t) (ip - 2 - src);
+	}
+
+	op = put_seq(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - dst;
+}
+
+// Decompress len bytes from src in dst; return the decompressed length, or -1 if the data is
+// not valid or it doesn't fit in max bytes.
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int max) {
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + max;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15) {
+			unsigned b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;	// the last sequence has no match
+
+		if (iend - ip < 2)
+			return -1;
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t) (op - dst))
+			return -1;
+		size_t mlen = token & 15;
+		if (mlen == 15) {
+			unsigned b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += MIN_MATCH;
+		if (mlen > (size_t) (oend - op))
+			return -1;
+
+		const uint8_t *r = op - off;
+		if (off >= mlen) {
+			memcpy(op, r, mlen);
+			op += mlen;
+		}
+		else {
+			// the match overlaps the output, a repeating pattern
+			while (mlen--)
+				*op++ = *r++;
+		}
+	}
+	return op - dst;
+}
+
+// the number of byte values in the last LZ_SAMPLE bytes of the frame, a cheap estimate of
+// the entropy
+static int distinct(const uint8_t *pkt, int nbytes) {
+	uint64_t seen[4] = {0, 0, 0, 0};
+	const uint8_t *p = pkt + nbytes - LZ_SAMPLE;
+	int i;
+	for (i = 0; i < LZ_SAMPLE; i++)
+		seen[p[i] >> 6] |= 1ULL << (p[i] & 63);
+	return __builtin_popcountll(seen[0]) + __builtin_popcountll(seen[1]) +
+	       __builtin_popcountll(seen[2]) + __builtin_popcountll(seen[3]);
+}
+
+// the CPU cycles go in the stats by the thousand (1024)
+static __thread uint64_t cycles_left;
+
+// Compress the frame of context cid in pkt, in place, sender side; the frame goes out with
+// the opcode given. Return the new length, the opcode included, or 0 if the frame is sent
+// as it is.
+int lz_encode(Peer *peer, FlowTable *t, uint16_t cid, uint8_t *pkt, int nbytes, uint8_t opcode,
+	      int direction, int lane) {
+	static __thread uint8_t buf[LZ_FRAME_MAX];
+	if (nbytes < LZ_MIN || nbytes > LZ_FRAME_MAX)
+		return 0;
+
+	// the history of the flow decides if the frame goes through the compressor
+	spin_lock(&peer->compress_lock[direction][lane]);
+	FlowLz *z = &t->lz[cid];
+	int skip = (z->skip != 0);
+	if (skip) {
+		z->skip--;
+		z->in += nbytes;
+		z->out += nbytes;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+	thread_stats->lz_in += nbytes;
+	if (skip) {
+		thread_stats->lz_out += nbytes;
+		return 0;
+	}
+
+	int clen = 0;
+	uint64_t c = 0;
+	if (distinct(pkt, nbytes) <= LZ_DISTINCT_MAX) {
+		c = cycles();
+		clen = lz_compress(pkt, nbytes, buf, nbytes - 1 - LZ_GAIN_MIN);
+		c = cycles() - c;
+		thread_stats->lz_tried += nbytes;
+		cycles_left += c;
+		thread_stats->lz_kcycles += cycles_left >> 10;
+		cycles_left &= 1023;
+	}
+	int len = (clen)? clen + 1: nbytes;
+	thread_stats->lz_out += len;
+
+	spin_lock(&peer->compress_lock[direction][lane]);
+	unsigned ratio = len * 256 / nbytes;
+	if (ratio == 0)
+		ratio = 1;
+	z->ratio = (z->ratio)? (3 * z->ratio + ratio) / 4: ratio;
+	if (z->ratio > LZ_RATIO_MAX) {
+		if (z->miss < LZ_MISS_MAX)
+			z->miss++;
+		z->skip = (1 << z->miss) - 1;
+	}
+	else
+		z->miss = 0;
+	z->in += nbytes;
+	z->out += len;
+	if (c) {
+		z->tried += nbytes;
+		z->cycles += c;
+	}
+	spin_unlock(&peer->compress_lock[direction][lane]);
+
+	if (!clen)
+		return 0;
+	thread_stats->lz_pkt++;
+	pkt[0] = opcode;
+	memcpy(pkt + 1, buf, clen);
+	return len;
+}
+
+// Decompress an O_DATA_LZ frame in pkt, in place, receiver side; the room after pkt is
+// LZ_FRAME_MAX bytes at least. Store the opcode of the frame in opcode and return the new
+// length, or -1 if the frame is not valid.
+int lz_decode(uint8_t *pkt, int nbytes, uint8_t *opcode) {
+	static __thread uint8_t buf[LZ_FRAME_MAX];
+	if (nbytes < 2 || nbytes > LZ_FRAME_MAX)
+		return -1;
+	*opcode = pkt[0];
+	if (!opcode_is_data(*opcode) || *opcode == O_DATA_LZ)
+		return -1;
+	memcpy(buf, pkt + 1, nbytes - 1);
+	return lz_decompress(buf, nbytes - 1, pkt, LZ_FRAME_MAX);
+}
+
+static void print_table(FlowTable *t, const char *profile, int lane) {
+	uint32_t i;
+	for (i = 0; i < t->count; i++) {
+		FlowLz *z = &t->lz[i];
+		if (!t->ctl[i].cnt || !z->in)
+			continue;
+		printf("   %s %d:%u: in %u, out %u (%u%%)", profile, lane, i, z->in, z->out,
+		       (unsigned) ((uint64_t) z->out * 100 / z->in));
+		if (z->tried)
+			printf(", %.1f cycles/byte", (double) z->cycles / z->tried);
+		if (z->skip)
+			printf(", skip %u", z->skip);
+		printf("\n");
+	}
+}
+
+// payload compression for each flow, sender side
+void print_lz_table(Peer *peer, int direction) {
+	if (!arg_lz)
+		return;
+	printf("Payload compression table:\n");
+	int lane;
+	for (lane = 0; lane < WORKERS_MAX; lane++) {
+		void *tables[4] = {
+			peer->compress_l2[direction][lane],
+			peer->compress_l3[direction][lane],
+			peer->compress_l4[direction][lane],
+			peer->compress_udp[direction][lane]
+		};
+		static const char *profile[4] = {"l2", "l3", "tcp", "udp"};
+		int i;
+		for (i = 0; i < 4; i++) {
+			FlowTable *t = tables[i];
+			if (!t || !t->lz)
+				continue;
+			spin_lock(&peer->compress_lock[direction][lane]);
+			print_table(t, profile[i], lane);
+			spin_unlock(&peer->compress_lock[direction][lane]);
+		}
+	}
+}
+
+#ifdef TESTING
+// Round trip of text, binary, random and repeating data through the compressor, every
+// frame coming out of the decompressor is compared with the frame sent; the ratio and the
+// speed are printed for each kind of data. Broken frames are fed to the decompressor, it
+// should never write outside the buffer.
+//     gcc -O2 -DTESTING lz.c -o lz-test && ./lz-test
+int arg_debug = 0;
+int arg_lz = 1;
+static TStats stats;
+__thread TStats *thread_stats = &stats;
+
+#define TEST_FRAMES 20000
+
+static const char *words[] = {
+	"GET", "/api/v1/", "users", "HTTP/1.1", "Host:", "Content-Type:", "application/json",
+	"{\"id\":", "\"name\":", "\"status\":", "\"ok\"", "true", "false", "null", "2018-08-17",
+	"INFO", "WARN", "connection", "from", "10.10.20.", "request", "completed", "in", "ms"
+};
+
+// kind 0: text, 1: binary records, 2: random, 3: a repeating byte
+static int build(uint8_t *p, int kind, int len) {
+	int i = 0;
+	switch (kind) {
+	case 0:
+		while (i < len) {
+			const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+			int n = strlen(w);
+			if (i + n + 1 > len)
+				break;
+			memcpy(p + i, w, n);
+			i += n;
+			p[i++] = (rand() % 8)? ' ': '\n';
+		}
+		while (i < len)
+			p[i++] = ' ';
+		break;
+	case 1:
+		for (i = 0; i + 16 <= len; i += 16) {
+			uint32_t v[4] = {htonl(i), htonl(0x0a0a1400 + (rand() % 4)), 0, htonl(rand() % 1000)};
+			memcpy(p + i, v, 16);
+		}
+		memset(p + i, 0, len - i);
+		break;
+	case 2:
+		for (i = 0; i < len; i++)
+			p[i] = rand();
+		break;
+	default:
+		memset(p, 'a', len);
+	}
+	return len;
+}
+
+static double elapsed(struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+int main(void) {
+	static const char *kind[4] = {"text", "binary", "random", "repeat"};
+	uint8_t frame[LZ_FRAME_MAX];
+	uint8_t comp[LZ_FRAME_MAX];
+	uint8_t out[LZ_FRAME_MAX + 64];
+	int errors = 0;
+
+	printf("data      ratio   compress  decompress\n");
+	int k;
+	for (k = 0; k < 4; k++) {
+		uint64_t in = 0;
+		uint64_t cbytes = 0;
+		double ns_c = 0;
+		double ns_d = 0;
+		int i;
+		for (i = 0; i < TEST_FRAMES; i++) {
+			int len = build(frame, k, 1 + rand() % 1448);
+			struct timespec t0;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			int clen = lz_compress(frame, len, comp, sizeof(comp));
+			ns_c += elapsed(&t0);
+			if (clen == 0) {
+				if (errors++ < 10)
+					printf("error: %s frame %d, %d bytes not compressed\n", kind[k], i, len);
+				continue;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			int dlen = lz_decompress(comp, clen, out, LZ_FRAME_MAX);
+			ns_d += elapsed(&t0);
+			if (dlen != len || memcmp(out, frame, len)) {
+				if (errors++ < 10)
+					printf("error: %s frame %d, %d bytes\n", kind[k], i, len);
+			}
+			in += len;
+			cbytes += clen;
+		}
+		printf("%-8s %5.1f%% %6.0f MB/s %6.0f MB/s\n", kind[k], 100.0 * cbytes / in,
+		       in * 1e3 / ns_c, in * 1e3 / ns_d);
+	}
+
+	// a frame never grows, the compressor gives up instead
+	int len = build(frame, 2, 1448);
+	if (lz_compress(frame, len, comp, len - 1 - LZ_GAIN_MIN) != 0) {
+		printf("error: random frame compressed\n");
+		errors++;
+	}
+
+	// broken frames: truncated, random bytes, offsets out of range
+	int i;
+	for (i = 0; i < TEST_FRAMES * 10; i++) {
+		len = build(frame, i % 2, 200 + rand() % 1200);
+		int clen = lz_compress(frame, len, comp, sizeof(comp));
+		int cut = rand() % (clen + 1);
+		int n = rand() % 4;
+		while (n--)
+			comp[rand() % clen] = rand();
+		memset(out + LZ_FRAME_MAX, 0x5a, 64);
+		lz_decompress(comp, cut, out, LZ_FRAME_MAX);
+		int j;
+		for (j = 0; j < 64; j++) {
+			if (out[LZ_FRAME_MAX + j] != 0x5a) {
+				if (errors++ < 10)
+					printf("error: overflow, frame %d\n", i);
+				break;
+			}
+		}
+	}
+
+	printf("%s\n", (errors)? "FAILED": "passed");
+	return (errors)? 1: 0;
+}
+#endif
@@ -30,6 +30,20 @@ int arg_noscrambling = 0;
 int arg_noseccomp = 0;
 int arg_nonat = 0;
 int arg_daemonize = 0;
+int arg_batch = 0;
+int arg_nogso = 0;
+int arg_nogro = 0;
+int arg_tso = 0;
+int arg_hugepages = 0;
+int arg_keycache = 0;
+int arg_lowmem = 0;
+int arg_lz = 0;
+int arg_engine = 0;
+char *arg_xdp = NULL;
+int arg_workers = 0;
+int arg_cpu[WORKERS_MAX];
+int arg_cpu_cnt = 0;
+char *arg_plugin = NULL;
 int arg_debug = 0;
 int arg_debug_compress = 0;
 
@@ -117,12 +131,58 @@ static void parse_args(int argc, char **argv) {
 				exit(1);
 			}
 		}
+		else if (strncmp(argv[i], "--batch=",  8) == 0) {
+			arg_batch = atoi(argv[i] + 8);
+			if (arg_batch < 1 || arg_batch > BATCH_MAX) {
+				fprintf(stderr, "Error: invalid batch size %s\n", argv[i] + 8);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[i], "--engine=",  9) == 0) {
+			arg_engine = profile_engine_id(argv[i] + 9);
+			if (arg_engine == 0) {
+				fprintf(stderr, "Error: invalid I/O engine %s\n", argv[i] + 9);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[i], "--workers=",  10) == 0) {
+			arg_workers = atoi(argv[i] + 10);
+			if (arg_workers < 1 || arg_workers > WORKERS_MAX) {
+				fprintf(stderr, "Error: invalid number of workers %s\n", argv[i] + 10);
+				exit(1);
+			}
+		}
+		else if (strncmp(argv[i], "--cpus=",  7) == 0) {
+			arg_cpu_cnt = profile_cpu_list(argv[i] + 7, arg_cpu);
+			if (arg_cpu_cnt == -1) {
+				fprintf(stderr, "Error: invalid CPU list %s\n", argv[i] + 7);
+				exit(1);
+			}
+		}
 		else if (strcmp(argv[i], "--noscrambling") == 0)
 			arg_noscrambling = 1;
+		else if (strcmp(argv[i], "--hugepages") == 0)
+			arg_hugepages = 1;
+		else if (strcmp(argv[i], "--keycache") == 0)
+			arg_keycache = 1;
+		else if (strcmp(argv[i], "--lowmem") == 0)
+			arg_lowmem = 1;
+		else if (strcmp(argv[i], "--lz") == 0)
+			arg_lz = 1;
+		else if (strcmp(argv[i], "--nogro") == 0)
+			arg_nogro = 1;
+		else if (strcmp(argv[i], "--nogso") == 0)
+			arg_nogso = 1;
 		else if (strcmp(argv[i], "--nonat") == 0)
 			arg_nonat = 1;
+		else if (strncmp(argv[i], "--plugin=", 9) == 0)
+			arg_plugin = argv[i] + 9;
+		else if (strcmp(argv[i], "--tso") == 0)
+			arg_tso = 1;
 		else if (strcmp(argv[i], "--noseccomp") == 0)
 			arg_noseccomp = 1;
+		else if (strncmp(argv[i], "--xdp=", 6) == 0)
+			arg_xdp = argv[i] + 6;
 		else if (strcmp(argv[i], "--daemonize") == 0)
 			arg_daemonize = 1;
 		else if (strncmp(argv[i], "--bridge=", 9) == 0)
@@ -171,6 +231,50 @@ static void parse_args(int argc, char **argv) {
 	}
 	logmsg("Tunnel mtu %d\n", tunnel.overlay.mtu);
 
+	if (arg_batch == 0)
+		arg_batch = profile_batch;
+	if (arg_batch == 0)
+		arg_batch = DEFAULT_BATCH;
+
+	if (arg_engine == 0)
+		arg_engine = profile_engine;
+	if (arg_engine == 0)
+		arg_engine = ENGINE_EPOLL;
+#ifndef HAVE_URING
+	if (arg_engine == ENGINE_URING) {
+		fprintf(stderr, "Error: io_uring engine not supported by this build\n");
+		exit(1);
+	}
+#endif
+	if (arg_engine == ENGINE_URING && arg_tso) {
+		fprintf(stderr, "Error: --tso is not supported by the io_uring engine\n");
+		exit(1);
+	}
+	if (arg_engine == ENGINE_URING && arg_xdp) {
+		fprintf(stderr, "Error: --xdp is not supported by the io_uring engine\n");
+		exit(1);
+	}
+
+	if (arg_workers == 0)
+		arg_workers = profile_workers;
+	if (arg_workers == 0)
+		arg_workers = 1;
+	if (arg_cpu_cnt == 0) {
+		memcpy(arg_cpu, profile_cpu, sizeof(arg_cpu));
+		arg_cpu_cnt = profile_cpu_cnt;
+	}
+
+	if (arg_plugin == NULL)
+		arg_plugin = profile_plugin;
+	if (arg_plugin && arg_noscrambling) {
+		fprintf(stderr, "Error: --plugin and --noscrambling are mutually exclusive\n");
+		exit(1);
+	}
+	if (arg_lowmem && (arg_plugin || arg_keycache)) {
+		fprintf(stderr, "Error: --lowmem cannot be used with --plugin or --keycache\n");
+		exit(1);
+	}
+
 	// check ip addresses
 	if ((tunnel.overlay.netaddr & tunnel.overlay.netmask) != (tunnel.overlay.defaultgw & tunnel.overlay.netmask)) {
 		fprintf(stderr, "Error: invalid overlay network configuration\n");
@@ -189,8 +293,6 @@ static void parse_args(int argc, char **argv) {
 int main(int argc, char **argv) {
 	// init
 	memset(&tunnel, 0, sizeof(tunnel));
-	compress_l2_init();
-	compress_l3_init();
 
 	// parse command line arguments
 	parse_args(argc, argv);
@@ -217,10 +319,15 @@ int main(int argc, char **argv) {
 	}
 
 	// initialize keys
+	blake2_select();
 	init_keys((uint16_t) arg_port);
+	if (arg_plugin)
+		plugin_load(arg_plugin);
+	scramble_init();
+	flow_init();
 
 	// open tap device
-	tunnel.tapfd = net_tap_open(tunnel.tap_device_name);
+	net_tap_open(tunnel.tap_device_name, tunnel.tapfd, arg_workers);
 	net_set_mtu(tunnel.tap_device_name, tunnel.overlay.mtu);
 	logmsg("Device %s created\n", tunnel.tap_device_name);
 
@@ -229,6 +336,9 @@ int main(int argc, char **argv) {
 	net_set_mtu(tunnel.bridge_device_name, tunnel.overlay.mtu);
 	net_if_up(tunnel.bridge_device_name);
 	net_bridge_add_interface(tunnel.bridge_device_name, tunnel.tap_device_name);
+	// the server forwards the traffic between clients
+	if (arg_server)
+		net_bridge_hairpin(tunnel.tap_device_name);
 	logmsg("Bridge %s created\n", tunnel.bridge_device_name);
 
 	if (arg_server) {
@@ -252,11 +362,15 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	// open udp server socket
+	// open udp sockets, one for each worker
 	if (arg_server)
-		tunnel.udpfd = net_udp_server(arg_port);
+		net_udp_server(arg_port, tunnel.udpfd, arg_workers);
 	else
-		tunnel.udpfd = net_udp_client();
+		net_udp_client(tunnel.udpfd, arg_workers);
+
+	// AF_XDP fast path for the tunnel packets
+	if (arg_xdp)
+		xdp_open(arg_xdp, tunnel.udpfd[0], tunnel.xsk, arg_workers);
 
 
 	// set firejail configuration for the server
@@ -271,17 +385,6 @@ int main(int argc, char **argv) {
 		free(fname);
 	}
 
-	// set remote for the client
-	tunnel.state = S_DISCONNECTED;
-	if (!arg_server) {
-		tunnel.remote_sock_addr.sin_family    = AF_INET;
-		if (arg_remote_addr)
-			tunnel.remote_sock_addr.sin_addr.s_addr = htonl(arg_remote_addr);
-		else
-			tunnel.remote_sock_addr.sin_addr.s_addr = INADDR_ANY;
-		tunnel.remote_sock_addr.sin_port = htons(arg_port);
-	}
-
 	int fd[2];
 	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fd) == -1)
 		errExit("setsockpair");
@@ -23,9 +23,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <netinet/udp.h>
 #include <linux/if_tun.h>
 #include <errno.h>
 #include <linux/if_bridge.h>
+#include <linux/filter.h>
 
 //*****************************************************
 // Interface
@@ -239,24 +241,65 @@ void net_bridge_add_interface(const char *bridge, const char *dev) {
 		net_set_mtu(bridge, mtu1);
 }
 
+// allow the bridge to send a frame back on the port it came from; all the clients
+// of a server share the same tap device
+void net_bridge_hairpin(const char *dev) {
+	check_if_name(dev);
+
+	char *fname;
+	if (asprintf(&fname, "/sys/class/net/%s/brport/hairpin_mode", dev) == -1)
+		errExit("asprintf");
+	FILE *fp = fopen(fname, "w");
+	if (!fp) {
+		fprintf(stderr, "Warning: cannot open %s, the clients will not be able to talk to each other\n", fname);
+		free(fname);
+		return;
+	}
+	fprintf(fp, "1");
+	fclose(fp);
+	free(fname);
+}
+
 //*****************************************************
 // TAP interface
 //*****************************************************
-int net_tap_open(char *devname) {
-	// open the clone device
-	int fd;
-	if ( (fd = open("/dev/net/tun", O_RDWR)) == -1 )
-		errExit("open /dev/net/tun");
-
-	// create a new TAP device;;
-	struct ifreq ifr;
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-	if (ioctl(fd, TUNSETIFF, (void *) &ifr) == -1 )
-		errExit("ioctl TUNSETIFF");
+// open the tap device; with more than one queue, the device is created with IFF_MULTI_QUEUE
+// and every queue gets its own file descriptor in fds
+int net_tap_open(char *devname, int *fds, int queues) {
+	assert(devname);
+	assert(fds);
+	assert(queues >= 1 && queues <= WORKERS_MAX);
+
+	int i;
+	for (i = 0; i < queues; i++) {
+		// open the clone device
+		int fd;
+		// non-blocking descriptor, the data path drains it in batches
+		if ( (fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) == -1 )
+			errExit("open /dev/net/tun");
+
+		// create a new TAP device, or attach a new queue to it
+		struct ifreq ifr;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+		if (queues > 1)
+			ifr.ifr_flags |= IFF_MULTI_QUEUE;
+		if (arg_tso)
+			ifr.ifr_flags |= IFF_VNET_HDR;
+		if (i)
+			strncpy(ifr.ifr_name, devname, IFNAMSIZ - 1);
+		if (ioctl(fd, TUNSETIFF, (void *) &ifr) == -1 )
+			errExit("ioctl TUNSETIFF");
+
+		// extract device name
+		if (i == 0)
+			memcpy(devname,  ifr.ifr_name, IFNAMSIZ - 1);
+		fds[i] = fd;
+	}
 
-	// extract device name
-	memcpy(devname,  ifr.ifr_name, IFNAMSIZ - 1);
+	// the kernel can send us TCP/IPv4 super-frames and frames without checksum
+	if (arg_tso && ioctl(fds[0], TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN) == -1)
+		fprintf(stderr, "Warning: cannot enable the offloads on %s\n", devname);
 
 	// persistent device
 //	if(ioctl(fd, TUNSETPERSIST, 1) < 0)
@@ -265,38 +308,106 @@ int net_tap_open(char *devname) {
 	// bring the interface up
 	net_if_up(devname);
 
-	return fd;
+	return fds[0];
 }
 
 
 //*****************************************************
 // UDP
 //*****************************************************
-int net_udp_server(int port) {
-	int fd;
-	struct sockaddr_in addr;
+// Sharded UDP sockets
+// - one SO_REUSEPORT socket for each worker, all bound to the same port
+// - a classic BPF program attached to the group steers the incoming packets on the lane
+//   field of the tunnel header; all the packets of a lane land on the same worker,
+//   together with the decompression table and the replay state for that lane
+static void net_udp_steering(int fd, int socks) {
+	struct sock_filter code[] = {
+		// the program starts at the UDP payload: A = lane field in the first byte of PacketHeader
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, F_LANE_SHIFT),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, F_LANE_MASK >> F_LANE_SHIFT),
+		// the remote end could run more workers than we do
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, socks),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+		errExit("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+}
 
-	if ( (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
-		errExit("socket");
+// open socks UDP sockets bound to port; port 0 picks up an ephemeral port for all sockets
+static void net_udp_open(int port, int *fds, int socks) {
+	assert(fds);
+	assert(socks >= 1 && socks <= WORKERS_MAX);
 
+	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family    = AF_INET;
 	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = htons(port);
 
-	if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
-		errExit("bind");
+	int i;
+	for (i = 0; i < socks; i++) {
+		int fd;
+		if ( (fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 )
+			errExit("socket");
+
+		if (socks > 1) {
+			int one = 1;
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+				errExit("setsockopt SO_REUSEPORT");
+		}
+
+		if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
+			errExit("bind");
 
-	return fd;
+		// the next sockets join the group on the same port
+		if (i == 0 && port == 0) {
+			socklen_t len = sizeof(addr);
+			if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+				errExit("getsockname");
+		}
+		fds[i] = fd;
+	}
+
+	if (socks > 1)
+		net_udp_steering(fds[0], socks);
 }
 
-int net_udp_client(void) {
-	int fd;
+void net_udp_server(int port, int *fds, int socks) {
+	net_udp_open(port, fds, socks);
+}
 
-	if ( (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
-		errExit("socket");
+void net_udp_client(int *fds, int socks) {
+	// a single client socket is bound by the kernel on the first sendto();
+	// the AF_XDP fast path needs the port number before that
+	if (socks == 1 && !arg_xdp) {
+		if ( (fds[0] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 )
+			errExit("socket");
+		return;
+	}
+
+	net_udp_open(0, fds, socks);
+}
+
+// return 1 if the kernel supports UDP segmentation offload on this socket
+int net_udp_gso(int fd) {
+	int zero = 0;	// the segment size is passed in a control message for each buffer
+	if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) < 0)
+		return 0;
+	return 1;
+}
 
-	return fd;
+// enable UDP receive coalescing on this socket, return 1 if supported by the kernel
+int net_udp_gro(int fd) {
+	int one = 1;
+	if (setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+		return 0;
+	return 1;
 }
 
 //*****************************************************
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include <arpa/inet.h>
+#include <linux/virtio_net.h>
+
+// Tap device offloads (--tso)
+// - the tap device is opened with IFF_VNET_HDR, every frame is preceded by a virtio-net header
+// - the kernel hands us TCP/IPv4 super-frames up to 64KB, and frames without the
+//   TCP/UDP checksum; we segment the super-frames in MSS-sized frames and fill in the checksums
+//   before the frames go in the tunnel
+// - the frames coming out of the tunnel were checksummed by the sender, they are written
+//   to the tap device marked as already verified
+
+// add len bytes to a 32-bit ones' complement sum
+uint32_t csum_add(uint32_t sum, const uint8_t *ptr, int len) {
+	while (len > 1) {
+		uint16_t v;
+		memcpy(&v, ptr, 2);	// we could be misaligned in memory
+		sum += v;
+		ptr += 2;
+		len -= 2;
+	}
+	if (len) {
+		uint16_t v = 0;
+		memcpy(&v, ptr, 1);
+		sum += v;
+	}
+	return sum;
+}
+
+uint16_t csum_fold(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t) ~sum;
+}
+
+// Complete the checksum of a frame marked VIRTIO_NET_HDR_F_NEEDS_CSUM. The checksum field
+// already holds the pseudo-header sum. Return 1 if done, 0 if the offsets are invalid.
+int tso_checksum(uint8_t *frame, int len, struct virtio_net_hdr *vh) {
+	int start = vh->csum_start;
+	int offset = start + vh->csum_offset;
+	if (start >= len || offset + 2 > len)
+		return 0;
+
+	uint16_t csum = csum_fold(csum_add(0, frame + start, len - start));
+	memcpy(frame + offset, &csum, 2);
+	return 1;
+}
+
+// Prepare the segmentation of a TCP/IPv4 super-frame; return 1 if the frame can be segmented.
+int tso_init(Tso *t, struct virtio_net_hdr *vh, uint8_t *frame, int len) {
+	memset(t, 0, sizeof(Tso));
+	if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV4)
+		return 0;
+	if (len < 14 + 20 + 20)
+		return 0;
+	if (frame[12] != 0x08 || frame[13] != 0x00)	// IPv4 in eth header
+		return 0;
+
+	uint8_t *ip = frame + 14;
+	int iplen = (ip[0] & 0x0f) * 4;
+	if ((ip[0] >> 4) != 4 || iplen < 20 || ip[9] != 6)	// TCP
+		return 0;
+	if (14 + iplen + 20 > len)
+		return 0;
+	uint8_t *tcp = ip + iplen;
+	int tcplen = (tcp[12] >> 4) * 4;
+	if (tcplen < 20 || 14 + iplen + tcplen > len)
+		return 0;
+
+	t->frame = frame;
+	t->len = len;
+	t->iplen = iplen;
+	t->hdrlen = 14 + iplen + tcplen;
+	t->mss = vh->gso_size;
+	if (t->mss == 0 || (unsigned) (t->hdrlen + t->mss) > TSO_FRAME_MAX)
+		return 0;
+	t->offset = t->hdrlen;
+
+	uint16_t id;
+	memcpy(&id, ip + 4, 2);
+	t->id = ntohs(id);
+	uint32_t seq;
+	memcpy(&seq, tcp + 4, 4);
+	t->seq = ntohl(seq);
+	return 1;
+}
+
+// Build the next segment in dst; return the length of the frame, or 0 if there are no more segments.
+int tso_next(Tso *t, uint8_t *dst) {
+	int remaining = t->len - t->offset;
+	if (remaining <= 0)
+		return 0;
+	int plen = (remaining < t->mss)? remaining: t->mss;
+	int last = (plen == remaining);
+
+	memcpy(dst, t->frame, t->hdrlen);
+	memcpy(dst + t->hdrlen, t->frame + t->offset, plen);
+	uint8_t *ip = dst + 14;
+	uint8_t *tcp = ip + t->iplen;
+	int tcplen = t->hdrlen - 14 - t->iplen + plen;
+
+	// IP header: length, id, checksum
+	uint16_t v = htons(t->iplen + tcplen);
+	memcpy(ip + 2, &v, 2);
+	v = htons(t->id + t->segment);
+	memcpy(ip + 4, &v, 2);
+	memset(ip + 10, 0, 2);
+	v = csum_fold(csum_add(0, ip, t->iplen));
+	memcpy(ip + 10, &v, 2);
+
+	// TCP header: sequence number, flags, checksum
+	uint32_t seq = htonl(t->seq + (t->offset - t->hdrlen));
+	memcpy(tcp + 4, &seq, 4);
+	if (t->segment)
+		tcp[13] &= ~0x80;	// CWR only in the first segment
+	if (!last)
+		tcp[13] &= ~0x09;	// FIN and PSH only in the last segment
+	memset(tcp + 16, 0, 2);
+	uint32_t sum = csum_add(0, ip + 12, 8);	// pseudo-header: addresses, protocol, TCP length
+	sum += htons(6);
+	sum += htons(tcplen);
+	v = csum_fold(csum_add(sum, tcp, tcplen));
+	memcpy(tcp + 16, &v, 2);
+
+	t->offset += plen;
+	t->segment++;
+	return t->hdrlen + plen;
+}
@@ -21,16 +21,12 @@
 #include <time.h>
 #include <arpa/inet.h>
 
+// Replay cache for the HELLO packets starting a new session. There is no peer, so no replay
+// window yet; a HELLO is accepted only if its timestamp is newer than the last one accepted
+// with the same low bits of seq, whatever address it comes from. Without it, a captured HELLO
+// sent again from spoofed addresses would open a session for every address.
 static uint32_t scache[SEQ_DELTA_MAX];
-static int scache_initialized = 0;
-
-static void scache_init(void) {
-	time_t ts = time(NULL);
-	int i;
-	for (i = 0; i < SEQ_DELTA_MAX; i++)
-		scache[i] = ts - 1;
-	scache_initialized = 1;
-}
+static int scache_lock = 0;
 
 void pkt_set_header(PacketHeader *header, uint8_t opcode, uint32_t seq)  {
 	assert(header);
@@ -40,78 +36,138 @@ void pkt_set_header(PacketHeader *header, uint8_t opcode, uint32_t seq)  {
 	header->timestamp = htonl(time(NULL));
 }
 
+// Add the BLAKE2 tags to n tunnel packets built in place. pkt[i] is the start of the packet,
+// len[i] the length without the tag; the tag goes after the data.
+void pkt_sign_batch(uint8_t **pkt, unsigned *len, int n) {
+	HashReq req[HASH_BATCH];
+	int i = 0;
+	while (i < n) {
+		int cnt = (n - i < HASH_BATCH)? n - i: HASH_BATCH;
+		int j;
+		for (j = 0; j < cnt; j++) {
+			PacketHeader *hdr = (PacketHeader *) pkt[i + j];
+			req[j].in = pkt[i + j];
+			req[j].inlen = len[i + j];
+			req[j].timestamp = ntohl(hdr->timestamp);
+			req[j].seq = ntohs(hdr->seq);
+			req[j].out = pkt[i + j] + len[i + j];
+		}
+		get_hash_batch(req, cnt);
+		i += cnt;
+	}
+}
+
+// Check the BLAKE2 tags of n received packets, len[i] includes the tag. The result goes
+// in auth[i], AUTH_OK or AUTH_FAIL.
+void pkt_verify_batch(uint8_t **pkt, unsigned *len, int n, uint8_t *auth) {
+	HashReq req[HASH_BATCH];
+	uint8_t tag[HASH_BATCH][KEY_LEN];
+	int index[HASH_BATCH];
+	int i = 0;
+	while (i < n) {
+		// the short packets are dropped before the tag is checked
+		int cnt = 0;
+		for (; i < n && cnt < HASH_BATCH; i++) {
+			auth[i] = AUTH_FAIL;
+			if (len[i] < sizeof(PacketHeader) + KEY_LEN)
+				continue;
+			PacketHeader *hdr = (PacketHeader *) pkt[i];
+			req[cnt].in = pkt[i];
+			req[cnt].inlen = len[i] - KEY_LEN;
+			req[cnt].timestamp = ntohl(hdr->timestamp);
+			req[cnt].seq = ntohs(hdr->seq);
+			req[cnt].out = tag[cnt];
+			index[cnt++] = i;
+		}
+		get_hash_batch(req, cnt);
+
+		int j;
+		for (j = 0; j < cnt; j++) {
+			if (memcmp(req[j].in + req[j].inlen, tag[j], KEY_LEN) == 0)
+				auth[index[j]] = AUTH_OK;
+		}
+	}
+}
+
 // return 1 if header is good, 0 if bad
-int pkt_check_header(UdpFrame *pkt, unsigned len, struct sockaddr_in *client_addr) {
+// peer is NULL for the first HELLO packet of a new client, checked against scache
+// auth is the result of pkt_verify_batch(), or AUTH_UNKNOWN if the tag was not checked yet
+int pkt_check_header(Peer *peer, UdpFrame *pkt, unsigned len, struct sockaddr_in *client_addr, int auth) {
 	assert(pkt);
 	PacketHeader *header = &pkt->header;
 
-	if (scache_initialized == 0)
-		scache_init();
-
 	// check packet length
 	if (len < sizeof(PacketHeader) + KEY_LEN)
 		return 0;
 
-	// check opcode
-	if (header->opcode >= O_MAX)
+	// check opcode and flags
+	if (header->opcode >= O_MAX || (header->flags & ~opcode_flags(header->opcode)))
 		return 0;
 
-	// check ip:port
-	if (tunnel.remote_sock_addr.sin_port != 0 &&
-	    tunnel.remote_sock_addr.sin_addr.s_addr != 0) {
-		if (tunnel.remote_sock_addr.sin_addr.s_addr != client_addr->sin_addr.s_addr ||
-		    tunnel.remote_sock_addr.sin_port != client_addr->sin_port) {
-		    	tunnel.stats.udp_rx_drop_addr_pkt++;
-
-		    	logmsg("Address mismatch %d.%d.%d.%d:%d\n",
-				PRINT_IP(ntohl(client_addr->sin_addr.s_addr)),
-				ntohs(client_addr->sin_port));
-
-		    	return 0;
-		}
-	}
-
 	// check timestamp
 	uint32_t current_timestamp = time(NULL);
 	uint32_t timestamp = ntohl(header->timestamp);
 	uint32_t delta = diff_uint32(current_timestamp, timestamp);
 	if (delta > TIMESTAMP_DELTA_MAX) {
-		tunnel.stats.udp_rx_drop_timestamp_pkt++;
+		thread_stats->udp_rx_drop_timestamp_pkt++;
 		return 0;
 	}
 
-	// accept packet if bigger timestamp than what we have stored in scache
-	// this basically limits the incoming speed  to SEQ_DELTA_MAX packets per second
+	// drop the duplicates before spending time on BLAKE2
 	uint16_t seq = ntohs(header->seq);
-	uint32_t index = seq  & SEQ_BITMAP;
-	if (timestamp <= scache[index]) {
-		tunnel.stats.udp_rx_drop_seq_pkt++;
+	if (peer && auth == AUTH_UNKNOWN && !replay_check(&peer->replay, seq, timestamp)) {
+		thread_stats->udp_rx_drop_seq_pkt++;
+		return 0;
+	}
+	uint32_t index = seq & (SEQ_DELTA_MAX - 1);
+	if (!peer && timestamp <= __atomic_load_n(&scache[index], __ATOMIC_RELAXED)) {
+		thread_stats->udp_rx_drop_seq_pkt++;
 		return 0;
 	}
-	else // store timestamp
-		scache[index] = timestamp;
 
 	// check blake2
-	uint8_t *hash = get_hash((uint8_t *)pkt, len - KEY_LEN,
-		ntohl(header->timestamp), ntohs(header->seq));
+	if (auth == AUTH_UNKNOWN) {
+		uint8_t hash[KEY_LEN];
+		get_hash((uint8_t *)pkt, len - KEY_LEN,
+			ntohl(header->timestamp), ntohs(header->seq), hash);
+		auth = (memcmp((uint8_t *) pkt + len - KEY_LEN, hash, KEY_LEN) == 0)? AUTH_OK: AUTH_FAIL;
+	}
 
-	if (memcmp((uint8_t *) pkt + len - KEY_LEN, hash, KEY_LEN)) {
-		tunnel.stats.udp_rx_drop_blake2_pkt++;
+	if (auth != AUTH_OK) {
+		thread_stats->udp_rx_drop_blake2_pkt++;
 	    	logmsg("Hash mismatch %d.%d.%d.%d:%d\n",
 			PRINT_IP(ntohl(client_addr->sin_addr.s_addr)),
 			ntohs(client_addr->sin_port));
 		return 0;
 	}
 
+	// only the authenticated packets move the replay window; another worker could have
+	// accepted the same packet since the first check
+	if (peer && !replay_update(&peer->replay, seq, timestamp)) {
+		thread_stats->udp_rx_drop_seq_pkt++;
+		return 0;
+	}
+	if (!peer) {
+		spin_lock(&scache_lock);
+		int fresh = (timestamp > scache[index]);
+		if (fresh)
+			__atomic_store_n(&scache[index], timestamp, __ATOMIC_RELAXED);
+		spin_unlock(&scache_lock);
+		if (!fresh) {
+			thread_stats->udp_rx_drop_seq_pkt++;
+			return 0;
+		}
+	}
+
 	return 1;
 }
 
 
-void pkt_send_hello(UdpFrame *frame, int udpfd) {
+void pkt_send_hello(Peer *peer, UdpFrame *frame, int udpfd) {
 	// set header
-	tunnel.seq++;
-	pkt_set_header(&frame->header, O_HELLO,  tunnel.seq);
-	if (tunnel.state == S_DISCONNECTED)
+	uint16_t seq = peer_next_seq(peer);
+	pkt_set_header(&frame->header, O_HELLO,  seq);
+	if (peer->state == S_DISCONNECTED)
 		frame->header.flags |= F_SYNC;
 	int nbytes = sizeof(PacketHeader);
 
@@ -130,85 +186,268 @@ void pkt_send_hello(UdpFrame *frame, int udpfd) {
 	}
 
 	// add hash
-	uint8_t *hash = get_hash((uint8_t *)frame, nbytes,
-		ntohl(frame->header.timestamp), tunnel.seq);
-	memcpy((uint8_t *) frame + nbytes, hash, KEY_LEN);
+	get_hash((uint8_t *)frame, nbytes,
+		ntohl(frame->header.timestamp), seq, (uint8_t *) frame + nbytes);
 
 	// send
 	int rv = sendto(udpfd, frame, nbytes + KEY_LEN, 0,
-			(const struct sockaddr *) &tunnel.remote_sock_addr,
+			(const struct sockaddr *) &peer->addr,
 			sizeof(struct sockaddr_in));
 	if (rv == -1)
 		perror("sendto");
-	tunnel.stats.udp_tx_pkt++;
+	thread_stats->udp_tx_pkt++;
+	peer_stats_add(&peer->stats.tx_pkt, 1);
+}
+
+// Send the loss measured on the packets coming from the peer, and cnt contexts to refresh,
+// NACK_ENTRY bytes each: opcode of the compression profile, lane, 16-bit context id.
+void pkt_send_nack(Peer *peer, UdpFrame *frame, int udpfd, const uint8_t *entries, int cnt) {
+	// set header
+	uint16_t seq = peer_next_seq(peer);
+	pkt_set_header(&frame->header, O_NACK,  seq);
+	int nbytes = sizeof(PacketHeader);
+
+	uint16_t loss = htons((uint16_t) peer->rx_loss);
+	memcpy(frame->eth, &loss, 2);
+	if (cnt)
+		memcpy(frame->eth + 2, entries, cnt * NACK_ENTRY);
+	nbytes += 2 + cnt * NACK_ENTRY;
+
+	// add hash
+	get_hash((uint8_t *)frame, nbytes,
+		ntohl(frame->header.timestamp), seq, (uint8_t *) frame + nbytes);
+
+	// send
+	int rv = sendto(udpfd, frame, nbytes + KEY_LEN, 0,
+			(const struct sockaddr *) &peer->addr,
+			sizeof(struct sockaddr_in));
+	if (rv == -1)
+		perror("sendto");
+	thread_stats->udp_tx_pkt++;
+	thread_stats->compress_nack_tx += cnt;
+	peer_stats_add(&peer->stats.tx_pkt, 1);
+}
+
+// send a text message to the client
+static void send_message(Peer *peer, UdpFrame *frame, int udpfd, const char *msg) {
+	// set header
+	uint16_t seq = peer_next_seq(peer);
+	pkt_set_header(&frame->header, O_MESSAGE,  seq);
+	int nbytes = sizeof(PacketHeader);
+
+	// copy the message
+	strcpy(((char *) frame) + nbytes, msg);
+	nbytes += strlen(msg) + 1;
+
+	// add hash
+	get_hash((uint8_t *)frame, nbytes,
+		ntohl(frame->header.timestamp), seq, (uint8_t *) frame + nbytes);
+
+	// send
+	int rv = sendto(udpfd, frame, nbytes + KEY_LEN, 0,
+			(const struct sockaddr *) &peer->addr,
+			sizeof(struct sockaddr_in));
+	if (rv == -1)
+		perror("sendto");
+	thread_stats->udp_tx_pkt++;
+	peer_stats_add(&peer->stats.tx_pkt, 1);
+}
+
+// Append to the stats message ending at end; a message too long for the buffer is cut short
+// and ends in "...". Return the new end of the message.
+static char *append(char *ptr, char *end, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static char *append(char *ptr, char *end, const char *fmt, ...) {
+	if (end - ptr <= 1)
+		return ptr;	// truncated already
+
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(ptr, end - ptr, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return ptr;
+	if (n >= end - ptr) {
+		memcpy(end - 4, "...", 4);
+		return end - 1;
+	}
+	return ptr + n;
 }
 
 void pkt_print_stats(UdpFrame *frame, int udpfd) {
-	if (tunnel.state == S_DISCONNECTED)
+	int clients = peer_connected();
+	if (clients == 0)
 		return;
 
 	// build the stats message
 	char buf[1024];
 	char *ptr = buf;
+	char *end = buf + sizeof(buf);
 	char *type = "Client";
 	if (arg_server)
 		type = "Server";
 	int compressed = 0;
 	if (tunnel.stats.udp_tx_pkt)
 		compressed = (int) (100 * ((float) tunnel.stats.udp_tx_compressed_pkt / (float) tunnel.stats.udp_tx_pkt));
-	sprintf(ptr, "%s: tx %u compressed %d%%; rx %u, DNS %u, drop %u: ",
+	ptr = append(ptr, end, "%s: tx %u compressed %d%%; rx %u, DNS %u, drop %u: ",
 		type,
 		tunnel.stats.udp_tx_pkt,
 		compressed,
 		tunnel.stats.udp_rx_pkt,
 		tunnel.stats.eth_rx_dns,
 		tunnel.stats.udp_rx_drop_pkt);
-	ptr += strlen(ptr);
 
 	if (tunnel.stats.udp_rx_drop_timestamp_pkt) {
-		sprintf(ptr, "tstamp %u, ", tunnel.stats.udp_rx_drop_timestamp_pkt);
-		ptr += strlen(ptr);
+		ptr = append(ptr, end, "tstamp %u, ", tunnel.stats.udp_rx_drop_timestamp_pkt);
 	}
 	if (tunnel.stats.udp_rx_drop_seq_pkt) {
-		sprintf(ptr, "seq %u, ", tunnel.stats.udp_rx_drop_seq_pkt);
-		ptr += strlen(ptr);
+		ptr = append(ptr, end, "seq %u, ", tunnel.stats.udp_rx_drop_seq_pkt);
 	}
 	if (tunnel.stats.udp_rx_drop_addr_pkt) {
-		sprintf(ptr, "addr %u, ", tunnel.stats.udp_rx_drop_addr_pkt);
-		ptr += strlen(ptr);
+		ptr = append(ptr, end, "addr %u, ", tunnel.stats.udp_rx_drop_addr_pkt);
 	}
 	if (tunnel.stats.udp_rx_drop_blake2_pkt) {
-		printf(ptr, "blake2 %u, ", tunnel.stats.udp_rx_drop_blake2_pkt);
-		ptr += strlen(ptr);
+		ptr = append(ptr, end, "blake2 %u, ", tunnel.stats.udp_rx_drop_blake2_pkt);
+	}
+	if (tunnel.stats.eth_tx_drop_pkt) {
+		ptr = append(ptr, end, "tap queue %u, ", tunnel.stats.eth_tx_drop_pkt);
+	}
+	if (tunnel.stats.eth_rx_drop_pkt) {
+		ptr = append(ptr, end, "udp queue %u, ", tunnel.stats.eth_rx_drop_pkt);
+	}
+	if (tunnel.stats.udp_rx_drop_padding_pkt) {
+		ptr = append(ptr, end, "padding %u, ", tunnel.stats.udp_rx_drop_padding_pkt);
+	}
+	if (tunnel.stats.udp_rx_drop_compress_pkt) {
+		ptr = append(ptr, end, "decompress %u, ", tunnel.stats.udp_rx_drop_compress_pkt);
+	}
+	if (tunnel.stats.compress_l4_refresh) {
+		ptr = append(ptr, end, "tcp refresh %u, ", tunnel.stats.compress_l4_refresh);
+	}
+	if (tunnel.stats.compress_evict) {
+		ptr = append(ptr, end, "flow evict %u, ", tunnel.stats.compress_evict);
+	}
+	if (tunnel.stats.compress_nack_tx || tunnel.stats.compress_nack_rx) {
+		ptr = append(ptr, end, "nack tx %u rx %u, ", tunnel.stats.compress_nack_tx, tunnel.stats.compress_nack_rx);
+	}
+	if (!arg_server && (peers[0]->rx_loss || peers[0]->tx_loss)) {
+		ptr = append(ptr, end, "loss rx %.1f%% tx %.1f%%, ", peers[0]->rx_loss / 10.0, peers[0]->tx_loss / 10.0);
 	}
-	if (tunnel.stats.udp_rx_drop_padding_pkt)
-		sprintf(ptr, "padding %u", tunnel.stats.udp_rx_drop_padding_pkt);
+	if (arg_server) {
+		ptr = append(ptr, end, "clients %d, ", clients);
+	}
+
+	// packet rate and CPU time per packet since the last report
+	static TStats last;
+	static struct timespec last_wall;
+	static struct timespec last_cpu;
+	struct timespec wall;
+	struct timespec cpu;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	unsigned pkts = (tunnel.stats.udp_tx_pkt - last.udp_tx_pkt) + (tunnel.stats.udp_rx_pkt - last.udp_rx_pkt);
+	if (last_wall.tv_sec && pkts) {
+		double dwall = (wall.tv_sec - last_wall.tv_sec) + (wall.tv_nsec - last_wall.tv_nsec) / 1e9;
+		double dcpu = (cpu.tv_sec - last_cpu.tv_sec) + (cpu.tv_nsec - last_cpu.tv_nsec) / 1e9;
+		ptr = append(ptr, end, "pps %u, cpu %.2f us/pkt",
+			(unsigned) (pkts / dwall),
+			(dcpu * 1e6) / pkts);
+
+		// average number of packets moved by a single recvmmsg()/sendmmsg() call
+		unsigned rxb = tunnel.stats.udp_rx_batch - last.udp_rx_batch;
+		unsigned txb = tunnel.stats.udp_tx_batch - last.udp_tx_batch;
+		if (rxb || txb) {
+			ptr = append(ptr, end, ", batch rx %.1f tx %.1f",
+				(rxb)? (double) (tunnel.stats.udp_rx_pkt - last.udp_rx_pkt) / rxb: 0,
+				(txb)? (double) (tunnel.stats.udp_tx_pkt - last.udp_tx_pkt) / txb: 0);
+		}
+
+		// share of the packets sent in UDP_SEGMENT buffers
+		unsigned txp = tunnel.stats.udp_tx_pkt - last.udp_tx_pkt;
+		unsigned gso = tunnel.stats.udp_tx_gso_pkt - last.udp_tx_gso_pkt;
+		if (gso && txp) {
+			ptr = append(ptr, end, ", gso %d%%", (int) (100 * ((float) gso / (float) txp)));
+		}
+		unsigned rxp = tunnel.stats.udp_rx_pkt - last.udp_rx_pkt;
+		unsigned gro = tunnel.stats.udp_rx_gro_pkt - last.udp_rx_gro_pkt;
+		if (gro && rxp) {
+			ptr = append(ptr, end, ", gro %d%%", (int) (100 * ((float) gro / (float) rxp)));
+		}
+		unsigned tso = tunnel.stats.eth_rx_tso_pkt - last.eth_rx_tso_pkt;
+		if (tso && txp) {
+			ptr = append(ptr, end, ", tso %d%%", (int) (100 * ((float) tso / (float) txp)));
+		}
+		unsigned xdprx = tunnel.stats.udp_rx_xdp_pkt - last.udp_rx_xdp_pkt;
+		unsigned xdptx = tunnel.stats.udp_tx_xdp_pkt - last.udp_tx_xdp_pkt;
+		if (xdprx || xdptx) {
+			ptr = append(ptr, end, ", xdp rx %d%% tx %d%%",
+				(rxp)? (int) (100 * ((float) xdprx / (float) rxp)): 0,
+				(txp)? (int) (100 * ((float) xdptx / (float) txp)): 0);
+		}
+
+		// bytes removed by each header compression profile
+		unsigned saved[4] = {
+			tunnel.stats.compress_l2_saved - last.compress_l2_saved,
+			tunnel.stats.compress_l3_saved - last.compress_l3_saved,
+			tunnel.stats.compress_l4_saved - last.compress_l4_saved,
+			tunnel.stats.compress_udp_saved - last.compress_udp_saved
+		};
+		static const char *profile[4] = {"l2", "l3", "tcp", "udp"};
+		if (saved[0] || saved[1] || saved[2] || saved[3]) {
+			ptr = append(ptr, end, ", saved");
+			int i;
+			for (i = 0; i < 4; i++) {
+				if (saved[i]) {
+					ptr = append(ptr, end, " %s %.1f", profile[i], saved[i] / dwall / 1024);
+				}
+			}
+			ptr = append(ptr, end, " KB/s");
+		}
+
+		// payload compression: bytes saved, ratio on the bytes offered, CPU cycles for each
+		// byte going through the compressor
+		unsigned lzin = tunnel.stats.lz_in - last.lz_in;
+		unsigned lzout = tunnel.stats.lz_out - last.lz_out;
+		if (lzin) {
+			unsigned tried = tunnel.stats.lz_tried - last.lz_tried;
+			ptr = append(ptr, end, ", lz saved %.1f KB/s (%d%%), %.1f cycles/byte",
+				(lzin - lzout) / dwall / 1024,
+				(int) (100 * ((float) lzout / (float) lzin)),
+				(tried)? (tunnel.stats.lz_kcycles - last.lz_kcycles) * 1024.0 / tried: 0);
+		}
+
+		// CPU cycles spent in the scrambler plugin for each packet
+		unsigned ptx = tunnel.stats.plugin_tx_pkt - last.plugin_tx_pkt;
+		unsigned prx = tunnel.stats.plugin_rx_pkt - last.plugin_rx_pkt;
+		if (ptx || prx) {
+			ptr = append(ptr, end, ", plugin %.32s cycles/pkt tx %u rx %u", plugin_name(),
+				(ptx)? (unsigned) ((tunnel.stats.plugin_tx_kcycles - last.plugin_tx_kcycles) * 1024.0 / ptx): 0,
+				(prx)? (unsigned) ((tunnel.stats.plugin_rx_kcycles - last.plugin_rx_kcycles) * 1024.0 / prx): 0);
+		}
+	}
+	memcpy(&last, &tunnel.stats, sizeof(TStats));
+	last_wall = wall;
+	last_cpu = cpu;
 
 	// print stats message on console
 	printf("%s\n", buf);
 
-	// send the message to the client
-	if (arg_server && tunnel.state == S_CONNECTED) {
-		// set header
-		tunnel.seq++;
-		pkt_set_header(&frame->header, O_MESSAGE,  tunnel.seq);
-		int nbytes = sizeof(PacketHeader);
-
-		// copy the message
-		strcpy(((char *) frame) + nbytes, buf);
-		nbytes += strlen(buf) + 1;
-
-		// add hash
-		uint8_t *hash = get_hash((uint8_t *)frame, nbytes,
-			ntohl(frame->header.timestamp), tunnel.seq);
-		memcpy((uint8_t *) frame + nbytes, hash, KEY_LEN);
-
-		// send
-		int rv = sendto(udpfd, frame, nbytes + KEY_LEN, 0,
-				(const struct sockaddr *) &tunnel.remote_sock_addr,
-				sizeof(struct sockaddr_in));
-		if (rv == -1)
-			perror("sendto");
-		tunnel.stats.udp_tx_pkt++;
+	// send each client its own stats
+	if (arg_server) {
+		int i;
+		for (i = 0; i < peers_cnt; i++) {
+			Peer *peer = peers[i];
+			if (peer->state != S_CONNECTED)
+				continue;
+
+			compressed = 0;
+			if (peer->stats.tx_pkt)
+				compressed = (int) (100 * ((float) peer->stats.tx_compressed_pkt / (float) peer->stats.tx_pkt));
+			snprintf(buf, sizeof(buf), "Server: tx %u compressed %d%%; rx %u, clients %d",
+				peer->stats.tx_pkt,
+				compressed,
+				peer->stats.rx_pkt,
+				clients);
+			send_message(peer, frame, udpfd, buf);
+		}
 	}
 }
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include <time.h>
+
+// Peer table
+// - the server keeps one session for each client, the client has only one peer, the server
+// - the Peer structures are allocated on first use and never released; a slot is reused
+//   when a new client connects after the old one was disconnected
+// - address lookup: open addressing hash table of PEER_HASH_SIZE pointers, linear probing;
+//   the lookup doesn't take any locks, the table is modified only under the state lock
+//   in child.c; the tombstones left by peer_remove() are cleared at the end of a probe
+//   chain, and the table is rebuilt in the spare copy when they grow above TOMBSTONE_MAX,
+//   so a lookup for an unknown address always stops on an empty slot quickly
+// - MAC address table: frames received from a peer teach us where the source MAC address
+//   lives; the table is used to pick up the peer for the frames read from the tap device
+Peer *peers[PEERS_MAX];
+int peers_cnt = 0;	// number of slots allocated in peers
+
+#define PEER_HASH_BITS 12
+#define PEER_HASH_SIZE (1 << PEER_HASH_BITS)	// 4 times PEERS_MAX
+static Peer *peer_hash_mem[2][PEER_HASH_SIZE];
+static Peer **peer_hash = peer_hash_mem[0];	// the table in use
+static Peer peer_tombstone;	// marks a removed entry in peer_hash
+#define TOMBSTONE (&peer_tombstone)
+#define TOMBSTONE_MAX (PEER_HASH_SIZE / 4)
+static int tombstones = 0;
+
+// MAC address table, each entry packs the MAC address (48 bits) and the peer id + 1 (16 bits)
+#define FDB_SIZE 4096	// power of 2
+#define FDB_PROBE 4
+static uint64_t fdb[FDB_SIZE];
+
+static inline int addr_equal(struct sockaddr_in *a, struct sockaddr_in *b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static inline unsigned addr_hash(struct sockaddr_in *addr) {
+	uint32_t h = addr->sin_addr.s_addr ^ ((uint32_t) addr->sin_port << 16);
+	h *= 0x9e3779b1;	// golden ratio multiplicative hash
+	return h >> (32 - PEER_HASH_BITS);
+}
+
+static Peer *peer_alloc(int id) {
+	Peer *p = malloc(sizeof(Peer));
+	if (!p)
+		errExit("malloc");
+	memset(p, 0, sizeof(Peer));
+	p->id = id;
+	return p;
+}
+
+// reset the session data; the server clears the tables also when reusing a slot
+static void peer_reset(Peer *p) {
+	p->state = S_DISCONNECTED;
+	p->connect_ttl = 0;
+	p->seq = 0;
+	memset(&p->stats, 0, sizeof(PeerStats));
+	spin_lock(&p->route_lock);
+	memset(&p->route, 0, sizeof(XdpRoute));
+	spin_unlock(&p->route_lock);
+
+	replay_init(&p->replay);
+	compress_l2_init(p);
+	compress_l3_init(p);
+	compress_l4_init(p);
+	compress_udp_init(p);
+	p->rx_loss = 0;
+	p->loss_pkt = 0;
+	p->loss_top = 0;
+	flow_loss(p, 0);
+}
+
+// called before the worker threads are started
+void peer_init(void) {
+	if (arg_server)
+		return;
+
+	// the client talks only to the server
+	Peer *p = peer_alloc(0);
+	p->addr.sin_family = AF_INET;
+	if (arg_remote_addr)
+		p->addr.sin_addr.s_addr = htonl(arg_remote_addr);
+	else
+		p->addr.sin_addr.s_addr = INADDR_ANY;
+	p->addr.sin_port = htons(arg_port);
+	peer_reset(p);
+	peers[0] = p;
+	peers_cnt = 1;
+}
+
+// find the peer for this address, return NULL if not found
+Peer *peer_find(struct sockaddr_in *addr) {
+	if (!arg_server) {
+		// without a server address configured, the client accepts the first server responding
+		Peer *p = peers[0];
+		if (p->addr.sin_addr.s_addr == 0 || addr_equal(&p->addr, addr))
+			return p;
+		return NULL;
+	}
+
+	Peer **table = __atomic_load_n(&peer_hash, __ATOMIC_ACQUIRE);
+	unsigned h = addr_hash(addr);
+	unsigned i;
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		Peer *p = __atomic_load_n(&table[(h + i) & (PEER_HASH_SIZE - 1)], __ATOMIC_ACQUIRE);
+		if (p == NULL)
+			break;
+		if (p != TOMBSTONE && addr_equal(&p->addr, addr))
+			return p;
+	}
+
+	return NULL;
+}
+
+// add a new server session; called with the state lock held
+// return NULL if the table is full
+Peer *peer_add(struct sockaddr_in *addr) {
+	assert(arg_server);
+
+	// pick up a free slot
+	Peer *p = NULL;
+	int i;
+	for (i = 0; i < peers_cnt; i++) {
+		if (peers[i]->addr.sin_port == 0) {
+			p = peers[i];
+			break;
+		}
+	}
+	if (!p) {
+		if (peers_cnt == PEERS_MAX)
+			return NULL;
+		p = peer_alloc(peers_cnt);
+		peers[peers_cnt] = p;
+		__atomic_store_n(&peers_cnt, peers_cnt + 1, __ATOMIC_RELEASE);
+	}
+	peer_reset(p);
+	memcpy(&p->addr, addr, sizeof(struct sockaddr_in));
+
+	// insert it in the hash table, reusing the first tombstone found
+	unsigned h = addr_hash(addr);
+	unsigned j;
+	Peer **slot = NULL;
+	for (j = 0; j < PEER_HASH_SIZE; j++) {
+		Peer **ptr = &peer_hash[(h + j) & (PEER_HASH_SIZE - 1)];
+		if (*ptr == TOMBSTONE && slot == NULL)
+			slot = ptr;
+		else if (*ptr == NULL) {
+			if (slot == NULL)
+				slot = ptr;
+			break;
+		}
+	}
+	assert(slot);	// the hash table is 4 times bigger than the peer table
+	if (*slot == TOMBSTONE)
+		tombstones--;
+	__atomic_store_n(slot, p, __ATOMIC_RELEASE);
+
+	return p;
+}
+
+// Measure the loss of the packets coming from the peer since the last measurement, in
+// per mille; the sequence numbers skipped by the replay window against the packets accepted.
+// The estimate moves halfway to the new value, and it stays put without enough traffic.
+// Called from the timer every TIMEOUT seconds.
+#define LOSS_MIN_PKT 100
+int peer_rx_loss(Peer *p) {
+	spin_lock(&p->replay.lock);
+	uint64_t top = p->replay.top;
+	spin_unlock(&p->replay.lock);
+	unsigned pkt = __atomic_load_n(&p->stats.rx_pkt, __ATOMIC_RELAXED);
+
+	if (top < p->loss_top) {
+		// the sender restarted its sequence
+		p->loss_top = top;
+		p->loss_pkt = pkt;
+	}
+	uint64_t expected = top - p->loss_top;
+	if (expected < LOSS_MIN_PKT)
+		return p->rx_loss;
+
+	uint64_t received = pkt - p->loss_pkt;
+	int loss = (received < expected)? (int) ((expected - received) * 1000 / expected): 0;
+	p->rx_loss = (p->rx_loss + loss + (loss > p->rx_loss)) / 2;	// rounded towards loss
+	p->loss_top = top;
+	p->loss_pkt = pkt;
+	return p->rx_loss;
+}
+
+// Rebuild the hash table without the tombstones, in the spare copy; the lookups running
+// on the old copy still find every peer, the old copy is not touched before the next
+// rebuild, TOMBSTONE_MAX removals later. Called with the state lock held.
+static void peer_rehash(void) {
+	Peer **old = peer_hash;
+	Peer **table = (old == peer_hash_mem[0])? peer_hash_mem[1]: peer_hash_mem[0];
+	memset(table, 0, sizeof(peer_hash_mem[0]));
+
+	unsigned i;
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		Peer *p = old[i];
+		if (p == NULL || p == TOMBSTONE)
+			continue;
+		unsigned h = addr_hash(&p->addr);
+		while (table[h] != NULL)
+			h = (h + 1) & (PEER_HASH_SIZE - 1);
+		table[h] = p;
+	}
+	__atomic_store_n(&peer_hash, table, __ATOMIC_RELEASE);
+	tombstones = 0;
+}
+
+// remove a server session; called with the state lock held
+void peer_remove(Peer *p) {
+	assert(arg_server);
+
+	unsigned h = addr_hash(&p->addr);
+	unsigned i;
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		unsigned pos = (h + i) & (PEER_HASH_SIZE - 1);
+		if (peer_hash[pos] == NULL)
+			break;
+		if (peer_hash[pos] != p)
+			continue;
+
+		// a tombstone followed by an empty slot ends no probe chain, the tombstones in
+		// front of an empty slot go back to empty
+		__atomic_store_n(&peer_hash[pos], TOMBSTONE, __ATOMIC_RELEASE);
+		tombstones++;
+		if (peer_hash[(pos + 1) & (PEER_HASH_SIZE - 1)] == NULL) {
+			while (peer_hash[pos] == TOMBSTONE) {
+				__atomic_store_n(&peer_hash[pos], NULL, __ATOMIC_RELEASE);
+				tombstones--;
+				pos = (pos - 1) & (PEER_HASH_SIZE - 1);
+			}
+		}
+		break;
+	}
+	if (tombstones > TOMBSTONE_MAX)
+		peer_rehash();
+
+	// forget the MAC addresses of this peer
+	for (i = 0; i < FDB_SIZE; i++) {
+		uint64_t e = __atomic_load_n(&fdb[i], __ATOMIC_RELAXED);
+		if (e && (int) (e & 0xffff) == p->id + 1)
+			__atomic_store_n(&fdb[i], 0, __ATOMIC_RELAXED);
+	}
+
+	p->state = S_DISCONNECTED;
+	memset(&p->addr, 0, sizeof(p->addr));
+}
+
+static inline uint64_t mac_key(uint8_t *mac) {
+	uint64_t key = 0;
+	memcpy(&key, mac, 6);
+	return key << 16;
+}
+
+static inline unsigned mac_hash(uint64_t key) {
+	return (unsigned) ((key * 0x9e3779b97f4a7c15ULL) >> 52) & (FDB_SIZE - 1);
+}
+
+// the frame with this source MAC address was received from peer p
+void peer_learn(Peer *p, uint8_t *mac) {
+	if (*mac & 1)	// multicast/broadcast source address
+		return;
+
+	uint64_t key = mac_key(mac);
+	uint64_t entry = key | (uint64_t) (p->id + 1);
+	unsigned h = mac_hash(key);
+	int i;
+	for (i = 0; i < FDB_PROBE; i++) {
+		uint64_t *ptr = &fdb[(h + i) & (FDB_SIZE - 1)];
+		uint64_t e = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+		if (e == entry)
+			return;
+		if (e == 0 || (e & ~0xffffULL) == key) {
+			__atomic_store_n(ptr, entry, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	// the probe sequence is full, replace the first entry
+	__atomic_store_n(&fdb[h], entry, __ATOMIC_RELAXED);
+}
+
+// return the peer for this destination MAC address, or NULL if the frame needs to go to all peers
+Peer *peer_lookup_mac(uint8_t *mac) {
+	if (!arg_server)
+		return peers[0];
+	if (*mac & 1)	// multicast/broadcast
+		return NULL;
+
+	uint64_t key = mac_key(mac);
+	unsigned h = mac_hash(key);
+	int i;
+	for (i = 0; i < FDB_PROBE; i++) {
+		uint64_t e = __atomic_load_n(&fdb[(h + i) & (FDB_SIZE - 1)], __ATOMIC_RELAXED);
+		if (e == 0)
+			break;
+		if ((e & ~0xffffULL) == key) {
+			Peer *p = peers[(e & 0xffff) - 1];
+			return (p->state == S_CONNECTED)? p: NULL;
+		}
+	}
+
+	return NULL;
+}
+
+int peer_connected(void) {
+	int cnt = 0;
+	int i;
+	int n = __atomic_load_n(&peers_cnt, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		if (peers[i]->state == S_CONNECTED)
+			cnt++;
+	}
+	return cnt;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include "plugin.h"
+#include <dlfcn.h>
+#include <sys/stat.h>
+
+// Scrambler plugins (--plugin)
+// - the shared library is loaded in the parent process at startup, before the fork and
+//   before the seccomp filters are installed
+// - the plugin code runs in the worker threads, the packets of a batch are passed
+//   in a single call
+// - the time spent in the plugin is counted in the worker stats, in CPU cycles
+
+#define PLUGIN_BATCH 64		// packets in a single call
+#define PLUGIN_TEST_LEN 1500
+
+static const FtPlugin *plugin = NULL;
+static __thread uint64_t cycles_left[2];	// cycles not yet added to the stats, tx and rx
+
+// the stats are 32-bit counters, the cycles go in by the thousand (1024)
+static inline void stats_cycles(int rx, uint64_t c, unsigned n) {
+	cycles_left[rx] += c;
+	unsigned k = cycles_left[rx] >> 10;
+	cycles_left[rx] &= 1023;
+	if (rx) {
+		thread_stats->plugin_rx_kcycles += k;
+		thread_stats->plugin_rx_pkt += n;
+	}
+	else {
+		thread_stats->plugin_tx_kcycles += k;
+		thread_stats->plugin_tx_pkt += n;
+	}
+}
+
+// pkt points to the packet header, len includes the header
+static void run(int rx, uint8_t **pkt, unsigned *len, int n) {
+	FtPacket p[PLUGIN_BATCH];
+	int i = 0;
+	while (i < n) {
+		int cnt;
+		for (cnt = 0; i < n && cnt < PLUGIN_BATCH; i++, cnt++) {
+			p[cnt].hdr = (FtHeader *) pkt[i];
+			p[cnt].data = pkt[i] + sizeof(PacketHeader);
+			p[cnt].len = len[i] - sizeof(PacketHeader);
+		}
+
+		uint64_t t0 = cycles();
+		if (rx)
+			plugin->descramble(p, cnt);
+		else
+			plugin->scramble(p, cnt);
+		stats_cycles(rx, cycles() - t0, cnt);
+	}
+}
+
+void plugin_scramble(uint8_t **pkt, unsigned *len, int n) {
+	assert(plugin);
+	run(0, pkt, len, n);
+}
+
+void plugin_descramble(uint8_t **pkt, unsigned *len, int n) {
+	assert(plugin);
+	run(1, pkt, len, n);
+}
+
+const char *plugin_name(void) {
+	return (plugin)? plugin->name: NULL;
+}
+
+// Scramble and descramble a few packets of different lengths in a single batch,
+// the data should come back unchanged. Return 0 if ok.
+static int plugin_selftest(const FtPlugin *p) {
+	static const unsigned lengths[] = {0, 1, 7, 8, 63, 64, 65, 500, PLUGIN_TEST_LEN};
+	const int n = sizeof(lengths) / sizeof(lengths[0]);
+	static uint8_t buf[sizeof(lengths) / sizeof(lengths[0])][sizeof(PacketHeader) + PLUGIN_TEST_LEN];
+	static uint8_t ref[sizeof(lengths) / sizeof(lengths[0])][sizeof(PacketHeader) + PLUGIN_TEST_LEN];
+	FtPacket pkt[sizeof(lengths) / sizeof(lengths[0])];
+
+	int i;
+	for (i = 0; i < n; i++) {
+		unsigned j;
+		for (j = 0; j < sizeof(buf[i]); j++)
+			buf[i][j] = (uint8_t) (j * 31 + i);
+		PacketHeader *hdr = (PacketHeader *) buf[i];
+		pkt_set_header(hdr, O_DATA, (uint16_t) (i + 1));
+		memcpy(ref[i], buf[i], sizeof(buf[i]));
+		pkt[i].hdr = (FtHeader *) buf[i];
+		pkt[i].data = buf[i] + sizeof(PacketHeader);
+		pkt[i].len = lengths[i];
+	}
+
+	p->scramble(pkt, n);
+	p->descramble(pkt, n);
+	for (i = 0; i < n; i++) {
+		if (memcmp(buf[i], ref[i], sizeof(buf[i])))
+			return 1;
+	}
+	return 0;
+}
+
+// Load the plugin and pass it the key dictionaries; the keys should be initialized.
+void plugin_load(const char *fname) {
+	assert(fname);
+
+	// the library runs in the tunnel process with root privileges
+	struct stat s;
+	if (stat(fname, &s) == -1) {
+		fprintf(stderr, "Error: cannot access plugin %s\n", fname);
+		exit(1);
+	}
+	if (s.st_uid != 0 || (s.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "Error: plugin %s should be owned by root and writable only by root\n", fname);
+		exit(1);
+	}
+
+	void *handle = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		fprintf(stderr, "Error: cannot load plugin %s: %s\n", fname, dlerror());
+		exit(1);
+	}
+	const FtPlugin *p = dlsym(handle, FT_PLUGIN_SYMBOL);
+	if (!p) {
+		fprintf(stderr, "Error: %s is not a firetunnel plugin, %s not found\n", fname, FT_PLUGIN_SYMBOL);
+		exit(1);
+	}
+	if (p->abi != FT_PLUGIN_ABI || !p->name || !p->scramble || !p->descramble) {
+		fprintf(stderr, "Error: plugin %s, ABI version %u not supported\n", fname, p->abi);
+		exit(1);
+	}
+
+	FtKeys keys;
+	keys.auth = auth_dictionary;
+	keys.enc = enc_dictionary;
+	keys.key_len = KEY_LEN;
+	keys.key_max = KEY_MAX;
+	if (p->init && p->init(&keys)) {
+		fprintf(stderr, "Error: plugin %s initialization failed\n", p->name);
+		exit(1);
+	}
+	if (plugin_selftest(p)) {
+		fprintf(stderr, "Error: plugin %s self-test failed\n", p->name);
+		exit(1);
+	}
+
+	plugin = p;
+	logmsg("Plugin %s loaded from %s\n", p->name, fname);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#ifndef FIRETUNNEL_PLUGIN_H
+#define FIRETUNNEL_PLUGIN_H
+#include <stdint.h>
+
+// Scrambler plugin ABI, see plugins/README
+// - the plugin is a shared library exporting a FtPlugin descriptor under the name
+//   FT_PLUGIN_SYMBOL; an incompatible change of the ABI bumps both the symbol
+//   and FT_PLUGIN_ABI
+// - the plugin replaces the built-in scrambler for the data packets; the packets are
+//   transformed in place, in batches, before they are signed on transmit and after the
+//   BLAKE2 check on receive
+#define FT_PLUGIN_ABI 1
+#define FT_PLUGIN_SYMBOL "firetunnel_plugin_v1"
+
+// tunnel packet header as found on the wire, seq and timestamp in network byte order;
+// the header is authenticated, the plugin should not modify it
+typedef struct ft_header_t {
+	uint8_t opcode_flags;
+	uint8_t sid;
+	uint16_t seq;
+	uint32_t timestamp;
+} __attribute__((__packed__)) FtHeader;	// 8 bytes
+
+typedef struct ft_packet_t {
+	FtHeader *hdr;
+	uint8_t *data;		// data following the header
+	unsigned len;		// length of the data, it should not change
+} FtPacket;
+
+// key dictionaries, key_max keys of key_len bytes each
+typedef struct ft_keys_t {
+	const uint8_t *auth;	// BLAKE2 authentication keys
+	const uint8_t *enc;	// scrambling keys
+	unsigned key_len;
+	unsigned key_max;
+} FtKeys;
+
+typedef struct ft_plugin_t {
+	unsigned abi;		// FT_PLUGIN_ABI
+	const char *name;
+
+	// called once at startup, before the sandbox is in place; the dictionaries stay valid
+	// for the life of the program; return 0 if ok
+	int (*init)(const FtKeys *keys);
+
+	// transform n packets in place; descramble() should undo scramble()
+	void (*scramble)(FtPacket *pkt, unsigned n);
+	void (*descramble)(FtPacket *pkt, unsigned n);
+} FtPlugin;
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include <errno.h>
+#include <sys/mman.h>
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// Packet buffer pool
+// - fixed-size PacketMem buffers carved out of a single mapping allocated at startup;
+//   see PacketMem in firetunnel.h for the buffer layout
+// - one pool for each worker, used only by the worker thread, there are no locks
+// - a buffer has a single owner at any time: a queue entry, a pipeline stage or an io_uring
+//   request; ownership moves by swapping pointers, the packet is never copied
+// - with --hugepages the mapping sits on 2MB pages (MAP_HUGETLB); if no hugepages are
+//   reserved on the system, we ask for transparent hugepages
+void pool_init(PacketPool *p, unsigned size) {
+	assert(p);
+	assert(size);
+	memset(p, 0, sizeof(PacketPool));
+	p->len = size * sizeof(PacketMem);
+
+	void *mem = MAP_FAILED;
+	if (arg_hugepages) {
+		p->len = (p->len + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+		mem = mmap(NULL, p->len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (mem == MAP_FAILED) {
+			static int warned = 0;
+			if (!warned)
+				fprintf(stderr, "Warning: cannot allocate hugepages (%s), using transparent hugepages\n",
+					strerror(errno));
+			warned = 1;
+		}
+		else
+			p->huge = 1;
+	}
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, p->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			errExit("mmap");
+		if (arg_hugepages)
+			madvise(mem, p->len, MADV_HUGEPAGE);
+		// fault in the pages now, not in the data path
+		memset(mem, 0, p->len);
+	}
+	p->mem = mem;
+
+	p->free = malloc(size * sizeof(PacketMem *));
+	if (!p->free)
+		errExit("malloc");
+	unsigned i;
+	for (i = 0; i < size; i++)
+		p->free[i] = &p->mem[size - 1 - i];	// the first buffers go out first
+	p->cnt = size;
+	p->size = size;
+}
+
+// the pool is sized for all the users at startup, running out of buffers is a bug
+PacketMem *pool_get(PacketPool *p) {
+	if (p->cnt == 0) {
+		fprintf(stderr, "Error: packet buffer pool exhausted\n");
+		exit(1);
+	}
+	return p->free[--p->cnt];
+}
+
+void pool_put(PacketPool *p, PacketMem *mem) {
+	assert(mem >= p->mem && mem < p->mem + p->size);
+	assert(p->cnt < p->size);
+	p->free[p->cnt++] = mem;
+}
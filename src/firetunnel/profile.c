@@ -24,8 +24,14 @@ uint32_t profile_netaddr = 0;
 uint32_t profile_netmask = 0;
 uint32_t profile_defaultgw = 0;
 uint32_t profile_mtu = 0;
+int profile_batch = 0;
+int profile_workers = 0;
+int profile_engine = 0;
+int profile_cpu[WORKERS_MAX];
+int profile_cpu_cnt = 0;
 char *profile_child_seccomp = NULL;
 char *profile_parent_seccomp = NULL;
+char *profile_plugin = NULL;
 
 // remove multiple spaces and return allocated memory
 static char *line_remove_spaces(const char *buf) {
@@ -74,12 +80,92 @@ static char *line_remove_spaces(const char *buf) {
 	return rv;
 }
 
+// parse a comma-separated list of CPU numbers, for example "0,2,4";
+// return the number of CPUs, or -1 if the list is invalid
+int profile_cpu_list(const char *str, int *cpu) {
+	assert(str);
+	assert(cpu);
+	int cnt = 0;
+	const char *ptr = str;
+	while (*ptr) {
+		char *end;
+		long val = strtol(ptr, &end, 10);
+		if (end == ptr || val < 0 || val >= CPU_SETSIZE || cnt >= WORKERS_MAX)
+			return -1;
+		cpu[cnt++] = (int) val;
+
+		if (*end == ',' && *(end + 1) != '\0')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		ptr = end;
+	}
+
+	return (cnt)? cnt: -1;
+}
+
+// return ENGINE_EPOLL or ENGINE_URING, 0 if the name is not recognized
+int profile_engine_id(const char *name) {
+	if (strcmp(name, "epoll") == 0)
+		return ENGINE_EPOLL;
+	if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+		return ENGINE_URING;
+	return 0;
+}
+
 static void profile_check_line(char *ptr, int lineno, const char *fname) {
+	if (strncmp(ptr, "batch ", 6) == 0) {
+		profile_batch = atoi(ptr + 6);
+		if (profile_batch < 1 || profile_batch > BATCH_MAX) {
+			fprintf(stderr, "Error: invalid batch size in %s line %d\n", fname, lineno);
+			exit(1);
+		}
+		return;
+	}
+
+	if (strncmp(ptr, "engine ", 7) == 0) {
+		profile_engine = profile_engine_id(ptr + 7);
+		if (profile_engine == 0) {
+			fprintf(stderr, "Error: invalid I/O engine in %s line %d\n", fname, lineno);
+			exit(1);
+		}
+		return;
+	}
+
+	if (strncmp(ptr, "cpus ", 5) == 0) {
+		profile_cpu_cnt = profile_cpu_list(ptr + 5, profile_cpu);
+		if (profile_cpu_cnt == -1) {
+			fprintf(stderr, "Error: invalid CPU list in %s line %d\n", fname, lineno);
+			exit(1);
+		}
+		return;
+	}
+
 	if (strcmp(ptr, "daemonize") == 0) {
 		arg_daemonize = 1;
 		return;
 	}
 
+	if (strcmp(ptr, "hugepages") == 0) {
+		arg_hugepages = 1;
+		return;
+	}
+
+	if (strcmp(ptr, "keycache") == 0) {
+		arg_keycache = 1;
+		return;
+	}
+
+	if (strcmp(ptr, "lowmem") == 0) {
+		arg_lowmem = 1;
+		return;
+	}
+
+	if (strcmp(ptr, "lz") == 0) {
+		arg_lz = 1;
+		return;
+	}
+
 	if (strncmp(ptr, "dns ", 4) == 0) {
 		dns_test(ptr + 4);
 		return;
@@ -119,6 +205,28 @@ static void profile_check_line(char *ptr, int lineno, const char *fname) {
 		return;
 	}
 
+	if (strncmp(ptr, "xdp ", 4) == 0) {
+		arg_xdp = strdup(ptr + 4);
+		if (!arg_xdp)
+			errExit("strdup");
+		return;
+	}
+
+	if (strcmp(ptr, "tso") == 0) {
+		arg_tso = 1;
+		return;
+	}
+
+	if (strcmp(ptr, "nogro") == 0) {
+		arg_nogro = 1;
+		return;
+	}
+
+	if (strcmp(ptr, "nogso") == 0) {
+		arg_nogso = 1;
+		return;
+	}
+
 	if (strcmp(ptr, "nonat") == 0) {
 		arg_nonat = 1;
 		return;
@@ -148,11 +256,27 @@ static void profile_check_line(char *ptr, int lineno, const char *fname) {
 		return;
 	}
 
+	if (strncmp(ptr, "plugin ", 7) == 0) {
+		profile_plugin = strdup(ptr + 7);
+		if (!profile_plugin)
+			errExit("strdup");
+		return;
+	}
+
 	if (strcmp(ptr, "server") == 0) {
 		arg_server = 1;
 		return;
 	}
 
+	if (strncmp(ptr, "workers ", 8) == 0) {
+		profile_workers = atoi(ptr + 8);
+		if (profile_workers < 1 || profile_workers > WORKERS_MAX) {
+			fprintf(stderr, "Error: invalid number of workers in %s line %d\n", fname, lineno);
+			exit(1);
+		}
+		return;
+	}
+
 	// forward compatiblitiy
 	fprintf(stderr, "Warning: \"%s\" profile entry not supported\n", ptr);
 }
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+
+// Bounded packet queue
+// - a ring of packet buffers taken from the worker pool at startup
+// - the producer reads packets directly in the free entries at the tail of the ring,
+//   and commits the ones that need to go out
+// - the consumer sends the entries at the head of the ring, and releases them once
+//   the kernel accepted them
+// - the entries own their buffers; moving an entry swaps the buffer pointers
+void queue_init(Queue *q, unsigned size, PacketPool *pool) {
+	assert(q);
+	assert(size);
+	memset(q, 0, sizeof(Queue));
+	q->entry = malloc(size * sizeof(QueueEntry));
+	if (!q->entry)
+		errExit("malloc");
+
+	unsigned i;
+	for (i = 0; i < size; i++) {
+		q->entry[i].mem = pool_get(pool);
+		q->entry[i].start = NULL;
+		q->entry[i].len = 0;
+	}
+	q->size = size;
+}
+
+// return the i-th free entry after the tail of the queue
+QueueEntry *queue_free_entry(Queue *q, unsigned i) {
+	assert(i < q->size - q->cnt);
+	return &q->entry[(q->head + q->cnt + i) % q->size];
+}
+
+// move the i-th free entry at the tail of the queue
+void queue_push(Queue *q, unsigned i) {
+	assert(i < q->size - q->cnt);
+	if (i) {
+		QueueEntry *tail = queue_free_entry(q, 0);
+		QueueEntry *e = queue_free_entry(q, i);
+		QueueEntry tmp = *tail;
+		*tail = *e;
+		*e = tmp;
+	}
+	q->cnt++;
+}
+
+// return the i-th entry from the head of the queue
+QueueEntry *queue_entry(Queue *q, unsigned i) {
+	assert(i < q->cnt);
+	return &q->entry[(q->head + i) % q->size];
+}
+
+// release n entries from the head of the queue
+void queue_pop(Queue *q, unsigned n) {
+	assert(n <= q->cnt);
+	q->head = (q->head + n) % q->size;
+	q->cnt -= n;
+}
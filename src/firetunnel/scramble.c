@@ -18,6 +18,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 #include "firetunnel.h"
+#include "blake2.h"
+#include <time.h>
 
 //**********************************************************************************
 // Skytale scrambler
@@ -37,7 +39,8 @@
 #define BLOCKLEN 8
 
 // transposition routine; same function is used for encoding and decoding
-static void skytale(uint8_t *in) {
+// this is the reference implementation, the kernels below are checked against it
+static void skytale_ref(uint8_t *in) {
 	uint8_t out[BLOCKLEN] = {0};
 	uint8_t *ptr = in;
 
@@ -53,12 +56,172 @@ static void skytale(uint8_t *in) {
 	memcpy(in, out, BLOCKLEN);
 }
 
+static void skytale_blocks_ref(uint8_t *ptr, int blocks) {
+	int i;
+	for (i = 0; i < blocks; i++)
+		skytale_ref(ptr + i * BLOCKLEN);
+}
+
+// The block is an 8x8 bit matrix, one byte in each row; the transposition moves bit i of
+// byte j to bit j of byte i. Loaded as a little endian 64-bit word, the bit 8j+i goes to 8i+j,
+// done in three steps swapping 1x1, 2x2 and 4x4 sub-matrices with masks and shifts.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SKYTALE_FAST
+#define M1 0x00aa00aa00aa00aaULL
+#define M2 0x0000cccc0000ccccULL
+#define M4 0x00000000f0f0f0f0ULL
+
+static inline uint64_t transpose8(uint64_t x) {
+	uint64_t t;
+	t = (x ^ (x >> 7)) & M1;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & M2;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & M4;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+static void skytale_blocks_scalar(uint8_t *ptr, int blocks) {
+	int i;
+	for (i = 0; i < blocks; i++, ptr += BLOCKLEN) {
+		uint64_t x;
+		memcpy(&x, ptr, BLOCKLEN);
+		x = transpose8(x);
+		memcpy(ptr, &x, BLOCKLEN);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SKYTALE_SIMD
+
+// the same steps on two blocks at a time
+#define SSE_SWAP(x, m, n) \
+	do { \
+		__m128i t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, n)), m); \
+		x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, n)); \
+	} while (0)
+
+__attribute__((target("sse2")))
+static void skytale_blocks_sse2(uint8_t *ptr, int blocks) {
+	const __m128i m1 = _mm_set1_epi64x(M1);
+	const __m128i m2 = _mm_set1_epi64x(M2);
+	const __m128i m4 = _mm_set1_epi64x(M4);
+	for (; blocks >= 2; blocks -= 2, ptr += 2 * BLOCKLEN) {
+		__m128i x = _mm_loadu_si128((const __m128i *) ptr);
+		SSE_SWAP(x, m1, 7);
+		SSE_SWAP(x, m2, 14);
+		SSE_SWAP(x, m4, 28);
+		_mm_storeu_si128((__m128i *) ptr, x);
+	}
+	skytale_blocks_scalar(ptr, blocks);
+}
+
+// four blocks at a time
+#define AVX_SWAP(x, m, n) \
+	do { \
+		__m256i t = _mm256_and_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, n)), m); \
+		x = _mm256_xor_si256(_mm256_xor_si256(x, t), _mm256_slli_epi64(t, n)); \
+	} while (0)
+
+__attribute__((target("avx2")))
+static void skytale_blocks_avx2(uint8_t *ptr, int blocks) {
+	const __m256i m1 = _mm256_set1_epi64x(M1);
+	const __m256i m2 = _mm256_set1_epi64x(M2);
+	const __m256i m4 = _mm256_set1_epi64x(M4);
+	for (; blocks >= 4; blocks -= 4, ptr += 4 * BLOCKLEN) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) ptr);
+		AVX_SWAP(x, m1, 7);
+		AVX_SWAP(x, m2, 14);
+		AVX_SWAP(x, m4, 28);
+		_mm256_storeu_si256((__m256i *) ptr, x);
+	}
+	skytale_blocks_sse2(ptr, blocks);
+}
+#endif // x86
+#endif // little endian
+
+typedef struct {
+	const char *name;
+	void (*fn)(uint8_t *ptr, int blocks);
+} SkytaleKernel;
+
+static SkytaleKernel skytale_kernels[] = {
+	{ "ref", skytale_blocks_ref },
+#ifdef SKYTALE_FAST
+	{ "scalar", skytale_blocks_scalar },
+#ifdef SKYTALE_SIMD
+	{ "sse2", skytale_blocks_sse2 },
+	{ "avx2", skytale_blocks_avx2 },
+#endif
+#endif
+	{ NULL, NULL }
+};
+
+static int skytale_supported(SkytaleKernel *k) {
+#ifdef SKYTALE_SIMD
+	if (strcmp(k->name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+	if (strcmp(k->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	(void) k;
+	return 1;
+}
+
+// return 0 if the kernel gives the same result as the reference implementation
+#define SELFTEST_BLOCKS 37
+static int skytale_selftest(SkytaleKernel *k) {
+	uint8_t ref[SELFTEST_BLOCKS * BLOCKLEN];
+	uint8_t buf[SELFTEST_BLOCKS * BLOCKLEN];
+	unsigned i;
+	for (i = 0; i < sizeof(ref); i++)
+		ref[i] = (uint8_t) (i * 151 + 17);
+	memcpy(buf, ref, sizeof(buf));
+
+	skytale_blocks_ref(ref, SELFTEST_BLOCKS);
+	k->fn(buf, SELFTEST_BLOCKS);
+	return memcmp(ref, buf, sizeof(buf))? -1: 0;
+}
+
+// throughput of the kernel in MB/s, the best of a few rounds on a full-size tunnel packet,
+// trailing block included
+#define BENCH_LEN 1500
+#define BENCH_LOOPS 1000
+#define BENCH_ROUNDS 3
+static unsigned skytale_bench(SkytaleKernel *k) {
+	uint8_t buf[BENCH_LEN];
+	memset(buf, 0x5a, sizeof(buf));
+
+	double best = 0;
+	int r;
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		int i;
+		for (i = 0; i < BENCH_LOOPS; i++) {
+			k->fn(buf, BENCH_LEN / BLOCKLEN);
+			k->fn(buf + BENCH_LEN - BLOCKLEN, 1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double usec = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+		if (r == 0 || usec < best)
+			best = usec;
+	}
+	if (best < 1)
+		best = 1;
+	return (unsigned) ((double) BENCH_LEN * BENCH_LOOPS / best);
+}
+
+static void (*skytale_blocks)(uint8_t *ptr, int blocks) = skytale_blocks_ref;
+
 #ifdef TESTING
 int arg_noscrambling = 0;
 #endif
 
 // scrambling function
-__attribute__((weak)) void scramble(uint8_t *ptr, int len, PacketHeader *hdr) {
+static void skytale_scramble(uint8_t *ptr, int len, PacketHeader *hdr) {
 	assert(ptr);
 	(void) hdr;
 
@@ -67,17 +230,15 @@ __attribute__((weak)) void scramble(uint8_t *ptr, int len, PacketHeader *hdr) {
 		return;
 
 	// padding: multiple of BLOCKLEN
-	int i;
-	for ( i = 0; i < (len / BLOCKLEN); i++)
-		skytale(ptr + i * BLOCKLEN);
+	skytale_blocks(ptr, len / BLOCKLEN);
 
 	if (len % BLOCKLEN)
-		skytale(ptr + len - BLOCKLEN);
+		skytale_blocks(ptr + len - BLOCKLEN, 1);
 
 }
 
 // descrambling function
-__attribute__((weak)) void descramble(uint8_t *ptr, int len, PacketHeader *hdr) {
+static void skytale_descramble(uint8_t *ptr, int len, PacketHeader *hdr) {
 	assert(ptr);
 	(void) hdr;
 
@@ -86,31 +247,186 @@ __attribute__((weak)) void descramble(uint8_t *ptr, int len, PacketHeader *hdr)
 		return;
 
 	if (len % BLOCKLEN)
-		skytale(ptr + len - BLOCKLEN);
+		skytale_blocks(ptr + len - BLOCKLEN, 1);
 
-	int i;
-	for ( i = 0; i < (len / BLOCKLEN); i++)
-		skytale(ptr + i * BLOCKLEN);
+	skytale_blocks(ptr, len / BLOCKLEN);
 }
 
-#ifdef TESTING
-#include <time.h>
+// the functions can be replaced at link time
+void scramble(uint8_t *ptr, int len, PacketHeader *hdr) __attribute__((weak, alias("skytale_scramble")));
+void descramble(uint8_t *ptr, int len, PacketHeader *hdr) __attribute__((weak, alias("skytale_descramble")));
+
+#ifndef TESTING
+//**********************************************************************************
+// Scrambling and BLAKE2 authentication in a single pass
+//**********************************************************************************
+// The data is processed in chunks of one BLAKE2 block: the chunk is transposed and hashed
+// while it is still in L1 cache. The result is the same as scramble() followed by get_hash(),
+// or get_hash() followed by descramble(). The trailing block of a data length not multiple
+// of BLOCKLEN overlaps the last full block:
+// - transmit: the bytes covered by the trailing block are hashed after its transposition
+// - receive: the trailing block is hashed first, then it is transposed, followed by
+//   the last full block
+#define FUSED_CHUNK (BLAKE2B_BLOCKBYTES / BLOCKLEN)	// skytale blocks in a chunk
+int scramble_fused = 0;	// the single-pass functions can be used, see scramble_init()
+
+static void fused_init(blake2b_state *S, PacketHeader *hdr) {
+	if (blake2b_init_state(S, KEY_LEN, get_hash_state(ntohl(hdr->timestamp), ntohs(hdr->seq))))
+		errExit("blake2");
+	blake2b_update(S, hdr, sizeof(PacketHeader));
+}
+
+// Scramble the len bytes of data following the packet header, the BLAKE2 tag goes after the data.
+void scramble_sign(PacketHeader *hdr, int len) {
+	uint8_t *ptr = (uint8_t *) (hdr + 1);
+	blake2b_state S[1];
+	fused_init(S, hdr);
+
+	int blocks = (arg_noscrambling || len < BLOCKLEN)? 0: len / BLOCKLEN;
+	int tail = blocks && (len % BLOCKLEN);
+	int safe = (tail)? len - BLOCKLEN: len;	// not modified by the trailing block
+	int done = 0;		// bytes hashed
+	int b = 0;
+	while (b < blocks) {
+		int cnt = (blocks - b < FUSED_CHUNK)? blocks - b: FUSED_CHUNK;
+		skytale_blocks(ptr + b * BLOCKLEN, cnt);
+		b += cnt;
+		int end = (b * BLOCKLEN < safe)? b * BLOCKLEN: safe;
+		if (end > done) {
+			blake2b_update(S, ptr + done, end - done);
+			done = end;
+		}
+	}
+	if (tail)
+		skytale_blocks(ptr + len - BLOCKLEN, 1);
+	if (len > done)
+		blake2b_update(S, ptr + done, len - done);
+	blake2b_final(S, ptr + len, KEY_LEN);
+}
+
+// Check the BLAKE2 tag of a received packet and descramble the len bytes of data following
+// the header; return AUTH_OK or AUTH_FAIL. The data is descrambled also if the tag is wrong.
+int descramble_verify(PacketHeader *hdr, int len) {
+	uint8_t *ptr = (uint8_t *) (hdr + 1);
+	blake2b_state S[1];
+	fused_init(S, hdr);
+
+	int blocks = (arg_noscrambling || len < BLOCKLEN)? 0: len / BLOCKLEN;
+	int tail = blocks && (len % BLOCKLEN);
+	int head = (tail)? blocks - 1: blocks;	// blocks not overlapping the trailing block
+	int done = 0;
+	int b = 0;
+	while (b < head) {
+		int cnt = (head - b < FUSED_CHUNK)? head - b: FUSED_CHUNK;
+		blake2b_update(S, ptr + done, (b + cnt) * BLOCKLEN - done);
+		done = (b + cnt) * BLOCKLEN;
+		skytale_blocks(ptr + b * BLOCKLEN, cnt);
+		b += cnt;
+	}
+	if (len > done)
+		blake2b_update(S, ptr + done, len - done);
+	uint8_t tag[KEY_LEN];
+	blake2b_final(S, tag, KEY_LEN);
+	if (tail) {
+		skytale_blocks(ptr + len - BLOCKLEN, 1);
+		skytale_blocks(ptr + head * BLOCKLEN, 1);
+	}
+
+	return (memcmp(ptr + len, tag, KEY_LEN) == 0)? AUTH_OK: AUTH_FAIL;
+}
+
+// return 0 if the single-pass functions give the same result as the two passes
+#define FUSED_TEST_LEN 300
+static int fused_selftest(void) {
+	uint8_t in[sizeof(PacketHeader) + FUSED_TEST_LEN + KEY_LEN];
+	uint8_t ref[sizeof(in)];
+	uint8_t buf[sizeof(in)];
+	unsigned i;
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = (uint8_t) (i * 29 + 3);
+
+	int len;
+	for (len = 1; len <= FUSED_TEST_LEN; len++) {
+		PacketHeader *hdr = (PacketHeader *) ref;
+		memcpy(ref, in, sizeof(ref));
+		skytale_scramble(ref + sizeof(PacketHeader), len, hdr);
+		get_hash(ref, sizeof(PacketHeader) + len, ntohl(hdr->timestamp), ntohs(hdr->seq),
+			 ref + sizeof(PacketHeader) + len);
+
+		memcpy(buf, in, sizeof(buf));
+		scramble_sign((PacketHeader *) buf, len);
+		if (memcmp(ref, buf, sizeof(buf)))
+			return -1;
+		if (descramble_verify((PacketHeader *) buf, len) != AUTH_OK ||
+		    memcmp(buf, in, sizeof(PacketHeader) + len))
+			return -1;
+
+		// a damaged packet
+		memcpy(buf, ref, sizeof(buf));
+		buf[sizeof(PacketHeader) + len / 2] ^= 1;
+		if (descramble_verify((PacketHeader *) buf, len) != AUTH_FAIL)
+			return -1;
+	}
+	return 0;
+}
+#endif
 
-// rtdsc timestamp on x86-64/amd64  processors
-static inline unsigned long long getticks(void) {
-#if defined(__x86_64__)
-	unsigned a, d;
-	asm volatile("rdtsc" : "=a" (a), "=d" (d));
-	return ((unsigned long long)a) | (((unsigned long long)d) << 32);
-#elif defined(__i386__)
-	unsigned long long ret;
-	__asm__ __volatile__("rdtsc" : "=A" (ret));
-	return ret;
-#else
-	return 0; // not implemented
+// Select the fastest skytale kernel supported by the CPU and passing the self-test, and check
+// the single-pass scramble and BLAKE2 functions. The keys should be initialized.
+void scramble_init(void) {
+	char msg[128];
+	char *ptr = msg;
+	*ptr = '\0';
+	SkytaleKernel *k;
+	SkytaleKernel *selected = NULL;
+	unsigned best_speed = 0;
+	for (k = skytale_kernels; k->name; k++) {
+		if (!skytale_supported(k))
+			continue;
+		if (k != skytale_kernels && skytale_selftest(k)) {
+			fprintf(stderr, "Warning: skytale %s self-test failed, kernel disabled\n", k->name);
+			continue;
+		}
+
+		unsigned speed = skytale_bench(k);
+		ptr += snprintf(ptr, msg + sizeof(msg) - ptr, "%s%s %u MB/s", (ptr == msg)? "": ", ", k->name, speed);
+		if (!selected || speed > best_speed) {
+			best_speed = speed;
+			selected = k;
+		}
+	}
+	skytale_blocks = selected->fn;
+	logmsg("Skytale kernel %s (%s)\n", selected->name, msg);
+
+#ifndef TESTING
+	// single pass only with the built-in scrambler
+	if (scramble == skytale_scramble && descramble == skytale_descramble && !arg_plugin) {
+		if (fused_selftest())
+			fprintf(stderr, "Warning: single-pass scramble and BLAKE2 self-test failed, disabled\n");
+		else
+			scramble_fused = 1;
+	}
 #endif
 }
 
+#ifdef TESTING
+// Throughput of the skytale kernels; the output of every kernel is checked against
+// the reference implementation byte for byte.
+//     gcc -O2 -DTESTING scramble.c -o skytale-bench && ./skytale-bench 1500
+int arg_debug = 0;
+
+void logmsg(char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+static double nsec_since(struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
 
 int main(int argc, char **argv) {
 	PacketHeader h;
@@ -121,61 +437,69 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	int buflen = atoi(argv[1]);
+	if (buflen < BLOCKLEN) {
+		printf("Error: the buffer should be at least %d bytes long\n", BLOCKLEN);
+		return 1;
+	}
 
 	uint8_t *buf = malloc(buflen);
 	uint8_t *buf_in = malloc(buflen);
-	uint8_t *buf_out = malloc(buflen);
-//	srand(time(NULL));
+	uint8_t *buf_ref = malloc(buflen);
+	if (!buf || !buf_in || !buf_ref)
+		errExit("malloc");
 
 	int i;
-	for (i = 0; i < buflen; i++) {
+	for (i = 0; i < buflen; i++)
 		buf_in[i] = (uint8_t) ( rand() % 256);
-		printf("%02x ", buf_in[i]);
-	}
-	printf("\n");
-
-	memcpy(buf, buf_in, buflen);
-	scramble(buf, buflen, &h);
-	for (i = 0; i < buflen; i++) {
-		printf("%02x ", buf[i]);
-	}
-	printf("\n");
 
-	memcpy(buf_out, buf, buflen);
-	descramble(buf_out, buflen, &h);
-
-	for (i = 0; i < buflen; i++) {
-		printf("%02x ", buf_out[i]);
-	}
-	printf("\n");
-	for (i = 0; i < buflen; i++) {
-		if (buf_out[i] != buf_in[i])
-			printf("error position %d\n", i);
-	}
+	// reference result
+	skytale_blocks = skytale_blocks_ref;
+	memcpy(buf_ref, buf_in, buflen);
+	scramble(buf_ref, buflen, &h);
 
-	// evaluate time
-	for (i = 0; i < buflen; i++) {
-		buf_in[i] = (uint8_t) ( rand() % 256);
-	}
+	// the kernel picked up at startup
+	scramble_init();
+	int rv = 0;
+	SkytaleKernel *k;
+	for (k = skytale_kernels; k->name; k++) {
+		if (!skytale_supported(k))
+			continue;
+		skytale_blocks = k->fn;
 
-	unsigned cnt = 10000;
-	unsigned long long tstart = getticks();
-	for (i = 0; i < cnt; i++)
+		// same wire format as the reference, and descramble() gives back the original data
+		memcpy(buf, buf_in, buflen);
 		scramble(buf, buflen, &h);
-	unsigned long long tend = getticks();
-	usleep(1000);
-	unsigned long long t1ms = getticks();
+		for (i = 0; i < buflen; i++) {
+			if (buf[i] != buf_ref[i]) {
+				printf("%s: scramble error position %d\n", k->name, i);
+				rv = 1;
+				break;
+			}
+		}
+		descramble(buf, buflen, &h);
+		for (i = 0; i < buflen; i++) {
+			if (buf[i] != buf_in[i]) {
+				printf("%s: descramble error position %d\n", k->name, i);
+				rv = 1;
+				break;
+			}
+		}
 
-	double delta = (double) (tend - tstart) / (double) (t1ms - tend);
-	double delta_packet = delta / cnt;
-	double delta_byte = (delta_packet * 1000) / buflen;
-	double rate = 8 / delta_byte;
-	printf("Skytale %d bytes: %f ms / packet, rate %f Mbps\n", buflen, delta_packet, rate);
+		// evaluate time
+		unsigned cnt = 100000;
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < (int) cnt; i++)
+			scramble(buf, buflen, &h);
+		double nsec = nsec_since(&t0) / cnt;
+		printf("Skytale %-6s %d bytes: %.1f ns / packet, rate %.0f Mbps\n",
+		       k->name, buflen, nsec, buflen * 8 / nsec * 1000);
+	}
 
 	free(buf);
 	free(buf_in);
-	free(buf_out);
+	free(buf_ref);
 
-	return 0;
+	return rv;
 }
 #endif
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#ifdef HAVE_URING
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Minimal io_uring support for the io_uring engine in child.c, using the system calls
+// directly; liburing is not required.
+// - one ring per worker, used only by the worker thread
+// - the submission queue entries are published when uring_submit() is called
+
+static inline unsigned load_acquire(unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned *p, unsigned v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// return 0 if the ring was created, -1 if io_uring is not available
+int uring_init(Uring *r, unsigned entries, unsigned cq_entries) {
+	memset(r, 0, sizeof(Uring));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	// submission and completion rings share the same mapping
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring_len = (sq_len > cq_len)? sq_len: cq_len;
+	r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQ_RING);
+	if (r->ring == MAP_FAILED)
+		errExit("mmap");
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		errExit("mmap");
+
+	uint8_t *ptr = r->ring;
+	r->sq_head = (unsigned *) (ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *) (ptr + p.sq_off.tail);
+	r->sq_array = (unsigned *) (ptr + p.sq_off.array);
+	r->sq_mask = *(unsigned *) (ptr + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned *) (ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *) (ptr + p.cq_off.tail);
+	r->cqes = (struct io_uring_cqe *) (ptr + p.cq_off.cqes);
+	r->cq_mask = *(unsigned *) (ptr + p.cq_off.ring_mask);
+	r->local_tail = *r->sq_tail;
+	return 0;
+}
+
+void uring_free(Uring *r) {
+	munmap(r->sqes, r->sqes_len);
+	munmap(r->ring, r->ring_len);
+	close(r->fd);
+	memset(r, 0, sizeof(Uring));
+	r->fd = -1;
+}
+
+int uring_register(Uring *r, unsigned opcode, void *arg, unsigned nr) {
+	return syscall(__NR_io_uring_register, r->fd, opcode, arg, nr);
+}
+
+// Return a zeroed submission queue entry. If the queue is full, the pending entries are
+// submitted first.
+struct io_uring_sqe *uring_sqe(Uring *r) {
+	while (r->local_tail - load_acquire(r->sq_head) >= r->sq_entries) {
+		if (uring_submit(r, 0) == -1 && errno != EINTR && errno != EBUSY)
+			errExit("io_uring_enter");
+	}
+
+	unsigned index = r->local_tail & r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	r->local_tail++;
+	return sqe;
+}
+
+// Submit the pending entries and wait for at least wait completions.
+// Return the number of entries submitted, -1 if error.
+int uring_submit(Uring *r, unsigned wait) {
+	unsigned pending = r->local_tail - *r->sq_tail;
+	store_release(r->sq_tail, r->local_tail);
+	if (pending == 0 && wait == 0)
+		return 0;
+	return syscall(__NR_io_uring_enter, r->fd, pending, wait,
+		       (wait)? IORING_ENTER_GETEVENTS: 0, NULL, 0);
+}
+
+// return the next completion queue entry, or NULL if the queue is empty
+struct io_uring_cqe *uring_cqe(Uring *r) {
+	unsigned head = *r->cq_head;
+	if (head == load_acquire(r->cq_tail))
+		return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(Uring *r) {
+	store_release(r->cq_head, *r->cq_head + 1);
+}
+
+// Provided buffer ring for the multishot receive; return 0 if done, -1 if not supported
+int uring_bufring_init(Uring *r, UringBufRing *b, unsigned entries, int bgid) {
+	assert((entries & (entries - 1)) == 0);
+	memset(b, 0, sizeof(UringBufRing));
+	b->len = entries * sizeof(struct io_uring_buf);
+	b->br = mmap(NULL, b->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED)
+		errExit("mmap");
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) b->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(b->br, b->len);
+		return -1;
+	}
+	b->mask = entries - 1;
+	b->bgid = bgid;
+	return 0;
+}
+
+// queue a buffer, it goes to the kernel on the next uring_bufring_commit()
+void uring_bufring_add(UringBufRing *b, void *addr, unsigned len, uint16_t bid) {
+	struct io_uring_buf *buf = &b->br->bufs[(b->tail + b->added) & b->mask];
+	buf->addr = (uint64_t) (uintptr_t) addr;
+	buf->len = len;
+	buf->bid = bid;
+	b->added++;
+}
+
+void uring_bufring_commit(UringBufRing *b) {
+	if (b->added == 0)
+		return;
+	b->tail += b->added;
+	b->added = 0;
+	__atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+#endif // HAVE_URING
@@ -26,25 +26,40 @@ void usage(void) {
 	printf("    server-ip-address - the IP address of the server\n");
 	printf("\n");
 	printf("Options:\n");
+	printf("   --batch=number - number of packets processed in one system call, default 32\n");
 	printf("   --bridge=device - use this Linux bridge device\n");
+	printf("   --cpus=cpu,cpu - pin the worker threads on these CPUs\n");
 	printf("   --daemonize - detach from the controlling terminal and run as a Unix\n");
 	printf("\tdaemon\n");
 	printf("   --debug, --debug-compress - print debug information\n");
 	printf("   --defaultgw=address - tunnel default gateway address, default 10.10.20.1\n");
 	printf("   --dns=address - add this DNS server to the list of servers\n");
+	printf("   --engine=epoll|uring - I/O engine for the data path, default epoll\n");
 	printf("   --help, ? - this help screen\n");
+	printf("   --hugepages - allocate the packet buffers on hugepages\n");
+	printf("   --keycache - keep the keys derived from the secret file in /run/firetunnel\n");
+	printf("   --lowmem - derive the keys on demand, for systems short on memory\n");
+	printf("   --lz - compress the payload of the packets going out, skipping\n");
+	printf("\tcompressed and encrypted data\n");
 	printf("   --mtu=number - maximum transmission uint for interfaces inside the tunnel\n");
 	printf("\tdefault 1434\n");
 	printf("   --netaddr=address - tunnel network address, default 10.10.20.0\n");
 	printf("   --netmask=mask - tunnel network mask, default 255.255.255.0\n");
+	printf("   --nogro - UDP receive coalescing disabled\n");
+	printf("   --nogso - UDP segmentation offload disabled\n");
 	printf("   --nonat - network address translation disabled\n");
 	printf("   --noscrambling - scrambling disabled, the packets are sent in clear\n");
 	printf("   --noseccomp - disable seccomp\n");
+	printf("   --plugin=filename - replace the built-in scrambler with this shared library\n");
 	printf("   --port=number - UDP server port number, default 1119\n");
 	printf("   --profile=filename - load the configuration from the profile file\n");
 	printf("   --server - run as a server for the tunnel; without this option the program\n");
 	printf("\truns as a client\n");
+	printf("   --tso - tap device offloads, TCP segmentation done by firetunnel\n");
 	printf("   --version - software version\n");
+	printf("   --workers=number - number of worker threads and tap queues, default 1\n");
+	printf("   --xdp=device - receive and send the tunnel packets on an AF_XDP socket\n");
+	printf("\ton this network interface\n");
 	printf("\n");
 }
 
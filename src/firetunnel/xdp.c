@@ -0,0 +1,485 @@
+/*
+ * Copyright (C) 2018 Firetunnel Authors
+ *
+ * This file is part of firetunnel project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "firetunnel.h"
+#include <errno.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// AF_XDP fast path (--xdp)
+// - a small XDP program attached to the network interface redirects the IPv4 UDP packets
+//   for our port to an AF_XDP socket; everything else goes up the regular network stack
+// - one AF_XDP socket for each worker, bound to the receive queue with the same number;
+//   the packets arriving on the other queues are passed to the stack, they end up on the
+//   regular UDP socket
+// - the program is loaded and attached with the bpf() system call, libbpf is not required;
+//   it is attached with a BPF link, the kernel removes it when firetunnel exits
+// - copy mode: the kernel copies the frames in and out of UMEM, this works with any driver,
+//   including veth and the generic (SKB) XDP mode
+// - the frames sent on the socket carry our own Ethernet/IP/UDP headers; the addresses are
+//   learned from the packets received from the peer (XdpRoute in Peer), until then the
+//   packets for the peer go out on the UDP socket
+// - the setup runs in the parent process before the child is started and seccomp'ed;
+//   UMEM is a shared mapping, the parent and the child see the same frames
+static int xdp_mapfd = -1;	// XSKMAP: receive queue -> AF_XDP socket
+static int xdp_linkfd = -1;
+
+static inline unsigned load_acquire(unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned *p, unsigned v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+	((struct bpf_insn) { .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+#define LDX(SIZE, DST, SRC, OFF) INSN(BPF_LDX | BPF_MEM | (SIZE), DST, SRC, OFF, 0)
+#define JUMP_PASS 0x7fff	// jump to the XDP_PASS exit, the offset is fixed up after assembly
+#define JNE_PASS(DST, IMM) INSN(BPF_JMP | BPF_JNE | BPF_K, DST, 0, JUMP_PASS, IMM)
+
+// load the XDP program for this UDP port (host byte order); return the program descriptor, -1 if error
+static int xdp_prog_load(int port) {
+	// the 16-bit loads return the bytes in network order, the constants are compared with htons()
+	struct bpf_insn prog[] = {
+		// r2 = ctx->data, r3 = ctx->data_end
+		LDX(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data)),
+		LDX(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end)),
+		// room for Ethernet + IPv4 + UDP headers
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_HDR_LEN),
+		INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, JUMP_PASS, 0),
+		// IPv4 without options
+		LDX(BPF_H, BPF_REG_5, BPF_REG_2, 12),
+		JNE_PASS(BPF_REG_5, htons(0x0800)),
+		LDX(BPF_B, BPF_REG_5, BPF_REG_2, 14),
+		JNE_PASS(BPF_REG_5, 0x45),
+		// UDP, fragments are reassembled by the stack
+		LDX(BPF_B, BPF_REG_5, BPF_REG_2, 23),
+		JNE_PASS(BPF_REG_5, IPPROTO_UDP),
+		LDX(BPF_H, BPF_REG_5, BPF_REG_2, 20),
+		INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff)),
+		JNE_PASS(BPF_REG_5, 0),
+		// destination port
+		LDX(BPF_H, BPF_REG_5, BPF_REG_2, 36),
+		JNE_PASS(BPF_REG_5, htons(port)),
+		// return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)
+		LDX(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index)),
+		INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xdp_mapfd),
+		INSN(0, 0, 0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		// everything else goes to the network stack
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	int cnt = sizeof(prog) / sizeof(prog[0]);
+	int pass = cnt - 2;
+	int i;
+	for (i = 0; i < cnt; i++) {
+		if (BPF_CLASS(prog[i].code) == BPF_JMP && prog[i].off == JUMP_PASS)
+			prog[i].off = pass - i - 1;
+	}
+
+	static char log[4096];
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uint64_t) (uintptr_t) prog;
+	attr.insn_cnt = cnt;
+	attr.license = (uint64_t) (uintptr_t) "GPL";
+	if (arg_debug) {
+		attr.log_buf = (uint64_t) (uintptr_t) log;
+		attr.log_size = sizeof(log);
+		attr.log_level = 1;
+	}
+	int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd == -1 && arg_debug)
+		fprintf(stderr, "%s\n", log);
+	return fd;
+}
+
+static int xsk_ring_map(XskRing *r, int fd, struct xdp_ring_offset *off, size_t elem, uint64_t pgoff) {
+	r->map_len = off->desc + XSK_RING_SIZE * elem;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (r->map == MAP_FAILED)
+		return -1;
+	uint8_t *ptr = r->map;
+	r->producer = (unsigned *) (ptr + off->producer);
+	r->consumer = (unsigned *) (ptr + off->consumer);
+	r->desc = ptr + off->desc;
+	r->mask = XSK_RING_SIZE - 1;
+	r->local = *r->producer;
+	return 0;
+}
+
+static void xsk_close(Xsk *x) {
+	XskRing *rings[] = { &x->fill, &x->comp, &x->rx, &x->tx };
+	unsigned i;
+	for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+		if (rings[i]->map)
+			munmap(rings[i]->map, rings[i]->map_len);
+	}
+	close(x->fd);
+	munmap(x->umem, XSK_FRAMES * XSK_FRAME_SIZE);
+	free(x->tx_free);
+	free(x);
+}
+
+// open an AF_XDP socket on this receive queue; return NULL if error
+static Xsk *xsk_open(int ifindex, int queue, uint16_t port) {
+	Xsk *x = malloc(sizeof(Xsk));
+	if (!x)
+		errExit("malloc");
+	memset(x, 0, sizeof(Xsk));
+	x->queue = queue;
+	x->port = port;
+	x->tx_free = malloc(XSK_RING_SIZE * sizeof(uint64_t));
+	if (!x->tx_free)
+		errExit("malloc");
+
+	// UMEM: the first XSK_RING_SIZE frames are used for receiving, the rest for sending
+	x->umem = mmap(NULL, XSK_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (x->umem == MAP_FAILED)
+		errExit("mmap");
+
+	x->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (x->fd == -1) {
+		munmap(x->umem, XSK_FRAMES * XSK_FRAME_SIZE);
+		free(x->tx_free);
+		free(x);
+		return NULL;
+	}
+
+	struct xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uint64_t) (uintptr_t) x->umem;
+	reg.len = XSK_FRAMES * XSK_FRAME_SIZE;
+	reg.chunk_size = XSK_FRAME_SIZE;
+	int size = XSK_RING_SIZE;
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1 ||
+	    getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1)
+		goto errout;
+
+	if (xsk_ring_map(&x->fill, x->fd, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+	    xsk_ring_map(&x->comp, x->fd, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+	    xsk_ring_map(&x->rx, x->fd, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+	    xsk_ring_map(&x->tx, x->fd, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1)
+		goto errout;
+
+	// all the receive frames go to the kernel
+	uint64_t *fill = x->fill.desc;
+	unsigned i;
+	for (i = 0; i < XSK_RING_SIZE; i++)
+		fill[i] = (uint64_t) i * XSK_FRAME_SIZE;
+	store_release(x->fill.producer, XSK_RING_SIZE);
+	for (i = 0; i < XSK_RING_SIZE; i++)
+		x->tx_free[i] = (uint64_t) (XSK_RING_SIZE + i) * XSK_FRAME_SIZE;
+	x->tx_free_cnt = XSK_RING_SIZE;
+
+	struct sockaddr_xdp sxdp;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_COPY;
+	if (bind(x->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) == -1)
+		goto errout;
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	uint32_t key = queue;
+	uint32_t value = x->fd;
+	attr.map_fd = xdp_mapfd;
+	attr.key = (uint64_t) (uintptr_t) &key;
+	attr.value = (uint64_t) (uintptr_t) &value;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+		goto errout;
+	return x;
+
+errout:;
+	int err = errno;
+	xsk_close(x);
+	errno = err;
+	return NULL;
+}
+
+// Set up the AF_XDP fast path on interface ifname, for the local port of the UDP socket udpfd.
+// One socket is opened for each worker in xsk[]; the workers without a receive queue on this
+// interface get NULL. If AF_XDP is not available, a warning is printed and all the traffic
+// stays on the UDP sockets. Return the number of AF_XDP sockets opened.
+int xdp_open(const char *ifname, int udpfd, Xsk **xsk, int workers) {
+	memset(xsk, 0, workers * sizeof(Xsk *));
+	int q;
+	int ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		fprintf(stderr, "Error: cannot find network interface %s\n", ifname);
+		exit(1);
+	}
+
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(udpfd, (struct sockaddr *) &addr, &len) == -1)
+		errExit("getsockname");
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = WORKERS_MAX;
+	xdp_mapfd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xdp_mapfd == -1)
+		goto errout;
+
+	int progfd = xdp_prog_load(ntohs(addr.sin_port));
+	if (progfd == -1)
+		goto errout;
+
+	// native mode if the driver supports XDP, generic mode otherwise
+	static const struct {
+		unsigned flags;
+		const char *name;
+	} modes[] = {
+		{ XDP_FLAGS_DRV_MODE, "native" },
+		{ XDP_FLAGS_SKB_MODE, "generic" }
+	};
+	const char *mode = NULL;
+	unsigned i;
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]) && xdp_linkfd == -1; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd = progfd;
+		attr.link_create.target_ifindex = ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = modes[i].flags;
+		xdp_linkfd = sys_bpf(BPF_LINK_CREATE, &attr);
+		mode = modes[i].name;
+	}
+	close(progfd);	// the link holds a reference to the program
+	if (xdp_linkfd == -1)
+		goto errout;
+
+	int cnt = 0;
+	for (q = 0; q < workers; q++) {
+		xsk[q] = xsk_open(ifindex, q, addr.sin_port);
+		if (xsk[q])
+			cnt++;
+		else if (q == 0)
+			goto errout;
+		else
+			dbg_printf("no AF_XDP socket for worker %d: %s\n", q, strerror(errno));
+	}
+
+	logmsg("AF_XDP enabled on %s, %s mode, %d queue%s\n", ifname, mode, cnt, (cnt > 1)? "s": "");
+	return cnt;
+
+errout:
+	fprintf(stderr, "Warning: AF_XDP not available on %s (%s), using the UDP socket\n",
+		ifname, strerror(errno));
+	for (q = 0; q < workers; q++) {
+		if (xsk[q])
+			xsk_close(xsk[q]);
+		xsk[q] = NULL;
+	}
+	if (xdp_linkfd != -1)
+		close(xdp_linkfd);
+	if (xdp_mapfd != -1)
+		close(xdp_mapfd);
+	xdp_linkfd = -1;
+	xdp_mapfd = -1;
+	return 0;
+}
+
+// return the number of frames waiting in the receive ring, up to max
+unsigned xsk_rx_peek(Xsk *x, unsigned max) {
+	unsigned n = load_acquire(x->rx.producer) - *x->rx.consumer;
+	return (n < max)? n: max;
+}
+
+// frame i of the frames returned by xsk_rx_peek()
+uint8_t *xsk_rx_frame(Xsk *x, unsigned i, unsigned *len) {
+	struct xdp_desc *d = (struct xdp_desc *) x->rx.desc + ((*x->rx.consumer + i) & x->rx.mask);
+	*len = d->len;
+	return x->umem + d->addr;
+}
+
+// done with the first n frames in the receive ring, they go back to the kernel in the fill ring
+void xsk_rx_release(Xsk *x, unsigned n) {
+	unsigned cons = *x->rx.consumer;
+	unsigned prod = *x->fill.producer;
+	uint64_t *fill = x->fill.desc;
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		struct xdp_desc *d = (struct xdp_desc *) x->rx.desc + ((cons + i) & x->rx.mask);
+		fill[(prod + i) & x->fill.mask] = d->addr & ~((uint64_t) XSK_FRAME_SIZE - 1);
+	}
+	store_release(x->fill.producer, prod + n);
+	store_release(x->rx.consumer, cons + n);
+}
+
+// return a free transmit frame, NULL if all the frames are in flight
+uint8_t *xsk_tx_alloc(Xsk *x) {
+	if (x->tx_free_cnt == 0) {
+		// frames already sent by the kernel
+		unsigned cons = *x->comp.consumer;
+		unsigned n = load_acquire(x->comp.producer) - cons;
+		uint64_t *comp = x->comp.desc;
+		unsigned i;
+		for (i = 0; i < n; i++)
+			x->tx_free[x->tx_free_cnt++] = comp[(cons + i) & x->comp.mask];
+		store_release(x->comp.consumer, cons + n);
+		if (x->tx_free_cnt == 0)
+			return NULL;
+	}
+	return x->umem + x->tx_free[--x->tx_free_cnt];
+}
+
+// queue a frame, it goes out on the next xsk_tx_kick(); the ring has room for all the frames
+void xsk_tx_push(Xsk *x, uint8_t *frame, unsigned len) {
+	struct xdp_desc *d = (struct xdp_desc *) x->tx.desc + (x->tx.local & x->tx.mask);
+	d->addr = frame - x->umem;
+	d->len = len;
+	d->options = 0;
+	x->tx.local++;
+}
+
+// Publish the frames queued and have the kernel send them. In copy mode a single sendto()
+// sends a limited number of frames. Return the number of frames still waiting in the ring.
+unsigned xsk_tx_kick(Xsk *x) {
+	if (*x->tx.producer != x->tx.local)
+		store_release(x->tx.producer, x->tx.local);
+
+	int i;
+	for (i = 0; i < XSK_KICK_MAX; i++) {
+		if (load_acquire(x->tx.consumer) == x->tx.local)
+			return 0;
+		// EAGAIN, EBUSY, ENOBUFS: the device is busy, we try again on the next call
+		if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 && errno != EINTR)
+			break;
+	}
+	return x->tx.local - load_acquire(x->tx.consumer);
+}
+
+// Check the Ethernet/IPv4/UDP headers of a frame received on the AF_XDP socket. Return the
+// UDP payload and its length in *len, the source address in addr and the way back to the
+// sender in route; NULL if the frame is not valid.
+uint8_t *xdp_parse(uint8_t *frame, unsigned flen, struct sockaddr_in *addr, XdpRoute *route, int *len) {
+	// the XDP program checked the protocols and the IP header length
+	if (flen < XDP_HDR_LEN)
+		return NULL;
+	uint8_t *ip = frame + 14;
+	uint8_t *udp = ip + 20;
+	uint16_t iplen;
+	uint16_t udplen;
+	memcpy(&iplen, ip + 2, 2);
+	memcpy(&udplen, udp + 4, 2);
+	iplen = ntohs(iplen);
+	udplen = ntohs(udplen);
+	// short frames are padded by the sender
+	if (iplen < 20 + 8 || 14u + iplen > flen || udplen < 8 || udplen > iplen - 20)
+		return NULL;
+	if (csum_fold(csum_add(0, ip, 20)) != 0)
+		return NULL;
+	// the UDP checksum is not verified, the payload is authenticated by BLAKE2
+
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	memcpy(&addr->sin_addr.s_addr, ip + 12, 4);
+	memcpy(&addr->sin_port, udp, 2);
+
+	memcpy(route->mac, frame + 6, 6);
+	memcpy(route->mac + 6, frame, 6);
+	memcpy(&route->saddr, ip + 16, 4);
+	route->valid = 1;
+
+	*len = udplen - 8;
+	return udp + 8;
+}
+
+// Build a UDP packet for dst in a transmit frame, the payload is copied after the headers.
+// Return the length of the frame.
+unsigned xdp_build(Xsk *x, uint8_t *frame, XdpRoute *route, struct sockaddr_in *dst,
+		   const uint8_t *payload, int len) {
+	uint16_t v;
+	memcpy(frame, route->mac, 12);
+	frame[12] = 0x08;	// IPv4
+	frame[13] = 0x00;
+
+	uint8_t *ip = frame + 14;
+	ip[0] = 0x45;
+	ip[1] = 0;
+	v = htons(20 + 8 + len);
+	memcpy(ip + 2, &v, 2);
+	v = htons(x->ip_id++);
+	memcpy(ip + 4, &v, 2);
+	v = htons(0x4000);	// don't fragment
+	memcpy(ip + 6, &v, 2);
+	ip[8] = 64;		// ttl
+	ip[9] = IPPROTO_UDP;
+	memset(ip + 10, 0, 2);
+	memcpy(ip + 12, &route->saddr, 4);
+	memcpy(ip + 16, &dst->sin_addr.s_addr, 4);
+	v = csum_fold(csum_add(0, ip, 20));
+	memcpy(ip + 10, &v, 2);
+
+	uint8_t *udp = ip + 20;
+	memcpy(udp, &x->port, 2);
+	memcpy(udp + 2, &dst->sin_port, 2);
+	v = htons(8 + len);
+	memcpy(udp + 4, &v, 2);
+	memset(udp + 6, 0, 2);
+	memcpy(udp + 8, payload, len);
+
+	// pseudo-header: addresses, protocol, UDP length
+	uint32_t sum = csum_add(0, ip + 12, 8);
+	sum += htons(IPPROTO_UDP);
+	sum += htons(8 + len);
+	v = csum_fold(csum_add(sum, udp, 8 + len));
+	if (v == 0)
+		v = 0xffff;
+	memcpy(udp + 6, &v, 2);
+
+	return XDP_HDR_LEN + len;
+}
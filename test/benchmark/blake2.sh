@@ -0,0 +1,22 @@
+#!/bin/bash
+# This file is part of Firetunnel project
+# Copyright (C) 2018 Firetunnel Authors
+# License GPL v2
+#
+# Per-packet cost of the BLAKE2 tag by packet size: the keyed hash initialized for every
+# packet, the hash starting from the precomputed key state, and the multi-buffer hash of
+# a batch of packets; then the memory and the per-packet cost of the key tables against the
+# keys derived on demand (--lowmem). The benchmark is the TESTING build of
+# src/firetunnel/secret.c, the keys are derived from a random digest.
+#     ./blake2.sh
+
+SRC=$(dirname "$0")/../../src/firetunnel
+BIN=/tmp/ftbench-blake2
+
+cd $SRC || exit 1
+if ! gcc -O2 -DTESTING -DSYSCONFDIR='"/etc/firetunnel"' secret.c blake2b-ref.c blake2b-simd.c log.c -o $BIN -lpthread; then
+	echo "Error: cannot build the benchmark"
+	exit 1
+fi
+$BIN
+rm -f $BIN
@@ -0,0 +1,112 @@
+#!/bin/bash
+# This file is part of Firetunnel project
+# Copyright (C) 2018 Firetunnel Authors
+# License GPL v2
+#
+# Compare the I/O engines on the same traffic. The server and the client run in two network
+# namespaces connected by a veth pair, and iperf3 pushes TCP traffic through the tunnel.
+# For each engine we report the throughput, the tunnel packet rate, the CPU time and the
+# context switches per packet, added up for both ends of the tunnel.
+#
+# Run it as root; iperf3 is required. All the firetunnel processes running on the
+# system are stopped.
+#     ./engine.sh [seconds] [firetunnel options]
+
+SECS=${1:-20}
+shift
+OPTS="$@"
+FT=${FIRETUNNEL:-firetunnel}
+NS1=ftbench-srv
+NS2=ftbench-cli
+
+cleanup() {
+	pkill -x firetunnel
+	pkill -x iperf3
+	sleep 1
+	ip netns del $NS1 2>/dev/null
+	ip netns del $NS2 2>/dev/null
+}
+
+# CPU time in clock ticks and context switches for all firetunnel processes
+cpu_ticks() {
+	local total=0
+	for pid in $(pgrep -x firetunnel); do
+		local t=$(awk '{print $14 + $15}' /proc/$pid/stat)
+		total=$((total + t))
+	done
+	echo $total
+}
+
+ctx_switches() {
+	local total=0
+	for pid in $(pgrep -x firetunnel); do
+		local c=$(cat /proc/$pid/task/*/status | awk '/ctxt_switches/ {s += $2} END {print s}')
+		total=$((total + c))
+	done
+	echo $total
+}
+
+# frames going in and out of the tunnel on the client tap device; the UDP packets on the
+# veth are not counted, with segmentation offload a packet carries several datagrams
+tap_packets() {
+	ip netns exec $NS2 sh -c 'for d in /sys/class/net/*; do
+		[ -e $d/tun_flags ] && echo $(($(cat $d/statistics/rx_packets) + $(cat $d/statistics/tx_packets)))
+	done' | head -1
+}
+
+if [ "$(id -u)" != "0" ]; then
+	echo "Error: run the benchmark as root"
+	exit 1
+fi
+if ! which iperf3 > /dev/null; then
+	echo "Error: iperf3 not found"
+	exit 1
+fi
+
+cleanup
+ip netns add $NS1
+ip netns add $NS2
+ip link add ftb0 type veth peer name ftb1
+ip link set ftb0 netns $NS1
+ip link set ftb1 netns $NS2
+ip netns exec $NS1 ip addr add 192.168.199.1/24 dev ftb0
+ip netns exec $NS2 ip addr add 192.168.199.2/24 dev ftb1
+for ns in $NS1 $NS2; do
+	ip netns exec $ns ip link set lo up
+done
+ip netns exec $NS1 ip link set ftb0 up
+ip netns exec $NS2 ip link set ftb1 up
+
+printf "%-8s %10s %10s %12s %14s\n" "engine" "Mbit/s" "kpps" "cpu us/pkt" "ctxsw/1000pkt"
+for engine in epoll uring; do
+	ip netns exec $NS1 $FT --server --nonat --noseccomp --engine=$engine $OPTS > /tmp/ftbench-srv.log 2>&1 &
+	for i in $(seq 1 40); do grep -q "fts updated" /tmp/ftbench-srv.log && break; sleep 0.25; done
+	ip netns exec $NS2 $FT --noseccomp --engine=$engine $OPTS 192.168.199.1 > /tmp/ftbench-cli.log 2>&1 &
+	for i in $(seq 1 60); do grep -q "ftc updated" /tmp/ftbench-cli.log && break; sleep 0.25; done
+	if ! grep -q "ftc updated" /tmp/ftbench-cli.log; then
+		echo "Error: $engine tunnel not connected, see /tmp/ftbench-srv.log and /tmp/ftbench-cli.log"
+		cleanup
+		exit 1
+	fi
+
+	# the client bridge has no address, the sandboxes normally use it
+	ip netns exec $NS2 ip addr replace 10.10.20.2/24 dev ftc
+	ip netns exec $NS1 iperf3 -s -D -B 10.10.20.1
+	sleep 1
+
+	t0=$(cpu_ticks); c0=$(ctx_switches); p0=$(tap_packets)
+	mbps=$(ip netns exec $NS2 iperf3 -c 10.10.20.1 -t $SECS -f m | awk '/receiver/ {print $(NF-2)}')
+	t1=$(cpu_ticks); c1=$(ctx_switches); p1=$(tap_packets)
+
+	pkts=$((p1 - p0))
+	[ $pkts -eq 0 ] && pkts=1
+	hz=$(getconf CLK_TCK)
+	awk -v e=$engine -v m="$mbps" -v p=$pkts -v s=$SECS -v t=$((t1 - t0)) -v hz=$hz -v c=$((c1 - c0)) \
+		'BEGIN {printf "%-8s %10s %10.1f %12.2f %14.1f\n", e, m, p / s / 1000, t * 1e6 / hz / p, c * 1000 / p}'
+
+	pkill -x iperf3
+	pkill -x firetunnel
+	sleep 2
+done
+
+cleanup